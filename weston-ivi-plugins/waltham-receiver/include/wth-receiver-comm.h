@@ -42,10 +42,12 @@
 #include <sys/epoll.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <assert.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <GLES/gl.h>
 #include <GLES2/gl2.h>
@@ -65,6 +67,7 @@ struct client;
 struct window;
 struct pointer;
 struct touch;
+struct _GstAppContext;
 static int verbose = 0;
 
 const struct wth_display_interface display_implementation;
@@ -91,6 +94,31 @@ void receiver_accept_client(struct receiver *srv);
 */
 void receiver_flush_clients(struct receiver *srv);
 
+/**
+* receiver_prepare_surfaces
+*
+* Dispatch the pending local compositor events of all displayed surfaces
+* and prepare to read their wayland sockets. Called before going to sleep.
+*
+* @param names        struct receiver *srv
+* @param value        socket connection info and client data
+* @return             none
+*/
+void receiver_prepare_surfaces(struct receiver *srv);
+
+/**
+* receiver_dispatch_surfaces
+*
+* Read and dispatch the local compositor events of all surfaces prepared
+* by receiver_prepare_surfaces(). Called right after waking up, before any
+* other event is handled.
+*
+* @param names        struct receiver *srv
+* @param value        socket connection info and client data
+* @return             none
+*/
+void receiver_dispatch_surfaces(struct receiver *srv);
+
 /**
 * client_destroy
 *
@@ -190,6 +218,171 @@ void waltham_pointer_button(struct window *window, uint32_t serial,
 void waltham_pointer_axis(struct window *window, uint32_t time,
              uint32_t axis, wl_fixed_t value);
 
+/**
+* waltham_pointer_axis_source
+*
+* Send pointer axis source event received from weston to waltham client,
+* with the axis events of the same pointer frame
+*
+* @param names        struct window *window
+*             uint32_t axis_source
+* @param value        window - window information
+*             axis_source - wheel, finger, continuous or wheel tilt
+* @return             none
+*/
+void waltham_pointer_axis_source(struct window *window, uint32_t axis_source);
+
+/**
+* waltham_pointer_axis_stop
+*
+* Send pointer axis stop event received from weston to waltham client,
+* with the axis events of the same pointer frame
+*
+* @param names        struct window *window
+*             uint32_t time
+*             uint32_t axis
+* @param value        window - window information
+*             time   - timestamp with millisecond granularity
+*             axis   - the axis that stopped scrolling
+* @return             none
+*/
+void waltham_pointer_axis_stop(struct window *window, uint32_t time,
+             uint32_t axis);
+
+/**
+* waltham_pointer_axis_discrete
+*
+* Send pointer axis discrete event received from weston to waltham
+* client, with the axis events of the same pointer frame
+*
+* @param names        struct window *window
+*             uint32_t axis
+*             int32_t discrete
+* @param value        window - window information
+*             axis     - axis type
+*             discrete - number of wheel steps
+* @return             none
+*/
+void waltham_pointer_axis_discrete(struct window *window, uint32_t axis,
+             int32_t discrete);
+
+/**
+* waltham_pointer_frame
+*
+* Send the pointer motion coalesced since the last pointer frame event
+* received from weston, then the frame, to waltham client
+*
+* @param names        struct window *window
+* @param value        window - window information
+* @return             none
+*/
+void waltham_pointer_frame(struct window *window);
+
+/**
+* waltham_keyboard_keymap
+*
+* Share the keymap received from weston with the waltham clients. It is
+* sent once, and again only when it changes
+*
+* @param names        struct window *window
+*             uint32_t format
+*             const void *keymap
+*             uint32_t size
+* @param value        window - window information
+*             format - keymap format
+*             keymap - keymap mapped from the file descriptor
+*             size   - keymap size in bytes
+* @return             none
+*/
+void waltham_keyboard_keymap(struct window *window, uint32_t format,
+             const void *keymap, uint32_t size);
+
+/**
+* waltham_keyboard_enter
+*
+* Send keyboard enter event received from weston to waltham client
+*
+* @param names        struct window *window
+*             uint32_t serial
+*             struct wl_array *keys
+* @param value        window - window information
+*             serial - serial number of the enter event
+*             keys   - the currently pressed keys
+* @return             none
+*/
+void waltham_keyboard_enter(struct window *window, uint32_t serial,
+             struct wl_array *keys);
+
+/**
+* waltham_keyboard_leave
+*
+* Send keyboard leave event received from weston to waltham client
+*
+* @param names        struct window *window
+*             uint32_t serial
+* @param value        window - window information
+*             serial - serial number of the leave event
+* @return             none
+*/
+void waltham_keyboard_leave(struct window *window, uint32_t serial);
+
+/**
+* waltham_keyboard_key
+*
+* Send key event received from weston to waltham client. Weston sends
+* no repeats, the clients repeat the keys from the repeat info
+*
+* @param names        struct window *window
+*             uint32_t serial
+*             uint32_t time
+*             uint32_t key
+*             uint32_t state
+* @param value        window - window information
+*             serial - serial number of the key event
+*             time   - timestamp with millisecond granularity
+*             key    - key that produced the event
+*             state  - physical state of the key
+* @return             none
+*/
+void waltham_keyboard_key(struct window *window, uint32_t serial,
+             uint32_t time, uint32_t key, uint32_t state);
+
+/**
+* waltham_keyboard_modifiers
+*
+* Send modifiers event received from weston to waltham client
+*
+* @param names        struct window *window
+*             uint32_t serial
+*             uint32_t mods_depressed, mods_latched, mods_locked
+*             uint32_t group
+* @param value        window - window information
+*             serial - serial number of the modifiers event
+*             mods_* - modifier state
+*             group  - keyboard layout
+* @return             none
+*/
+void waltham_keyboard_modifiers(struct window *window, uint32_t serial,
+             uint32_t mods_depressed, uint32_t mods_latched,
+             uint32_t mods_locked, uint32_t group);
+
+/**
+* waltham_keyboard_repeat_info
+*
+* Share the key repeat rate and delay received from weston with the
+* waltham clients, so that key repeat is generated on the transmitter
+*
+* @param names        struct window *window
+*             int32_t rate
+*             int32_t delay
+* @param value        window - window information
+*             rate   - repeats per second, 0 disables repeat
+*             delay  - delay in milliseconds before repeating
+* @return             none
+*/
+void waltham_keyboard_repeat_info(struct window *window, int32_t rate,
+             int32_t delay);
+
 /**
 * waltham_touch_down
 *
@@ -273,6 +466,33 @@ void waltham_touch_frame(struct window *window);
 */
 void waltham_touch_cancel(struct window *window);
 
+/**
+* waltham_surface_frame_done
+*
+* Acknowledge the pending buffer and send the pending frame callback of
+* the surface shown in the window to waltham client, once the local
+* compositor has repainted the window. The video decoded into the window
+* is not tracked, the ack only paces the client by these repaints
+*
+* @param names        struct window *window, uint32_t time
+* @param value        window - window information, time - frame time in ms
+* @return             none
+*/
+void waltham_surface_frame_done(struct window *window, uint32_t time);
+
+/**
+* waltham_surface_visibility
+*
+* Tell waltham client whether the surface shown in the window is on any
+* display of the local compositor, so that it can stop encoding it while
+* it is hidden
+*
+* @param names        struct window *window, bool visible
+* @param value        window - window information, visible - shown on a display
+* @return             none
+*/
+void waltham_surface_visibility(struct window *window, bool visible);
+
 /**
  * set verbosity
  */
@@ -299,6 +519,10 @@ inline bool get_verbosity()
 /***** macros *******/
 #define MAX_EPOLL_WATCHES 2
 
+/* marking of the client connections, which carry input and control */
+#define SOCKET_DSCP 46 /* expedited forwarding */
+#define SOCKET_PRIORITY 6 /* TC_PRIO_INTERACTIVE */
+
 #ifndef container_of
 #define container_of(ptr, type, member) ({                              \
         const __typeof__( ((type *)0)->member ) *__mptr = (ptr);        \
@@ -367,6 +591,8 @@ struct buffer {
     int32_t height;
     int32_t stride;
     uint32_t format;
+    uint32_t serial; /* frame sequence number of the client */
+    struct surface *surf; /* attached, not displayed yet */
     struct wl_list link; /* struct client::buffer_list */
 };
 
@@ -380,11 +606,41 @@ struct seat {
     struct wl_list link; /* struct client::seat_list */
 };
 
+/* scrolling on one axis within a pointer frame */
+#define POINTER_AXES 2
+
+struct pointer_axis {
+    bool pending;       /* axis event to send */
+    uint32_t time;
+    wl_fixed_t value;   /* summed over the frame */
+    int32_t discrete;   /* wheel steps, summed over the frame */
+    bool stop;
+    uint32_t stop_time;
+};
+
 /* wthp_pointer protocol object */
 struct pointer {
     struct wthp_pointer *obj;
     struct seat *seat;
     struct wl_list link; /* struct client::pointer_list */
+
+    /* last motion since the pointer frame, see waltham_pointer_frame() */
+    bool motion_pending;
+    uint32_t motion_time;
+    wl_fixed_t motion_x;
+    wl_fixed_t motion_y;
+
+    /* axis events since the pointer frame, per WL_POINTER_AXIS_* */
+    bool axis_source_pending;
+    uint32_t axis_source;
+    struct pointer_axis axis[POINTER_AXES];
+
+    /* cursor of the client, drawn on the local pointer */
+    bool cursor_set;           /* set_cursor was received */
+    struct surface *cursor;    /* NULL hides the cursor */
+    int32_t hotspot_x;
+    int32_t hotspot_y;
+    struct surface *focus;     /* surface under the local pointer */
 };
 
 /* wthp_keyboard protocol object */
@@ -394,11 +650,24 @@ struct keyboard {
     struct wl_list link; /* struct client::keyboard_list */
 };
 
+/* touch points whose motion is coalesced until the touch frame */
+#define MAX_TOUCH_POINTS 10
+
+/* last motion of one touch point since the touch frame */
+struct touch_motion {
+    bool pending;
+    int32_t id;
+    uint32_t time;
+    wl_fixed_t x;
+    wl_fixed_t y;
+};
+
 /* wthp_touch protocol object */
 struct touch {
     struct wthp_touch *obj;
     struct seat *seat;
     struct wl_list link; /* struct client::touch_list */
+    struct touch_motion motion[MAX_TOUCH_POINTS];
 };
 
 /* wthp_surface protocol object */
@@ -407,8 +676,17 @@ struct surface {
     uint32_t ivi_id;
     struct ivisurface *ivisurf;
     struct wthp_callback *cb;
+    struct buffer *pending_buffer; /* completed at the next repaint */
     struct window *shm_window;
     struct wl_list link; /* struct client::surface_list */
+
+    /* image of a cursor surface, see pointer_set_cursor() */
+    struct pointer *cursor_pointer;
+    void *cursor_data;
+    int32_t cursor_width;
+    int32_t cursor_height;
+    int32_t cursor_stride;
+    uint32_t cursor_format;
 };
 /* wthp_ivi_surface protocol object */
 struct ivisurface {
@@ -447,6 +725,43 @@ enum wthp_seat_capability {
     WTHP_SEAT_CAPABILITY_TOUCH = 4,
 };
 
+/* Input recording, written with -r and replayed by the input-replay
+ * option of waltham-transmitter, which has the same definitions. The file
+ * is INPUT_RECORD_MAGIC and INPUT_RECORD_VERSION followed by the records,
+ * all in host byte order.
+ */
+#define INPUT_RECORD_MAGIC 0x52495457 /* "WTIR" */
+#define INPUT_RECORD_VERSION 1
+
+enum input_record_type {
+    INPUT_RECORD_POINTER_ENTER = 1,     /* x, y */
+    INPUT_RECORD_POINTER_LEAVE,
+    INPUT_RECORD_POINTER_MOTION,        /* x, y */
+    INPUT_RECORD_POINTER_BUTTON,        /* button, state */
+    INPUT_RECORD_POINTER_AXIS,          /* axis, value */
+    INPUT_RECORD_POINTER_FRAME,
+    INPUT_RECORD_POINTER_AXIS_SOURCE,   /* source */
+    INPUT_RECORD_POINTER_AXIS_STOP,     /* axis */
+    INPUT_RECORD_POINTER_AXIS_DISCRETE, /* axis, discrete */
+    INPUT_RECORD_KEYBOARD_ENTER,
+    INPUT_RECORD_KEYBOARD_LEAVE,
+    INPUT_RECORD_KEYBOARD_KEY,          /* key, state */
+    INPUT_RECORD_KEYBOARD_MODIFIERS,    /* depressed, latched, locked, group */
+    INPUT_RECORD_TOUCH_DOWN,            /* id, x, y */
+    INPUT_RECORD_TOUCH_UP,              /* id */
+    INPUT_RECORD_TOUCH_MOTION,          /* id, x, y */
+    INPUT_RECORD_TOUCH_FRAME,
+    INPUT_RECORD_TOUCH_CANCEL,
+};
+
+/* one event sent to a waltham client */
+struct input_record {
+    uint64_t time;      /* us since the recording started */
+    uint32_t type;      /* enum input_record_type */
+    uint32_t ivi_id;    /* surface of enter, leave and touch down */
+    int32_t arg[4];
+};
+
 /* epoll structure */
 struct watch {
     struct receiver *receiver;
@@ -469,7 +784,10 @@ struct client {
     struct wl_list buffer_list;       /* struct buffer::link */
     struct wl_list seat_list;         /* struct seat::link */
     struct wl_list pointer_list;      /* struct pointer::link */
+    struct wl_list keyboard_list;     /* struct keyboard::link */
     struct wl_list touch_list;        /* struct touch::link */
+
+    const struct decoder *decoder;    /* bound by the client, NULL for the default pipeline */
 };
 
 /* receiver structure */
@@ -481,6 +799,37 @@ struct receiver {
     int epoll_fd;
 
     struct wl_list client_list; /* struct client::link */
+    struct wl_list mode_list;   /* struct display_mode::link */
+    struct wl_list decoder_list; /* struct decoder::link */
+
+    /* of the local keyboard, shared with every waltham keyboard */
+    void *keymap;
+    uint32_t keymap_size;
+    uint32_t keymap_format;
+    bool has_repeat_info;
+    int32_t repeat_rate;
+    int32_t repeat_delay;
+
+    /* input recording, NULL unless -r is given */
+    FILE *record;
+    uint64_t record_start; /* CLOCK_MONOTONIC, us */
+};
+
+/* mode of a local display, advertised to the waltham clients */
+struct display_mode {
+    uint32_t output;  /* index of the local wl_output */
+    uint32_t flags;   /* WL_OUTPUT_MODE_* */
+    int32_t width;
+    int32_t height;
+    int32_t refresh;  /* mHz */
+    struct wl_list link; /* struct receiver::mode_list */
+};
+
+/* decoder pipeline of a codec, advertised to the waltham clients */
+struct decoder {
+    char codec[16];   /* receiver_pipeline_<codec>.cfg */
+    uint32_t cost;    /* lower is preferred */
+    struct wl_list link; /* struct receiver::decoder_list */
 };
 
 struct shm_buffer {
@@ -498,7 +847,11 @@ struct display {
     struct ivi_application *ivi_application;
 
     struct wl_seat *seat;
+    bool pointer_frames; /* wl_seat version 5, wl_pointer sends frames */
     struct wl_pointer *wl_pointer;
+    uint32_t pointer_serial; /* of the last wl_pointer.enter */
+    struct wl_surface *cursor_surface;
+    struct wl_buffer *cursor_buffer;
     struct wl_keyboard *wl_keyboard;
     struct wl_touch *wl_touch;
     struct window *window;
@@ -543,6 +896,11 @@ struct window {
     struct pointer *receiver_pointer;
     bool ready;
     uint32_t id_ivisurf;
+    struct _GstAppContext *gstctx;
+    struct watch display_watch; /* local compositor connection */
+    bool read_prepared;
+    const char *codec; /* pipeline variant, NULL for receiver_pipeline.cfg */
+    int outputs; /* local outputs showing the surface */
 };
 
 
@@ -37,11 +37,18 @@
 #include "wth-receiver-comm.h"
 
 extern int wth_receiver_weston_main(struct window *);
+extern void wth_receiver_weston_destroy(struct window *);
+extern void wth_receiver_weston_prepare_read(struct window *);
+extern void wth_receiver_weston_dispatch(struct window *);
+extern void wth_receiver_weston_request_frame(struct window *);
 
 extern void wth_receiver_weston_shm_attach(struct window *, uint32_t data_sz, void * data,
        int32_t width, int32_t height, int32_t stride, uint32_t format);
 extern void wth_receiver_weston_shm_damage(struct window *);
 extern void wth_receiver_weston_shm_commit(struct window *);
+extern void wth_receiver_weston_set_cursor(struct window *, const void *data,
+       int32_t width, int32_t height, int32_t stride, uint32_t format,
+       int32_t hotspot_x, int32_t hotspot_y);
 
 /*
  * utility functions
@@ -73,11 +80,83 @@ client_post_out_of_memory(struct client *c)
 /*
  * waltham surface implementation
  */
+
+/* Acknowledge the frame of the buffer to the client, see
+ * surface_handle_attach().
+ *
+ * The video of the frame comes separately over UDP and carries no frame
+ * number, so the ack cannot say that this frame was decoded or shown. It
+ * is sent at the next repaint of the window by the local compositor: the
+ * client is paced by the repaints of the receiver, which does not bound
+ * the frames queued in its encoder or on the network.
+ */
+static void
+surface_complete_buffer(struct surface *surface)
+{
+    struct buffer *buf = surface->pending_buffer;
+
+    if (!buf)
+        return;
+
+    wthp_buffer_send_complete(buf->obj, buf->serial);
+    buf->surf = NULL;
+    surface->pending_buffer = NULL;
+}
+
+/* Show the cursor of the client on the window under the local pointer.
+ * The local compositor then moves it with the pointer, the client only
+ * hears about the image changes.
+ */
+static void
+pointer_update_cursor(struct pointer *pointer)
+{
+    struct surface *focus = pointer->focus;
+    struct surface *cursor = pointer->cursor;
+
+    if (!pointer->cursor_set || !focus ||
+        !focus->shm_window || !focus->shm_window->ready)
+        return;
+
+    if (cursor && cursor->cursor_data)
+        wth_receiver_weston_set_cursor(focus->shm_window, cursor->cursor_data,
+                                       cursor->cursor_width,
+                                       cursor->cursor_height,
+                                       cursor->cursor_stride,
+                                       cursor->cursor_format,
+                                       pointer->hotspot_x, pointer->hotspot_y);
+    else
+        wth_receiver_weston_set_cursor(focus->shm_window, NULL,
+                                       0, 0, 0, 0, 0, 0);
+}
+
 static void
 surface_destroy(struct surface *surface)
 {
     wth_verbose("%s >>> \n",__func__);
     wth_verbose("surface %p destroy\n", surface->obj);
+    struct seat *seat = surface->shm_window ?
+                        surface->shm_window->receiver_seat : NULL;
+
+    if (surface->cursor_pointer && surface->cursor_pointer->cursor == surface)
+        surface->cursor_pointer->cursor = NULL;
+    if (seat && seat->pointer && seat->pointer->focus == surface)
+        seat->pointer->focus = NULL;
+    free(surface->cursor_data);
+
+    if (surface->cb)
+        wthp_callback_free(surface->cb);
+    if (surface->pending_buffer)
+        surface->pending_buffer->surf = NULL;
+    if (surface->ivisurf)
+        surface->ivisurf->surf = NULL;
+
+    if (surface->shm_window && surface->shm_window->ready) {
+        watch_ctl(&surface->shm_window->display_watch, EPOLL_CTL_DEL, 0);
+        /* frees the window */
+        wth_receiver_weston_destroy(surface->shm_window);
+    } else {
+        free(surface->shm_window);
+    }
 
     wthp_surface_free(surface->obj);
     wl_list_remove(&surface->link);
@@ -105,7 +184,7 @@ surface_handle_attach(struct wthp_surface *wthp_surface,
     struct surface *surf = wth_object_get_user_data((struct wth_object *)wthp_surface);
     struct buffer *buf = NULL;
 
-    buf = container_of(wthp_buffer, struct buffer, obj);
+    buf = wth_object_get_user_data((struct wth_object *)wthp_buffer);
 
     if (surf->ivi_id != 0) {
         wth_receiver_weston_shm_attach(surf->shm_window,
@@ -116,7 +195,28 @@ surface_handle_attach(struct wthp_surface *wthp_surface,
                buf->stride,
                buf->format);
 
-        wthp_buffer_send_complete(wthp_buffer, 0);
+        /* The frame is acknowledged at the next repaint of the window.
+         * A frame still waiting for it is superseded, acknowledge it now.
+         */
+        surface_complete_buffer(surf);
+        buf->surf = surf;
+        surf->pending_buffer = buf;
+    } else if (buf && buf->data &&
+               buf->stride >= buf->width * 4 &&
+               buf->data_sz >= (uint32_t)(buf->stride * buf->height)) {
+        /* a cursor image, kept as the blob does not outlive the
+         * message, see pointer_set_cursor()
+         */
+        void *data = realloc(surf->cursor_data, buf->data_sz);
+
+        if (data) {
+            memcpy(data, buf->data, buf->data_sz);
+            surf->cursor_data = data;
+            surf->cursor_width = buf->width;
+            surf->cursor_height = buf->height;
+            surf->cursor_stride = buf->stride;
+            surf->cursor_format = buf->format;
+        }
     }
     wth_verbose(" <<< %s \n",__func__);
 }
@@ -146,7 +246,19 @@ surface_handle_frame(struct wthp_surface *wthp_surface,
     struct surface *surf = wth_object_get_user_data((struct wth_object *)wthp_surface);
     wth_verbose("surface %p callback(%p)\n",wthp_surface, callback);
 
+    /* Only one frame is tracked, an older request is answered now */
+    if (surf->cb) {
+        wthp_callback_send_done(surf->cb, 0);
+        wthp_callback_free(surf->cb);
+    }
     surf->cb = callback;
+
+    /* Answered from waltham_surface_frame_done() when the local
+     * compositor tells the window to draw again, so that the remote
+     * client is paced by the display of the receiver.
+     */
+    if (surf->shm_window && surf->shm_window->ready)
+        wth_receiver_weston_request_frame(surf->shm_window);
     wth_verbose(" <<< %s \n",__func__);
 }
 
@@ -176,6 +288,15 @@ surface_handle_commit(struct wthp_surface *wthp_surface)
 
     if (surf->ivi_id != 0) {
         wth_receiver_weston_shm_commit(surf->shm_window);
+    } else if (surf->cursor_pointer && surf->cursor_pointer->cursor == surf) {
+        pointer_update_cursor(surf->cursor_pointer);
+    }
+
+    if (surf->pending_buffer) {
+        if (surf->shm_window && surf->shm_window->ready)
+            wth_receiver_weston_request_frame(surf->shm_window);
+        else
+            surface_complete_buffer(surf);
     }
     wth_verbose(" <<< %s \n",__func__);
 }
@@ -225,6 +346,8 @@ buffer_handle_destroy(struct wthp_buffer *wthp_buffer)
 {
 	struct buffer *buf = wth_object_get_user_data((struct wth_object *)wthp_buffer);
 
+	if (buf->surf)
+		buf->surf->pending_buffer = NULL;
 	wthp_buffer_free(wthp_buffer);
 	wl_list_remove(&buf->link);
 	free(buf);
@@ -266,6 +389,12 @@ blob_factory_create_buffer(struct wthp_blob_factory *blob_factory,
 	buffer->format = format;
 	buffer->obj = wthp_buffer;
 
+	/* The client puts the frame sequence number in the blob, it is
+	 * echoed in wthp_buffer.complete.
+	 */
+	if (data && data_sz >= sizeof(buffer->serial))
+		memcpy(&buffer->serial, data, sizeof(buffer->serial));
+
 	wthp_buffer_set_interface(wthp_buffer, &buffer_implementation, buffer);
 }
 
@@ -301,6 +430,9 @@ wthp_ivi_surface_destroy(struct wthp_ivi_surface * ivi_surface)
 {
     wth_verbose("%s >>> \n",__func__);
     struct ivisurface *ivisurf = wth_object_get_user_data((struct wth_object *)ivi_surface);
+
+    if (ivisurf->surf)
+        ivisurf->surf->ivisurf = NULL;
     free(ivisurf);
     wth_verbose(" <<< %s \n",__func__);
 }
@@ -313,6 +445,19 @@ static const struct wthp_ivi_surface_interface wthp_ivi_surface_implementation =
 /*
  * waltham ivi application implementation
  */
+static void
+window_handle_display_data(struct watch *w, uint32_t events)
+{
+    wth_verbose("%s >>> \n",__func__);
+
+    /* The events themselves are read in receiver_dispatch_surfaces() */
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        wth_error("Lost connection to the local compositor.\n");
+        w->receiver->running = false;
+    }
+    wth_verbose(" <<< %s \n",__func__);
+}
+
 static void
 wthp_ivi_application_surface_create(struct wthp_ivi_application * ivi_application, uint32_t ivi_id,
                    struct wthp_surface * wthp_surface, struct wthp_ivi_surface *obj)
@@ -320,7 +465,9 @@ wthp_ivi_application_surface_create(struct wthp_ivi_application * ivi_applicatio
     wth_verbose("%s >>> \n",__func__);
     wth_verbose("ivi_application %p surface_create(%d, %p, %p)\n",
         ivi_application, ivi_id, wthp_surface, obj);
+    struct application *app = wth_object_get_user_data((struct wth_object *)ivi_application);
     struct surface *surface = wth_object_get_user_data((struct wth_object *)wthp_surface);
+    struct window *window;
     wth_verbose("----------------------------------\n\n\n");
     wth_verbose("surface    [%p]\n", surface);
     wth_verbose("shm_window [%p]\n\n\n", surface->shm_window);
@@ -337,11 +484,19 @@ wthp_ivi_application_surface_create(struct wthp_ivi_application * ivi_applicatio
 
     ivisurf->obj = obj;
     ivisurf->surf = surface;
+    surface->ivisurf = ivisurf;
 
-    wth_receiver_weston_main(surface->shm_window);
-
-    while (!surface->shm_window->ready)
-        usleep(1);
+    window = surface->shm_window;
+    window->codec = app->client->decoder ? app->client->decoder->codec : NULL;
+    if (wth_receiver_weston_main(window) < 0) {
+        wth_error("Failed to create window for ivi surface %d\n", ivi_id);
+    } else {
+        window->display_watch.receiver = app->client->receiver;
+        window->display_watch.fd = wl_display_get_fd(window->display->display);
+        window->display_watch.cb = window_handle_display_data;
+        if (watch_ctl(&window->display_watch, EPOLL_CTL_ADD, EPOLLIN) < 0)
+            wth_error("Failed to watch the local compositor connection\n");
+    }
 
     wthp_ivi_surface_set_interface(obj, &wthp_ivi_surface_implementation,
                   ivisurf);
@@ -375,10 +530,100 @@ client_bind_wthp_ivi_application(struct client *c, struct wthp_ivi_application *
     wth_verbose(" <<< %s \n",__func__);
 }
 
+/*
+ * Input recording
+ */
+
+/* Write one event sent to the client to the recording, see -r */
+static void
+input_record(struct seat *seat, uint32_t type, struct surface *surface,
+             int32_t a0, int32_t a1, int32_t a2, int32_t a3)
+{
+    struct receiver *srv = seat->client->receiver;
+    struct input_record rec;
+    struct timespec ts;
+
+    if (!srv->record)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec.time = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 -
+               srv->record_start;
+    rec.type = type;
+    rec.ivi_id = surface ? surface->ivi_id : 0;
+    rec.arg[0] = a0;
+    rec.arg[1] = a1;
+    rec.arg[2] = a2;
+    rec.arg[3] = a3;
+
+    if (fwrite(&rec, sizeof rec, 1, srv->record) != 1) {
+        wth_error("Input recording stopped: %s\n", strerror(errno));
+        fclose(srv->record);
+        srv->record = NULL;
+    }
+}
+
 /*
  * APIs to send pointer events to waltham client
  */
 
+/* Send the motion coalesced since the last pointer frame */
+static void
+pointer_flush_motion(struct pointer *pointer)
+{
+    if (!pointer->motion_pending)
+        return;
+
+    pointer->motion_pending = false;
+    wthp_pointer_send_motion (pointer->obj, pointer->motion_time,
+                              pointer->motion_x, pointer->motion_y);
+    input_record(pointer->seat, INPUT_RECORD_POINTER_MOTION, NULL,
+                 pointer->motion_x, pointer->motion_y, 0, 0);
+}
+
+/* Send the scrolling gathered since the last pointer frame, in the order
+ * wl_pointer defines for one frame: source, then per axis the discrete
+ * steps, the summed value and the stop.
+ */
+static void
+pointer_flush_axis(struct pointer *pointer)
+{
+    struct pointer_axis *axis;
+    uint32_t i;
+
+    if (pointer->axis_source_pending) {
+        pointer->axis_source_pending = false;
+        wthp_pointer_send_axis_source (pointer->obj, pointer->axis_source);
+        input_record(pointer->seat, INPUT_RECORD_POINTER_AXIS_SOURCE, NULL,
+                     pointer->axis_source, 0, 0, 0);
+    }
+
+    for (i = 0; i < POINTER_AXES; i++) {
+        axis = &pointer->axis[i];
+
+        if (axis->pending) {
+            if (axis->discrete != 0) {
+                wthp_pointer_send_axis_discrete (pointer->obj, i,
+                                                 axis->discrete);
+                input_record(pointer->seat,
+                             INPUT_RECORD_POINTER_AXIS_DISCRETE, NULL,
+                             i, axis->discrete, 0, 0);
+            }
+            wthp_pointer_send_axis (pointer->obj, axis->time, i,
+                                    axis->value);
+            input_record(pointer->seat, INPUT_RECORD_POINTER_AXIS, NULL,
+                         i, axis->value, 0, 0);
+        }
+        if (axis->stop) {
+            wthp_pointer_send_axis_stop (pointer->obj, axis->stop_time, i);
+            input_record(pointer->seat, INPUT_RECORD_POINTER_AXIS_STOP, NULL,
+                         i, 0, 0, 0);
+        }
+
+        memset(axis, 0, sizeof *axis);
+    }
+}
+
 void
 waltham_pointer_enter(struct window *window, uint32_t serial,
                       wl_fixed_t sx, wl_fixed_t sy)
@@ -391,7 +636,12 @@ waltham_pointer_enter(struct window *window, uint32_t serial,
 
     wth_verbose("waltham_pointer_enter [%d]\n", window->receiver_surf->ivi_id);
 
+    /* every window has its own wl_pointer, the cursor is set again */
+    pointer->focus = surface;
+    pointer_update_cursor(pointer);
+
     wthp_pointer_send_enter (pointer->obj, serial, surface->obj, sx, sy);
+    input_record(seat, INPUT_RECORD_POINTER_ENTER, surface, sx, sy, 0, 0);
 
     wth_verbose(" <<< %s \n",__func__);
     return;
@@ -407,7 +657,12 @@ waltham_pointer_leave(struct window *window, uint32_t serial)
 
     wth_verbose("waltham_pointer_leave [%d]\n", window->receiver_surf->ivi_id);
 
+    pointer_flush_motion(pointer);
+    pointer_flush_axis(pointer);
     wthp_pointer_send_leave (pointer->obj, serial, surface->obj);
+    input_record(seat, INPUT_RECORD_POINTER_LEAVE, surface, 0, 0, 0, 0);
+    if (pointer->focus == surface)
+        pointer->focus = NULL;
 
     wth_verbose(" <<< %s \n",__func__);
     return;
@@ -421,7 +676,32 @@ waltham_pointer_motion(struct window *window, uint32_t time,
     struct seat *seat = window->receiver_seat;
     struct pointer *pointer = seat->pointer;
 
-    wthp_pointer_send_motion (pointer->obj, time, sx, sy);
+    /* Only the last position of a frame is sent, from
+     * waltham_pointer_frame(). Without pointer frames every sample is.
+     */
+    pointer->motion_pending = true;
+    pointer->motion_time = time;
+    pointer->motion_x = sx;
+    pointer->motion_y = sy;
+    if (!window->display->pointer_frames)
+        pointer_flush_motion(pointer);
+
+    wth_verbose(" <<< %s \n",__func__);
+    return;
+}
+
+void
+waltham_pointer_frame(struct window *window)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct seat *seat = window->receiver_seat;
+    struct pointer *pointer = seat->pointer;
+
+    /* the transmitter hands the frame on to its clients */
+    pointer_flush_motion(pointer);
+    pointer_flush_axis(pointer);
+    wthp_pointer_send_frame (pointer->obj);
+    input_record(seat, INPUT_RECORD_POINTER_FRAME, NULL, 0, 0, 0, 0);
 
     wth_verbose(" <<< %s \n",__func__);
     return;
@@ -436,7 +716,11 @@ waltham_pointer_button(struct window *window, uint32_t serial,
     struct seat *seat = window->receiver_seat;
     struct pointer *pointer = seat->pointer;
 
+    /* buttons are sent right away, at the position of the motion before */
+    pointer_flush_motion(pointer);
+    pointer_flush_axis(pointer);
     wthp_pointer_send_button (pointer->obj, serial, time, button, state);
+    input_record(seat, INPUT_RECORD_POINTER_BUTTON, NULL, button, state, 0, 0);
 
     wth_verbose(" <<< %s \n",__func__);
     return;
@@ -450,7 +734,84 @@ waltham_pointer_axis(struct window *window, uint32_t time,
     struct seat *seat = window->receiver_seat;
     struct pointer *pointer = seat->pointer;
 
-    wthp_pointer_send_axis (pointer->obj, time, axis, value);
+    pointer_flush_motion(pointer);
+
+    if (axis >= POINTER_AXES) {
+        wthp_pointer_send_axis (pointer->obj, time, axis, value);
+        input_record(seat, INPUT_RECORD_POINTER_AXIS, NULL, axis, value, 0, 0);
+        wth_verbose(" <<< %s \n",__func__);
+        return;
+    }
+
+    /* Scrolling is summed up to the pointer frame, so a smooth scroll
+     * that the local compositor splits into many events crosses the
+     * network once per frame.
+     */
+    pointer->axis[axis].pending = true;
+    pointer->axis[axis].time = time;
+    pointer->axis[axis].value += value;
+    if (!window->display->pointer_frames)
+        pointer_flush_axis(pointer);
+
+    wth_verbose(" <<< %s \n",__func__);
+    return;
+}
+
+void
+waltham_pointer_axis_source(struct window *window, uint32_t axis_source)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct seat *seat = window->receiver_seat;
+    struct pointer *pointer = seat->pointer;
+
+    /* wl_pointer only sends it within a frame, with the axis events */
+    pointer->axis_source_pending = true;
+    pointer->axis_source = axis_source;
+
+    wth_verbose(" <<< %s \n",__func__);
+    return;
+}
+
+void
+waltham_pointer_axis_stop(struct window *window, uint32_t time,
+             uint32_t axis)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct seat *seat = window->receiver_seat;
+    struct pointer *pointer = seat->pointer;
+
+    if (axis >= POINTER_AXES) {
+        wthp_pointer_send_axis_stop (pointer->obj, time, axis);
+        input_record(seat, INPUT_RECORD_POINTER_AXIS_STOP, NULL, axis, 0, 0, 0);
+        wth_verbose(" <<< %s \n",__func__);
+        return;
+    }
+
+    pointer->axis[axis].stop = true;
+    pointer->axis[axis].stop_time = time;
+
+    wth_verbose(" <<< %s \n",__func__);
+    return;
+}
+
+void
+waltham_pointer_axis_discrete(struct window *window, uint32_t axis,
+             int32_t discrete)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct seat *seat = window->receiver_seat;
+    struct pointer *pointer = seat->pointer;
+
+    if (axis >= POINTER_AXES) {
+        wthp_pointer_send_axis_discrete (pointer->obj, axis, discrete);
+        input_record(seat, INPUT_RECORD_POINTER_AXIS_DISCRETE, NULL,
+                     axis, discrete, 0, 0);
+        wth_verbose(" <<< %s \n",__func__);
+        return;
+    }
+
+    /* always followed by the axis event of the same axis */
+    pointer->axis[axis].discrete += discrete;
 
     wth_verbose(" <<< %s \n",__func__);
     return;
@@ -468,6 +829,27 @@ pointer_set_cursor(struct wthp_pointer *wthp_pointer, int32_t serial, struct wth
     wth_verbose("wthp_pointer %p (%d, %p, %d, %d)\n",
         wthp_pointer, serial, surface, hotspot_x, hotspot_y);
 
+    struct surface *cursor = NULL;
+
+    if (surface)
+        cursor = wth_object_get_user_data((struct wth_object *)surface);
+
+    if (pointer->cursor && pointer->cursor != cursor)
+        pointer->cursor->cursor_pointer = NULL;
+
+    /* The image arrives with the commit of the cursor surface, usually
+     * before this request. It is kept by the surface, see
+     * surface_handle_attach(), so that the client sends it only when it
+     * changes.
+     */
+    pointer->cursor_set = true;
+    pointer->cursor = cursor;
+    pointer->hotspot_x = hotspot_x;
+    pointer->hotspot_y = hotspot_y;
+    if (cursor)
+        cursor->cursor_pointer = pointer;
+
+    pointer_update_cursor(pointer);
 }
 
 static void
@@ -483,10 +865,227 @@ static const struct wthp_pointer_interface pointer_implementation = {
     pointer_release
 };
 
+/*
+ * APIs to send keyboard events to waltham client
+ */
+
+/* The keyboard of the client in the window, NULL if it has none */
+static struct keyboard *
+window_keyboard(struct window *window)
+{
+    struct seat *seat = window->receiver_seat;
+
+    return seat ? seat->keyboard : NULL;
+}
+
+void
+waltham_keyboard_keymap(struct window *window, uint32_t format,
+             const void *keymap, uint32_t size)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct receiver *srv;
+    struct client *c;
+    struct keyboard *keyboard;
+    void *copy;
+
+    if (!window->receiver_seat)
+        return;
+    srv = window->receiver_seat->client->receiver;
+
+    /* every window gets the same keymap from weston, only a change
+     * goes out to the clients
+     */
+    if (srv->keymap && srv->keymap_format == format &&
+        srv->keymap_size == size && memcmp(srv->keymap, keymap, size) == 0)
+        return;
+
+    copy = malloc(size);
+    if (!copy)
+        return;
+    memcpy(copy, keymap, size);
+
+    free(srv->keymap);
+    srv->keymap = copy;
+    srv->keymap_size = size;
+    srv->keymap_format = format;
+
+    wl_list_for_each(c, &srv->client_list, link)
+        wl_list_for_each(keyboard, &c->keyboard_list, link)
+            wthp_keyboard_send_keymap(keyboard->obj, format, size, copy);
+
+    wth_verbose(" <<< %s \n",__func__);
+}
+
+void
+waltham_keyboard_enter(struct window *window, uint32_t serial,
+             struct wl_array *keys)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct keyboard *keyboard = window_keyboard(window);
+    struct wth_array wth_keys;
+
+    if (!keyboard)
+        return;
+
+    wth_keys.size = keys->size;
+    wth_keys.alloc = keys->alloc;
+    wth_keys.data = keys->data;
+
+    wthp_keyboard_send_enter(keyboard->obj, serial,
+                             window->receiver_surf->obj, &wth_keys);
+    input_record(keyboard->seat, INPUT_RECORD_KEYBOARD_ENTER,
+                 window->receiver_surf, 0, 0, 0, 0);
+
+    wth_verbose(" <<< %s \n",__func__);
+}
+
+void
+waltham_keyboard_leave(struct window *window, uint32_t serial)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct keyboard *keyboard = window_keyboard(window);
+
+    if (keyboard) {
+        wthp_keyboard_send_leave(keyboard->obj, serial,
+                                 window->receiver_surf->obj);
+        input_record(keyboard->seat, INPUT_RECORD_KEYBOARD_LEAVE,
+                     window->receiver_surf, 0, 0, 0, 0);
+    }
+
+    wth_verbose(" <<< %s \n",__func__);
+}
+
+void
+waltham_keyboard_key(struct window *window, uint32_t serial,
+             uint32_t time, uint32_t key, uint32_t state)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct keyboard *keyboard = window_keyboard(window);
+
+    if (keyboard) {
+        wthp_keyboard_send_key(keyboard->obj, serial, time, key, state);
+        input_record(keyboard->seat, INPUT_RECORD_KEYBOARD_KEY, NULL,
+                     key, state, 0, 0);
+    }
+
+    wth_verbose(" <<< %s \n",__func__);
+}
+
+void
+waltham_keyboard_modifiers(struct window *window, uint32_t serial,
+             uint32_t mods_depressed, uint32_t mods_latched,
+             uint32_t mods_locked, uint32_t group)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct keyboard *keyboard = window_keyboard(window);
+
+    if (keyboard) {
+        wthp_keyboard_send_modifiers(keyboard->obj, serial, mods_depressed,
+                                     mods_latched, mods_locked, group);
+        input_record(keyboard->seat, INPUT_RECORD_KEYBOARD_MODIFIERS, NULL,
+                     mods_depressed, mods_latched, mods_locked, group);
+    }
+
+    wth_verbose(" <<< %s \n",__func__);
+}
+
+void
+waltham_keyboard_repeat_info(struct window *window, int32_t rate,
+             int32_t delay)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct receiver *srv;
+    struct client *c;
+    struct keyboard *keyboard;
+
+    if (!window->receiver_seat)
+        return;
+    srv = window->receiver_seat->client->receiver;
+
+    if (srv->has_repeat_info && srv->repeat_rate == rate &&
+        srv->repeat_delay == delay)
+        return;
+
+    srv->has_repeat_info = true;
+    srv->repeat_rate = rate;
+    srv->repeat_delay = delay;
+
+    wl_list_for_each(c, &srv->client_list, link)
+        wl_list_for_each(keyboard, &c->keyboard_list, link)
+            wthp_keyboard_send_repeat_info(keyboard->obj, rate, delay);
+
+    wth_verbose(" <<< %s \n",__func__);
+}
+
+/*
+ *  waltham keyboard implementation
+ */
+static void
+keyboard_destroy(struct keyboard *keyboard)
+{
+    if (keyboard->seat->keyboard == keyboard)
+        keyboard->seat->keyboard = NULL;
+
+    wthp_keyboard_free(keyboard->obj);
+    wl_list_remove(&keyboard->link);
+    free(keyboard);
+}
+
+static void
+keyboard_release(struct wthp_keyboard *wthp_keyboard)
+{
+    struct keyboard *keyboard = wth_object_get_user_data((struct wth_object *)wthp_keyboard);
+
+    wth_verbose("wthp_keyboard %p\n",wthp_keyboard);
+
+    keyboard_destroy(keyboard);
+}
+
+static const struct wthp_keyboard_interface keyboard_implementation = {
+    keyboard_release
+};
+
 /*
  * APIs to send touch events to waltham client
  */
 
+/* The pending motion of a touch point, or a free slot for it */
+static struct touch_motion *
+touch_find_motion(struct touch *touch, int32_t id)
+{
+    struct touch_motion *slot = NULL;
+    int i;
+
+    for (i = 0; i < MAX_TOUCH_POINTS; i++) {
+        if (touch->motion[i].pending && touch->motion[i].id == id)
+            return &touch->motion[i];
+        if (!touch->motion[i].pending && !slot)
+            slot = &touch->motion[i];
+    }
+
+    return slot;
+}
+
+/* Send the pending motion of one touch point, of all of them for id -1 */
+static void
+touch_flush_motion(struct touch *touch, int32_t id)
+{
+    struct touch_motion *motion;
+    int i;
+
+    for (i = 0; i < MAX_TOUCH_POINTS; i++) {
+        motion = &touch->motion[i];
+        if (!motion->pending || (id != -1 && motion->id != id))
+            continue;
+
+        motion->pending = false;
+        wthp_touch_send_motion(touch->obj, motion->time, motion->id,
+                               motion->x, motion->y);
+        input_record(touch->seat, INPUT_RECORD_TOUCH_MOTION, NULL,
+                     motion->id, motion->x, motion->y, 0);
+    }
+}
+
 void
 waltham_touch_down(struct window *window, uint32_t serial,
                    uint32_t time, int32_t id,
@@ -498,7 +1097,9 @@ waltham_touch_down(struct window *window, uint32_t serial,
     struct touch *touch = seat->touch;
 
     wth_verbose("touch_handle_down surface [%d]\n", surface->ivi_id);
+    touch_flush_motion(touch, id);
     wthp_touch_send_down(touch->obj, serial, time, surface->obj, id, x_w, y_w);
+    input_record(seat, INPUT_RECORD_TOUCH_DOWN, surface, id, x_w, y_w, 0);
 
     wth_verbose(" <<< %s \n",__func__);
     return;
@@ -512,7 +1113,10 @@ waltham_touch_up(struct window *window, uint32_t serial,
     struct seat *seat = window->receiver_seat;
     struct touch *touch = seat->touch;
 
+    /* the point is released where it last moved to */
+    touch_flush_motion(touch, id);
     wthp_touch_send_up(touch->obj, serial, time, id);
+    input_record(seat, INPUT_RECORD_TOUCH_UP, NULL, id, 0, 0, 0);
 
     wth_verbose(" <<< %s \n",__func__);
     return;
@@ -525,8 +1129,22 @@ waltham_touch_motion(struct window *window, uint32_t time,
     wth_verbose("%s >>> \n",__func__);
     struct seat *seat = window->receiver_seat;
     struct touch *touch = seat->touch;
+    struct touch_motion *motion;
+
+    /* Only the last position of each point is sent with the frame */
+    motion = touch_find_motion(touch, id);
+    if (!motion) {
+        wthp_touch_send_motion(touch->obj, time, id, x_w, y_w);
+        input_record(seat, INPUT_RECORD_TOUCH_MOTION, NULL, id, x_w, y_w, 0);
+        wth_verbose(" <<< %s \n",__func__);
+        return;
+    }
 
-    wthp_touch_send_motion(touch->obj, time, id, x_w, y_w);
+    motion->pending = true;
+    motion->id = id;
+    motion->time = time;
+    motion->x = x_w;
+    motion->y = y_w;
 
     wth_verbose(" <<< %s \n",__func__);
     return;
@@ -539,7 +1157,9 @@ waltham_touch_frame(struct window *window)
     struct seat *seat = window->receiver_seat;
     struct touch *touch = seat->touch;
 
+    touch_flush_motion(touch, -1);
     wthp_touch_send_frame(touch->obj);
+    input_record(seat, INPUT_RECORD_TOUCH_FRAME, NULL, 0, 0, 0, 0);
 
     wth_verbose(" <<< %s \n",__func__);
     return;
@@ -551,8 +1171,58 @@ waltham_touch_cancel(struct window *window)
     wth_verbose("%s >>> \n",__func__);
     struct seat *seat = window->receiver_seat;
     struct touch *touch = seat->touch;
+    int i;
 
+    for (i = 0; i < MAX_TOUCH_POINTS; i++)
+        touch->motion[i].pending = false;
     wthp_touch_send_cancel(touch->obj);
+    input_record(seat, INPUT_RECORD_TOUCH_CANCEL, NULL, 0, 0, 0, 0);
+
+    wth_verbose(" <<< %s \n",__func__);
+    return;
+}
+
+/*
+ * API to send the frame callback to waltham client
+ */
+void
+waltham_surface_frame_done(struct window *window, uint32_t time)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct surface *surf = window->receiver_surf;
+
+    if (surf)
+        surface_complete_buffer(surf);
+
+    if (surf && surf->cb) {
+        wthp_callback_send_done(surf->cb, time);
+        wthp_callback_free(surf->cb);
+        surf->cb = NULL;
+    }
+
+    wth_verbose(" <<< %s \n",__func__);
+    return;
+}
+
+/*
+ * API to report the visibility of the window to waltham client
+ */
+void
+waltham_surface_visibility(struct window *window, bool visible)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct surface *surf = window->receiver_surf;
+
+    if (surf && surf->ivisurf) {
+        wth_verbose("ivi surface %d %s\n", surf->ivi_id,
+                    visible ? "shown" : "hidden");
+        /* 0x0 asks the client to pause the surface */
+        if (visible)
+            wthp_ivi_surface_send_configure(surf->ivisurf->obj,
+                                            window->width, window->height);
+        else
+            wthp_ivi_surface_send_configure(surf->ivisurf->obj, 0, 0);
+    }
 
     wth_verbose(" <<< %s \n",__func__);
     return;
@@ -603,6 +1273,40 @@ seat_get_pointer(struct wthp_seat *wthp_seat, struct wthp_pointer *wthp_pointer)
     wth_verbose(" <<< %s \n",__func__);
 }
 
+static void
+seat_get_keyboard(struct wthp_seat *wthp_seat, struct wthp_keyboard *wthp_keyboard)
+{
+    wth_verbose("%s >>> \n",__func__);
+    wth_verbose("wthp_seat %p get_keyboard(%p)\n",
+        wthp_seat, wthp_keyboard);
+
+    struct seat *seat = wth_object_get_user_data((struct wth_object *)wthp_seat);
+    struct receiver *srv = seat->client->receiver;
+    struct keyboard *keyboard;
+
+    keyboard = zalloc(sizeof *keyboard);
+    if (!keyboard) {
+        client_post_out_of_memory(seat->client);
+        return;
+    }
+
+    keyboard->obj = wthp_keyboard;
+    keyboard->seat = seat;
+    seat->keyboard = keyboard;
+    wl_list_insert(&seat->client->keyboard_list, &keyboard->link);
+
+    wthp_keyboard_set_interface(wthp_keyboard, &keyboard_implementation, keyboard);
+
+    /* known from the windows of an earlier client */
+    if (srv->keymap)
+        wthp_keyboard_send_keymap(wthp_keyboard, srv->keymap_format,
+                                  srv->keymap_size, srv->keymap);
+    if (srv->has_repeat_info)
+        wthp_keyboard_send_repeat_info(wthp_keyboard, srv->repeat_rate,
+                                       srv->repeat_delay);
+    wth_verbose(" <<< %s \n",__func__);
+}
+
 static void
 seat_get_touch(struct wthp_seat *wthp_seat, struct wthp_touch *wthp_touch)
 {
@@ -635,7 +1339,7 @@ seat_release(struct wthp_seat *wthp_seat)
 
 static const struct wthp_seat_interface seat_implementation = {
     seat_get_pointer,
-    NULL,
+    seat_get_keyboard,
     seat_get_touch,
     seat_release,
     NULL
@@ -650,6 +1354,9 @@ seat_send_updated_caps(struct seat *seat)
     caps |= WTHP_SEAT_CAPABILITY_POINTER;
     wth_verbose("WTHP_SEAT_CAPABILITY_POINTER %d\n", caps);
 
+    caps |= WTHP_SEAT_CAPABILITY_KEYBOARD;
+    wth_verbose("WTHP_SEAT_CAPABILITY_KEYBOARD %d\n", caps);
+
     caps |= WTHP_SEAT_CAPABILITY_TOUCH;
     wth_verbose("WTHP_SEAT_CAPABILITY_TOUCH %d\n", caps);
 
@@ -851,6 +1558,37 @@ registry_destroy(struct registry *reg)
     wth_verbose(" <<< %s \n",__func__);
 }
 
+/**
+* client_select_decoder
+*
+* Records the codec chosen by the client, which binds one of the globals
+* sent by registry_send_decoders(). The surfaces created afterwards use the
+* pipeline of that codec.
+*
+* @param names        struct client *c, const char *name
+* @param value        client, "<codec>/<cost>" part of the global's interface
+* @return             0 on success, -1 if the codec is not offered
+*/
+static int
+client_select_decoder(struct client *c, const char *name)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct decoder *dec;
+    size_t len = strcspn(name, "/");
+
+    wl_list_for_each(dec, &c->receiver->decoder_list, link) {
+        if (strlen(dec->codec) == len && strncmp(dec->codec, name, len) == 0) {
+            wth_verbose("Client %p selected codec %s\n", c, dec->codec);
+            c->decoder = dec;
+            wth_verbose(" <<< %s \n",__func__);
+            return 0;
+        }
+    }
+
+    wth_verbose(" <<< %s \n",__func__);
+    return -1;
+}
+
 static void
 registry_handle_destroy(struct wthp_registry *registry)
 {
@@ -887,6 +1625,10 @@ registry_handle_bind(struct wthp_registry *registry,
         client_bind_wthp_ivi_application(reg->client, (struct wthp_ivi_application *)id);
     } else if (strcmp(interface, "wthp_seat") == 0) {
         client_bind_seat(reg->client, (struct wthp_seat *)id);
+    } else if (strncmp(interface, "wthp_decoder/", 13) == 0 &&
+               client_select_decoder(reg->client, interface + 13) == 0) {
+        /* only a choice, there is no object behind it */
+        wth_object_delete(id);
     } else {
         wth_object_post_error((struct wth_object *)registry, 0,
                       "%s: unknown name %u", __func__, name);
@@ -904,6 +1646,59 @@ static const struct wthp_registry_interface registry_implementation = {
  * waltham display implementation
  */
 
+/**
+* registry_send_display_modes
+*
+* Advertises the modes of the local displays as registry globals. The
+* descriptor is carried in the interface name as
+* "wthp_output_mode/<output>/<width>x<height>@<refresh>/<flags>", these
+* globals cannot be bound.
+*
+* @param names        struct receiver *srv, struct wthp_registry *registry
+* @param value        receiver with the modes, registry of the client
+* @return             none
+*/
+static void
+registry_send_display_modes(struct receiver *srv, struct wthp_registry *registry)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct display_mode *mode;
+    char interface[64];
+
+    wl_list_for_each(mode, &srv->mode_list, link) {
+        snprintf(interface, sizeof interface,
+                 "wthp_output_mode/%u/%dx%d@%d/%u", mode->output,
+                 mode->width, mode->height, mode->refresh, mode->flags);
+        wthp_registry_send_global(registry, 1, interface, 1);
+    }
+    wth_verbose(" <<< %s \n",__func__);
+}
+
+/**
+* registry_send_decoders
+*
+* Advertises the codecs this receiver can decode as registry globals named
+* "wthp_decoder/<codec>/<cost>". The client binds the one it picked.
+*
+* @param names        struct receiver *srv, struct wthp_registry *registry
+* @param value        receiver with the decoders, registry of the client
+* @return             none
+*/
+static void
+registry_send_decoders(struct receiver *srv, struct wthp_registry *registry)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct decoder *dec;
+    char interface[64];
+
+    wl_list_for_each(dec, &srv->decoder_list, link) {
+        snprintf(interface, sizeof interface, "wthp_decoder/%s/%u",
+                 dec->codec, dec->cost);
+        wthp_registry_send_global(registry, 1, interface, 1);
+    }
+    wth_verbose(" <<< %s \n",__func__);
+}
+
 static void
 display_handle_client_version(struct wth_display *wth_display,
                   uint32_t client_version)
@@ -919,9 +1714,15 @@ display_handle_sync(struct wth_display * wth_display, struct wthp_callback * cal
 {
     wth_verbose("%s >>> \n",__func__);
     struct client *c = wth_object_get_user_data((struct wth_object *)wth_display);
+    struct timespec now;
 
     wth_verbose("Client %p requested wth_display.sync\n", c);
-    wthp_callback_send_done(callback, 0);
+
+    /* The answer carries our clock in ms, the same time base as the
+     * frame callbacks, so that the client can map them to its own clock.
+     */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    wthp_callback_send_done(callback, now.tv_sec * 1000 + now.tv_nsec / 1000000);
     wthp_callback_free(callback);
     wth_verbose(" <<< %s \n",__func__);
 }
@@ -950,6 +1751,8 @@ display_handle_get_registry(struct wth_display *wth_display,
     wthp_registry_send_global(registry, 1, "wthp_ivi_application", 1);
     wthp_registry_send_global(registry, 1, "wthp_seat", 4);
     wthp_registry_send_global(registry, 1, "wthp_blob_factory", 4);
+    registry_send_display_modes(c->receiver, registry);
+    registry_send_decoders(c->receiver, registry);
     wth_verbose(" <<< %s \n",__func__);
 }
 
@@ -967,6 +1770,7 @@ connection_handle_data(struct watch *w, uint32_t events)
 {
     wth_verbose("%s >>> \n",__func__);
     struct client *c = container_of(w, struct client, conn_watch);
+    int on = 1;
     int ret;
 
     if (events & EPOLLERR) {
@@ -1004,6 +1808,10 @@ connection_handle_data(struct watch *w, uint32_t events)
             return;
         }
 
+        /* TCP_QUICKACK does not stick, see client_set_low_latency() */
+        setsockopt(c->conn_watch.fd, IPPROTO_TCP, TCP_QUICKACK,
+                   &on, sizeof(on));
+
         ret = wth_connection_dispatch(c->connection);
         if (ret < 0 && errno != EPROTO) {
             wth_error("Client %p dispatch error.\n", c);
@@ -1015,6 +1823,39 @@ connection_handle_data(struct watch *w, uint32_t events)
     wth_verbose(" <<< %s \n",__func__);
 }
 
+/**
+* client_set_low_latency
+*
+* Send the input events without waiting: no Nagle, no delayed ACK of the
+* transmitter's messages, and the connection marked ahead of bulk traffic.
+* IP_TOS resets the socket priority, so it is set first.
+*
+* @param names        int fd
+* @param value        fd - socket of the client connection
+* @return             none
+*/
+static void
+client_setsockopt(int fd, int level, int name, int value, const char *what)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0)
+        wth_error("Failed to set %s: %s\n", what, strerror(errno));
+}
+
+static void
+client_set_low_latency(int fd)
+{
+    wth_verbose("%s >>> \n",__func__);
+
+    /* each option on its own, a failure does not skip the others */
+    client_setsockopt(fd, IPPROTO_IP, IP_TOS, SOCKET_DSCP << 2, "IP_TOS");
+    client_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    client_setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    client_setsockopt(fd, SOL_SOCKET, SO_PRIORITY, SOCKET_PRIORITY,
+                      "SO_PRIORITY");
+
+    wth_verbose(" <<< %s \n",__func__);
+}
+
 /**
 * client_create
 *
@@ -1041,6 +1882,7 @@ client_create(struct receiver *srv, struct wth_connection *conn)
     c->conn_watch.receiver = srv;
     c->conn_watch.fd = wth_connection_get_fd(conn);
     c->conn_watch.cb = connection_handle_data;
+    client_set_low_latency(c->conn_watch.fd);
     if (watch_ctl(&c->conn_watch, EPOLL_CTL_ADD, EPOLLIN) < 0) {
         free(c);
         return NULL;
@@ -1054,6 +1896,7 @@ client_create(struct receiver *srv, struct wth_connection *conn)
     wl_list_init(&c->compositor_list);
     wl_list_init(&c->seat_list);
     wl_list_init(&c->pointer_list);
+    wl_list_init(&c->keyboard_list);
     wl_list_init(&c->touch_list);
     wl_list_init(&c->region_list);
     wl_list_init(&c->surface_list);
@@ -1083,6 +1926,7 @@ client_destroy(struct client *c)
     struct compositor *comp;
     struct registry *reg;
     struct surface *surface;
+    struct keyboard *keyboard;
 
     wth_verbose("Client %p disconnected.\n", c);
 
@@ -1101,6 +1945,9 @@ client_destroy(struct client *c)
     wl_list_last_until_empty(surface, &c->surface_list, link)
         surface_destroy(surface);
 
+    wl_list_last_until_empty(keyboard, &c->keyboard_list, link)
+        keyboard_destroy(keyboard);
+
     wl_list_remove(&c->link);
     watch_ctl(&c->conn_watch, EPOLL_CTL_DEL, 0);
     wth_connection_destroy(c->connection);
@@ -1142,6 +1989,65 @@ receiver_flush_clients(struct receiver *srv)
 
 }
 
+/**
+* receiver_prepare_surfaces
+*
+* Dispatch the pending local compositor events of all displayed surfaces
+* and prepare to read their wayland sockets. Called before going to sleep.
+*
+* @param names        struct receiver *srv
+* @param value        socket connection info and client data
+* @return             none
+*/
+void
+receiver_prepare_surfaces(struct receiver *srv)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct client *c;
+    struct surface *surface;
+
+    wl_list_for_each(c, &srv->client_list, link) {
+        wl_list_for_each(surface, &c->surface_list, link) {
+            if (!surface->shm_window || !surface->shm_window->ready)
+                continue;
+
+            wth_receiver_weston_prepare_read(surface->shm_window);
+            surface->shm_window->read_prepared = true;
+        }
+    }
+    wth_verbose(" <<< %s \n",__func__);
+}
+
+/**
+* receiver_dispatch_surfaces
+*
+* Read and dispatch the local compositor events of all surfaces prepared
+* by receiver_prepare_surfaces(). Called right after waking up, before any
+* other event is handled.
+*
+* @param names        struct receiver *srv
+* @param value        socket connection info and client data
+* @return             none
+*/
+void
+receiver_dispatch_surfaces(struct receiver *srv)
+{
+    wth_verbose("%s >>> \n",__func__);
+    struct client *c;
+    struct surface *surface;
+
+    wl_list_for_each(c, &srv->client_list, link) {
+        wl_list_for_each(surface, &c->surface_list, link) {
+            if (!surface->shm_window || !surface->shm_window->read_prepared)
+                continue;
+
+            surface->shm_window->read_prepared = false;
+            wth_receiver_weston_dispatch(surface->shm_window);
+        }
+    }
+    wth_verbose(" <<< %s \n",__func__);
+}
+
 /**
 * receiver_accept_client
 *
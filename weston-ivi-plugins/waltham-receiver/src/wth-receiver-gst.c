@@ -35,7 +35,8 @@
  *******************************************************************************/
 
 #include <sys/mman.h>
-#include <signal.h>
+#include <limits.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <gst/gst.h>
 #include <GL/gl.h>
@@ -54,7 +55,6 @@
 #include "os-compatibility.h"
 #include "ivi-application-client-protocol.h"
 #include "bitmap.h"
-static int running = 1;
 
 typedef struct _GstAppContext
 {
@@ -65,6 +65,7 @@ typedef struct _GstAppContext
 	struct display *display;
 	struct window *window;
 	GstVideoInfo info;
+	pthread_t thread;
 }GstAppContext;
 
 static const gchar *vertex_shader_str =
@@ -106,6 +107,8 @@ pointer_handle_enter(void *data, struct wl_pointer *wl_pointer,
 	struct display *display = data;
 	struct window *window = display->window;
 
+	/* needed by wl_pointer.set_cursor */
+	display->pointer_serial = serial;
 	waltham_pointer_enter(window, serial, sx, sy);
 
 	wth_verbose(" <<< %s \n",__func__);
@@ -170,12 +173,71 @@ pointer_handle_axis(void *data, struct wl_pointer *wl_pointer,
 	wth_verbose(" <<< %s \n",__func__);
 }
 
+static void
+pointer_handle_frame(void *data, struct wl_pointer *wl_pointer)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	struct display *display = data;
+	struct window *window = display->window;
+
+	waltham_pointer_frame(window);
+
+	wth_verbose(" <<< %s \n",__func__);
+}
+
+static void
+pointer_handle_axis_source(void *data, struct wl_pointer *wl_pointer,
+		uint32_t axis_source)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	struct display *display = data;
+	struct window *window = display->window;
+
+	waltham_pointer_axis_source(window, axis_source);
+
+	wth_verbose(" <<< %s \n",__func__);
+}
+
+static void
+pointer_handle_axis_stop(void *data, struct wl_pointer *wl_pointer,
+		uint32_t time, uint32_t axis)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	struct display *display = data;
+	struct window *window = display->window;
+
+	waltham_pointer_axis_stop(window, time, axis);
+
+	wth_verbose(" <<< %s \n",__func__);
+}
+
+static void
+pointer_handle_axis_discrete(void *data, struct wl_pointer *wl_pointer,
+		uint32_t axis, int32_t discrete)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	struct display *display = data;
+	struct window *window = display->window;
+
+	waltham_pointer_axis_discrete(window, axis, discrete);
+
+	wth_verbose(" <<< %s \n",__func__);
+}
+
 static const struct wl_pointer_listener pointer_listener = {
 	pointer_handle_enter,
 	pointer_handle_leave,
 	pointer_handle_motion,
 	pointer_handle_button,
 	pointer_handle_axis,
+	pointer_handle_frame,
+	pointer_handle_axis_source,
+	pointer_handle_axis_stop,
+	pointer_handle_axis_discrete,
 };
 
 /*
@@ -261,6 +323,115 @@ static const struct wl_touch_listener touch_listener = {
 	touch_handle_cancel
 };
 
+/*
+ * keyboard callback functions
+ */
+static void
+keyboard_handle_keymap(void *data, struct wl_keyboard *wl_keyboard,
+		uint32_t format, int fd, uint32_t size)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	struct display *display = data;
+	struct window *window = display->window;
+	void *map;
+
+	/* the text goes to the waltham clients, they get their own copy
+	 * in a file on the transmitter */
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map != MAP_FAILED) {
+		waltham_keyboard_keymap(window, format, map, size);
+		munmap(map, size);
+	}
+	close(fd);
+
+	wth_verbose(" <<< %s \n",__func__);
+}
+
+static void
+keyboard_handle_enter(void *data, struct wl_keyboard *wl_keyboard,
+		uint32_t serial, struct wl_surface *surface,
+		struct wl_array *keys)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	struct display *display = data;
+	struct window *window = display->window;
+
+	waltham_keyboard_enter(window, serial, keys);
+
+	wth_verbose(" <<< %s \n",__func__);
+}
+
+static void
+keyboard_handle_leave(void *data, struct wl_keyboard *wl_keyboard,
+		uint32_t serial, struct wl_surface *surface)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	struct display *display = data;
+	struct window *window = display->window;
+
+	waltham_keyboard_leave(window, serial);
+
+	wth_verbose(" <<< %s \n",__func__);
+}
+
+static void
+keyboard_handle_key(void *data, struct wl_keyboard *wl_keyboard,
+		uint32_t serial, uint32_t time, uint32_t key,
+		uint32_t state)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	struct display *display = data;
+	struct window *window = display->window;
+
+	waltham_keyboard_key(window, serial, time, key, state);
+
+	wth_verbose(" <<< %s \n",__func__);
+}
+
+static void
+keyboard_handle_modifiers(void *data, struct wl_keyboard *wl_keyboard,
+		uint32_t serial, uint32_t mods_depressed,
+		uint32_t mods_latched, uint32_t mods_locked,
+		uint32_t group)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	struct display *display = data;
+	struct window *window = display->window;
+
+	waltham_keyboard_modifiers(window, serial, mods_depressed,
+				   mods_latched, mods_locked, group);
+
+	wth_verbose(" <<< %s \n",__func__);
+}
+
+static void
+keyboard_handle_repeat_info(void *data, struct wl_keyboard *wl_keyboard,
+		int32_t rate, int32_t delay)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	struct display *display = data;
+	struct window *window = display->window;
+
+	waltham_keyboard_repeat_info(window, rate, delay);
+
+	wth_verbose(" <<< %s \n",__func__);
+}
+
+static const struct wl_keyboard_listener keyboard_listener = {
+	keyboard_handle_keymap,
+	keyboard_handle_enter,
+	keyboard_handle_leave,
+	keyboard_handle_key,
+	keyboard_handle_modifiers,
+	keyboard_handle_repeat_info
+};
+
 /*
  * seat callback
  */
@@ -286,6 +457,19 @@ seat_capabilities(void *data, struct wl_seat *wl_seat, enum wl_seat_capability c
 		display->wl_pointer = NULL;
 	}
 
+	if ((caps & WL_SEAT_CAPABILITY_KEYBOARD) && !display->wl_keyboard)
+	{
+		wth_verbose("WL_SEAT_CAPABILITY_KEYBOARD\n");
+		display->wl_keyboard = wl_seat_get_keyboard(wl_seat);
+		wl_keyboard_set_user_data(display->wl_keyboard, display);
+		wl_keyboard_add_listener(display->wl_keyboard, &keyboard_listener, display);
+		wl_display_roundtrip(display->display);
+	} else if (!(caps & WL_SEAT_CAPABILITY_KEYBOARD) && display->wl_keyboard) {
+		wth_verbose("!WL_SEAT_CAPABILITY_KEYBOARD\n");
+		wl_keyboard_destroy(display->wl_keyboard);
+		display->wl_keyboard = NULL;
+	}
+
 	if ((caps & WL_SEAT_CAPABILITY_TOUCH) && !display->wl_touch)
 	{
 		wth_verbose("WL_SEAT_CAPABILITY_TOUCH\n");
@@ -302,9 +486,14 @@ seat_capabilities(void *data, struct wl_seat *wl_seat, enum wl_seat_capability c
 	wth_verbose(" <<< %s \n",__func__);
 }
 
+static void
+seat_name(void *data, struct wl_seat *wl_seat, const char *name)
+{
+}
+
 static const struct wl_seat_listener seat_listener = {
 	seat_capabilities,
-	NULL
+	seat_name
 };
 
 static void
@@ -315,8 +504,13 @@ add_seat(struct display *display, uint32_t id, uint32_t version)
 	display->wl_pointer = NULL;
 	display->wl_touch = NULL;
 	display->wl_keyboard = NULL;
+
+	/* version 5 for the wl_pointer frames motion is coalesced on */
+	if (version > 5)
+		version = 5;
+	display->pointer_frames = version >= 5;
 	display->seat = wl_registry_bind(display->registry, id,
-			&wl_seat_interface, 1);
+			&wl_seat_interface, version);
 	wl_seat_add_listener(display->seat, &seat_listener, display);
 	wth_verbose(" <<< %s \n",__func__);
 }
@@ -392,6 +586,8 @@ registry_handle_global(void *data, struct wl_registry *registry,
 					 &ivi_application_interface, 1);
 	} else if (strcmp(interface, "wl_seat") == 0) {
 		add_seat(d, id, version);
+	} else if (strcmp(interface, "wl_shm") == 0) {
+		d->shm = wl_registry_bind(registry, id, &wl_shm_interface, 1);
 	}
 	wth_verbose(" <<< %s \n",__func__);
 }
@@ -425,6 +621,371 @@ wth_receiver_weston_shm_commit(struct window *window)
 	/* stub */
 }
 
+/**
+ * wth_receiver_weston_set_cursor
+ *
+ * Shows the cursor image of the waltham client on the local pointer of
+ * the window, the local compositor moves it without waiting for the
+ * client. A NULL image hides the cursor.
+ *
+ * @param names        struct window *window
+ *                     const void *data
+ *                     int32_t width, height, stride
+ *                     uint32_t format
+ *                     int32_t hotspot_x, hotspot_y
+ * @param value        window - window under the pointer
+ *                     data - pixels, ARGB8888 or XRGB8888 wl_shm format
+ *                     hotspot_x, hotspot_y - in surface-local coordinates
+ * @return             none
+ */
+void
+wth_receiver_weston_set_cursor(struct window *window, const void *data,
+		int32_t width, int32_t height, int32_t stride, uint32_t format,
+		int32_t hotspot_x, int32_t hotspot_y)
+{
+	struct display *display = window->display;
+	struct wl_shm_pool *pool;
+	struct wl_buffer *buffer;
+	int32_t size = stride * height;
+	void *map;
+	int fd;
+
+	if (!display->wl_pointer)
+		return;
+
+	if (!data) {
+		wl_pointer_set_cursor(display->wl_pointer,
+				      display->pointer_serial, NULL, 0, 0);
+		return;
+	}
+
+	if (!display->shm || !display->compositor || size <= 0 ||
+	    (format != WL_SHM_FORMAT_ARGB8888 &&
+	     format != WL_SHM_FORMAT_XRGB8888))
+		return;
+
+	if (!display->cursor_surface) {
+		display->cursor_surface =
+			wl_compositor_create_surface(display->compositor);
+		if (!display->cursor_surface)
+			return;
+	}
+
+	fd = os_create_anonymous_file(size);
+	if (fd < 0) {
+		wth_error("creating a cursor buffer of %d B failed: %m\n", size);
+		return;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	memcpy(map, data, size);
+	munmap(map, size);
+
+	pool = wl_shm_create_pool(display->shm, fd, size);
+	buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
+					   stride, format);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	wl_surface_attach(display->cursor_surface, buffer, 0, 0);
+	wl_surface_damage(display->cursor_surface, 0, 0, width, height);
+	wl_surface_commit(display->cursor_surface);
+
+	/* the previous image is no longer attached */
+	if (display->cursor_buffer)
+		wl_buffer_destroy(display->cursor_buffer);
+	display->cursor_buffer = buffer;
+
+	wl_pointer_set_cursor(display->wl_pointer, display->pointer_serial,
+			      display->cursor_surface, hotspot_x, hotspot_y);
+}
+
+/*
+ * local display modes, see wth_receiver_weston_query_modes()
+ */
+#define MAX_LOCAL_OUTPUTS 8
+
+struct output_query {
+	struct receiver *srv;
+	uint32_t index;
+	struct wl_output *output;
+};
+
+struct mode_query {
+	struct output_query outputs[MAX_LOCAL_OUTPUTS];
+	uint32_t count;
+	struct receiver *srv;
+};
+
+static void
+output_handle_geometry(void *data, struct wl_output *wl_output,
+		int32_t x, int32_t y, int32_t physical_width,
+		int32_t physical_height, int32_t subpixel,
+		const char *make, const char *model, int32_t transform)
+{
+	/* stub */
+}
+
+static void
+output_handle_mode(void *data, struct wl_output *wl_output,
+		uint32_t flags, int32_t width, int32_t height, int32_t refresh)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	struct output_query *oq = data;
+	struct display_mode *mode;
+
+	wth_verbose("output %u mode %dx%d@%d flags %u\n",
+		    oq->index, width, height, refresh, flags);
+
+	mode = zalloc(sizeof *mode);
+	if (!mode)
+		return;
+
+	mode->output = oq->index;
+	mode->flags = flags;
+	mode->width = width;
+	mode->height = height;
+	mode->refresh = refresh;
+	wl_list_insert(oq->srv->mode_list.prev, &mode->link);
+
+	wth_verbose(" <<< %s \n",__func__);
+}
+
+static const struct wl_output_listener output_listener = {
+	output_handle_geometry,
+	output_handle_mode,
+};
+
+static void
+query_registry_handle_global(void *data, struct wl_registry *registry,
+		uint32_t id, const char *interface, uint32_t version)
+{
+	struct mode_query *q = data;
+	struct output_query *oq;
+
+	if (strcmp(interface, "wl_output") != 0 ||
+	    q->count == MAX_LOCAL_OUTPUTS)
+		return;
+
+	oq = &q->outputs[q->count];
+	oq->srv = q->srv;
+	oq->index = q->count++;
+	oq->output = wl_registry_bind(registry, id, &wl_output_interface, 1);
+	wl_output_add_listener(oq->output, &output_listener, oq);
+}
+
+static const struct wl_registry_listener query_registry_listener = {
+	query_registry_handle_global,
+	registry_handle_global_remove
+};
+
+/**
+ * wth_receiver_weston_query_modes
+ *
+ * Collects the modes of the displays of the local compositor into
+ * srv->mode_list, to be advertised to the waltham clients.
+ *
+ * @param names        struct receiver *srv
+ * @param value        receiver to store the modes in
+ * @return             0 on success, -1 if no mode was found
+ */
+int
+wth_receiver_weston_query_modes(struct receiver *srv)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	struct mode_query q;
+	struct wl_display *display;
+	struct wl_registry *registry;
+	uint32_t i;
+
+	memset(&q, 0, sizeof q);
+	q.srv = srv;
+
+	display = wl_display_connect(NULL);
+	if (!display)
+		return -1;
+
+	registry = wl_display_get_registry(display);
+	wl_registry_add_listener(registry, &query_registry_listener, &q);
+	/* globals, then the modes of the bound outputs */
+	wl_display_roundtrip(display);
+	wl_display_roundtrip(display);
+
+	for (i = 0; i < q.count; i++)
+		wl_output_destroy(q.outputs[i].output);
+	wl_registry_destroy(registry);
+	wl_display_disconnect(display);
+
+	wth_verbose(" <<< %s \n",__func__);
+	return wl_list_empty(&srv->mode_list) ? -1 : 0;
+}
+
+/**
+ * read_pipeline
+ *
+ * Reads a GStreamer pipeline description from a file.
+ *
+ * @param names        const char *path
+ * @param value        path of the pipeline file
+ * @return             the description to free(), NULL on error
+ */
+static char *
+read_pipeline(const char *path)
+{
+	FILE *pFile;
+	long lSize;
+	char *pipe;
+
+	pFile = fopen(path, "rb");
+	if (pFile == NULL)
+		return NULL;
+
+	/* obtain file size */
+	fseek(pFile, 0, SEEK_END);
+	lSize = ftell(pFile);
+	rewind(pFile);
+
+	/* allocate memory to contain the whole file */
+	pipe = zalloc(lSize + 1);
+	if (pipe == NULL) {
+		fclose(pFile);
+		return NULL;
+	}
+
+	/* copy the file into the buffer */
+	if (lSize <= 0 || fread(pipe, 1, lSize, pFile) != (size_t)lSize) {
+		free(pipe);
+		pipe = NULL;
+	}
+
+	fclose(pFile);
+	return pipe;
+}
+
+/*
+ * decoders offered to the waltham clients, see wth_receiver_weston_query_decoders()
+ */
+#define PIPELINE_DIR "/etc/xdg/weston"
+/* added to the cost of a decoder without hardware acceleration */
+#define SOFTWARE_DECODE_COST 100
+
+static const struct {
+	const char *codec;
+	uint32_t cost; /* stream cost, lower is better on the wire */
+} codecs[] = {
+	{ "h265", 1 },
+	{ "h264", 2 },
+	{ "jpeg", 3 },
+	{ "raw",  4 },
+};
+
+/**
+ * pipeline_is_hardware
+ *
+ * Tells whether any element of the pipeline is a hardware codec, from the
+ * klass of its factory.
+ *
+ * @param names        GstElement *pipeline
+ * @param value        parsed pipeline
+ * @return             true if a hardware element was found
+ */
+static bool
+pipeline_is_hardware(GstElement *pipeline)
+{
+	GstIterator *it;
+	GValue item = { 0 };
+	GstElement *element;
+	GstElementFactory *factory;
+	const gchar *klass;
+	bool hw = false;
+
+	it = gst_bin_iterate_recurse(GST_BIN(pipeline));
+	while (!hw && gst_iterator_next(it, &item) == GST_ITERATOR_OK) {
+		element = g_value_get_object(&item);
+		factory = gst_element_get_factory(element);
+		klass = factory ? gst_element_factory_get_metadata(factory,
+					GST_ELEMENT_METADATA_KLASS) : NULL;
+		if (klass && strstr(klass, "Hardware"))
+			hw = true;
+		g_value_unset(&item);
+	}
+	gst_iterator_free(it);
+
+	return hw;
+}
+
+/**
+ * wth_receiver_weston_query_decoders
+ *
+ * Collects the decoders which can be offered to the waltham clients into
+ * srv->decoder_list. A codec is offered when its receiver_pipeline_<codec>.cfg
+ * can be parsed, that is when all of its elements are installed. Hardware
+ * decoders are cheaper than software ones, then the codecs are ranked by
+ * their bandwidth.
+ *
+ * @param names        struct receiver *srv
+ * @param value        receiver to store the decoders in
+ * @return             the number of decoders found
+ */
+int
+wth_receiver_weston_query_decoders(struct receiver *srv)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	struct decoder *dec;
+	GstElement *pipeline;
+	GError *gerror = NULL;
+	char path[PATH_MAX];
+	char *pipe;
+	unsigned int i;
+	int count = 0;
+
+	gst_init(NULL, NULL);
+
+	for (i = 0; i < ARRAY_LENGTH(codecs); i++) {
+		snprintf(path, sizeof path, PIPELINE_DIR "/receiver_pipeline_%s.cfg",
+			 codecs[i].codec);
+		pipe = read_pipeline(path);
+		if (!pipe)
+			continue;
+
+		pipeline = gst_parse_launch(pipe, &gerror);
+		free(pipe);
+		if (gerror) {
+			wth_error("%s: %s\n", path, gerror->message);
+			g_error_free(gerror);
+			gerror = NULL;
+		}
+		if (!pipeline)
+			continue;
+
+		dec = zalloc(sizeof *dec);
+		if (!dec) {
+			gst_object_unref(pipeline);
+			break;
+		}
+
+		snprintf(dec->codec, sizeof dec->codec, "%s", codecs[i].codec);
+		dec->cost = codecs[i].cost;
+		if (!pipeline_is_hardware(pipeline))
+			dec->cost += SOFTWARE_DECODE_COST;
+		gst_object_unref(pipeline);
+
+		wth_verbose("decoder %s cost %u\n", dec->codec, dec->cost);
+		wl_list_insert(srv->decoder_list.prev, &dec->link);
+		count++;
+	}
+
+	wth_verbose(" <<< %s \n",__func__);
+	return count;
+}
+
 static struct display *
 create_display(void)
 {
@@ -441,6 +1002,10 @@ create_display(void)
 	assert(display->display);
 
 	display->has_xrgb = false;
+	display->shm = NULL;
+	display->pointer_serial = 0;
+	display->cursor_surface = NULL;
+	display->cursor_buffer = NULL;
 	display->registry = wl_display_get_registry(display->display);
 	wl_registry_add_listener(display->registry,
 			&registry_listener, display);
@@ -455,6 +1020,12 @@ destroy_display(struct display *display)
 {
 	wth_verbose("%s >>> \n",__func__);
 
+	if (display->cursor_buffer)
+		wl_buffer_destroy(display->cursor_buffer);
+	if (display->cursor_surface)
+		wl_surface_destroy(display->cursor_surface);
+	if (display->shm)
+		wl_shm_destroy(display->shm);
 	if (display->compositor)
 		wl_compositor_destroy(display->compositor);
 
@@ -615,6 +1186,35 @@ void init_gl(struct display *display)
 	return;
 }
 
+/*
+ * surface callbacks, the surface leaves every output when the ivi
+ * controller hides it
+ */
+static void
+surface_handle_enter(void *data, struct wl_surface *wl_surface,
+		struct wl_output *output)
+{
+	struct window *window = data;
+
+	if (window->outputs++ == 0)
+		waltham_surface_visibility(window, true);
+}
+
+static void
+surface_handle_leave(void *data, struct wl_surface *wl_surface,
+		struct wl_output *output)
+{
+	struct window *window = data;
+
+	if (window->outputs > 0 && --window->outputs == 0)
+		waltham_surface_visibility(window, false);
+}
+
+static const struct wl_surface_listener surface_listener = {
+	surface_handle_enter,
+	surface_handle_leave,
+};
+
 static void
 create_surface(struct window *window)
 {
@@ -624,6 +1224,8 @@ create_surface(struct window *window)
 
 	window->surface = wl_compositor_create_surface(display->compositor);
 	assert(window->surface);
+	window->outputs = 0;
+	wl_surface_add_listener(window->surface, &surface_listener, window);
 
 	window->native = wl_egl_window_create(window->surface,
 					      window->width, window->height);
@@ -698,10 +1300,49 @@ destroy_window(struct window *window)
 	wth_verbose(" <<< %s \n",__func__);
 }
 
+/*
+ * frame callback
+ */
 static void
-signal_int(int signum)
+frame_handle_done(void *data, struct wl_callback *callback, uint32_t time)
 {
-	running = 0;
+	wth_verbose("%s >>> \n",__func__);
+
+	struct window *window = data;
+
+	wl_callback_destroy(callback);
+	window->callback = NULL;
+
+	waltham_surface_frame_done(window, time);
+
+	wth_verbose(" <<< %s \n",__func__);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	frame_handle_done
+};
+
+/**
+ * wth_receiver_weston_request_frame
+ *
+ * Asks the local compositor for a frame callback on the window. The video
+ * itself is drawn by waylandsink on its own subsurface, the empty commit of
+ * the window only arms the callback, which fires at the next repaint of the
+ * output showing the window.
+ *
+ * @param names        struct window *window
+ * @param value        window started by wth_receiver_weston_main()
+ * @return             none
+ */
+void
+wth_receiver_weston_request_frame(struct window *window)
+{
+	if (window->callback)
+		return;
+
+	window->callback = wl_surface_frame(window->surface);
+	wl_callback_add_listener(window->callback, &frame_listener, window);
+	wl_surface_commit(window->surface);
 }
 
 void *stream_thread(void *data)
@@ -749,7 +1390,10 @@ pad_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 /**
  * wth_receiver_weston_main
  *
- * This is the main function which will handle connection to the compositor at receiver side
+ * Connects to the compositor at receiver side, creates the window and starts
+ * the GStreamer pipeline which renders the stream into it. The wayland events
+ * of the window are dispatched from the receiver main loop afterwards, see
+ * wth_receiver_weston_prepare_read() and wth_receiver_weston_dispatch().
  *
  * @param names        void *data
  * @param value        struct window data
@@ -760,120 +1404,186 @@ wth_receiver_weston_main(struct window *window)
 {
 	wth_verbose("%s >>> \n",__func__);
 
-	struct sigaction sigint;
-	pthread_t pthread;
-	GstAppContext gstctx;
-	int ret = 0;
+	GstAppContext *gstctx;
 	GError *gerror = NULL;
 	char * pipe = NULL;
-	FILE *pFile;
-	long lSize;
-	size_t res;
+	char path[PATH_MAX];
 	GstContext *context;
 
-	memset(&gstctx, 0, sizeof(gstctx));
+	gstctx = zalloc(sizeof(*gstctx));
+	if (!gstctx) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		return -1;
+	}
+
 	/* Initialization for window creation */
-	gstctx.display = create_display();
-	init_egl(gstctx.display);
+	gstctx->display = create_display();
+	/* before any roundtrip, the keymap comes as soon as the keyboard
+	 * is bound */
+	gstctx->display->window = window;
+	init_egl(gstctx->display);
 	/* ToDo: fix the hardcoded value of width, height */
-	create_window(window, gstctx.display,1920,1080);
-	init_gl(gstctx.display);
-	gstctx.window = window;
-
-	gstctx.display->window = window;
+	create_window(window, gstctx->display,1920,1080);
+	init_gl(gstctx->display);
+	gstctx->window = window;
 
-	wth_verbose("display %p\n", gstctx.display);
-	wth_verbose("display->window %p\n", gstctx.display->window);
+	wth_verbose("display %p\n", gstctx->display);
+	wth_verbose("display->window %p\n", gstctx->display->window);
 	wth_verbose("window %p\n", window);
 
-	sigint.sa_handler = signal_int;
-	sigemptyset(&sigint.sa_mask);
-	sigint.sa_flags = SA_RESETHAND;
-	sigaction(SIGINT, &sigint, NULL);
-
 	/* create gstreamer pipeline */
 	gst_init(NULL, NULL);
-	gstctx.loop = g_main_loop_new(NULL, FALSE);
-
-	/* Read pipeline from file */
-	pFile = fopen ( "/etc/xdg/weston/receiver_pipeline.cfg" , "rb" );
-	if (pFile==NULL){
-		fprintf(stderr, "failed to open file\n");
-		return -1;
+	gstctx->loop = g_main_loop_new(NULL, FALSE);
+
+	/* Read pipeline from file, the one of the codec chosen by the client
+	 * if any, see wth_receiver_weston_query_decoders().
+	 */
+	pipe = NULL;
+	if (window->codec) {
+		snprintf(path, sizeof path, PIPELINE_DIR "/receiver_pipeline_%s.cfg",
+			 window->codec);
+		pipe = read_pipeline(path);
 	}
-
-	/* obtain file size */
-	fseek (pFile , 0 , SEEK_END);
-	lSize = ftell (pFile);
-	rewind (pFile);
-
-	/* allocate memory to contain the whole file */
-	pipe = (char*) zalloc (sizeof(char)*lSize);
-	if (pipe == NULL){
-		fprintf(stderr,"Cannot allocate memory\n");
-		return -1;
-	}
-
-	/* copy the file into the buffer */
-	res = fread (pipe,1,lSize,pFile);
-	if (res != lSize){
-		fprintf(stderr,"File read error\n");
+	if (!pipe)
+		pipe = read_pipeline(PIPELINE_DIR "/receiver_pipeline.cfg");
+	if (!pipe) {
+		fprintf(stderr, "failed to read the pipeline file\n");
 		return -1;
 	}
 
 	wth_verbose("Gst Pipeline=%s",pipe);
-	/* close file */
-	fclose (pFile);
 
 	/* parse the pipeline */
-	gstctx.pipeline = gst_parse_launch(pipe, &gerror);
+	gstctx->pipeline = gst_parse_launch(pipe, &gerror);
 
-	if(!gstctx.pipeline)
+	if(!gstctx->pipeline)
 		fprintf(stderr,"Could not create gstreamer pipeline.\n");
 	free(pipe);
 
-	gstctx.bus = gst_pipeline_get_bus((GstPipeline*)((void*)gstctx.pipeline));
-	gst_bus_add_watch(gstctx.bus, bus_message, &gstctx);
+	gstctx->bus = gst_pipeline_get_bus((GstPipeline*)((void*)gstctx->pipeline));
+	gst_bus_add_watch(gstctx->bus, bus_message, gstctx);
 	fprintf(stderr, "registered bus signal\n");
 
 	/* get sink element */
-	gstctx.sink = gst_bin_get_by_name(GST_BIN(gstctx.pipeline), "sink");
+	gstctx->sink = gst_bin_get_by_name(GST_BIN(gstctx->pipeline), "sink");
 	/* get display context */
-	context = gst_wayland_display_handle_context_new(gstctx.display->display);
+	context = gst_wayland_display_handle_context_new(gstctx->display->display);
 	/* set external display from context to sink */
-	gst_element_set_context(gstctx.sink,context);
+	gst_element_set_context(gstctx->sink,context);
 	/* Attach existing surface to sink */
-	gst_video_overlay_set_window_handle(GST_VIDEO_OVERLAY (gstctx.sink),window->surface);
+	gst_video_overlay_set_window_handle(GST_VIDEO_OVERLAY (gstctx->sink),window->surface);
 
-	gst_pad_add_probe(gst_element_get_static_pad(gstctx.sink, "sink"),
+	gst_pad_add_probe(gst_element_get_static_pad(gstctx->sink, "sink"),
 			GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
-			pad_probe, &gstctx, NULL);
+			pad_probe, gstctx, NULL);
 
 	fprintf(stderr, "set state as playing\n");
-	gst_element_set_state((GstElement*)((void*)gstctx.pipeline), GST_STATE_PLAYING);
+	gst_element_set_state((GstElement*)((void*)gstctx->pipeline), GST_STATE_PLAYING);
 
 
-	pthread_create(&pthread, NULL, &stream_thread, gstctx.loop);
+	pthread_create(&gstctx->thread, NULL, &stream_thread, gstctx->loop);
 
 	fprintf(stderr, "rendering part\n");
 
-	wth_verbose("in render loop\n");
-	while (running && ret != -1)
-		ret=wl_display_dispatch_pending(gstctx.display->display);
+	window->gstctx = gstctx;
+	window->ready = true;
+
+	wth_verbose(" <<< %s \n",__func__);
+
+	return 0;
+}
 
+/**
+ * wth_receiver_weston_destroy
+ *
+ * Stops the pipeline of the window and disconnects from the compositor.
+ * The window itself is freed.
+ *
+ * @param names        struct window *window
+ * @param value        window started by wth_receiver_weston_main()
+ * @return             none
+ */
+void
+wth_receiver_weston_destroy(struct window *window)
+{
+	wth_verbose("%s >>> \n",__func__);
+
+	GstAppContext *gstctx = window->gstctx;
+	struct display *display = window->display;
 
 	wth_verbose("wth_receiver_gst_main exiting\n");
 
-	if (window->display->ivi_application) {
+	if (display->ivi_application) {
 		ivi_surface_destroy(window->ivi_surface);
-		ivi_application_destroy(window->display->ivi_application);
+		ivi_application_destroy(display->ivi_application);
 	}
 
-	gst_element_set_state((GstElement*)((void*)gstctx.pipeline), GST_STATE_NULL);
+	gst_element_set_state((GstElement*)((void*)gstctx->pipeline), GST_STATE_NULL);
+	g_main_loop_quit(gstctx->loop);
+	pthread_join(gstctx->thread, NULL);
+	g_main_loop_unref(gstctx->loop);
+
 	destroy_window(window);
-	destroy_display(gstctx.display);
+	destroy_display(display);
+	free(gstctx);
 
 	wth_verbose(" <<< %s \n",__func__);
+}
 
-	return 0;
+/**
+ * wth_receiver_weston_prepare_read
+ *
+ * Dispatches the queued wayland events of the window and announces the
+ * intention to read the display socket. Must be followed by
+ * wth_receiver_weston_dispatch() once the main loop has woken up.
+ *
+ * The waylandsink thread reads the same socket for its own queue; with
+ * the prepare/read protocol the events for our queue are never read
+ * behind our back while the main loop sleeps.
+ *
+ * @param names        struct window *window
+ * @param value        window started by wth_receiver_weston_main()
+ * @return             none
+ */
+void
+wth_receiver_weston_prepare_read(struct window *window)
+{
+	struct wl_display *display = window->display->display;
+
+	while (wl_display_prepare_read(display) != 0)
+		wl_display_dispatch_pending(display);
+
+	wl_display_flush(display);
+}
+
+/**
+ * wth_receiver_weston_dispatch
+ *
+ * Reads the display socket if it is readable, otherwise gives up the read
+ * prepared by wth_receiver_weston_prepare_read(), then dispatches the
+ * wayland events of the window.
+ *
+ * @param names        struct window *window
+ * @param value        window started by wth_receiver_weston_main()
+ * @return             none
+ */
+void
+wth_receiver_weston_dispatch(struct window *window)
+{
+	struct wl_display *display = window->display->display;
+	struct pollfd pfd;
+
+	pfd.fd = wl_display_get_fd(display);
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	/* wl_display_read_events() waits for the other readers when there
+	 * is nothing to read, so only call it for a readable socket.
+	 */
+	if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))
+		wl_display_read_events(display);
+	else
+		wl_display_cancel_read(display);
+
+	wl_display_dispatch_pending(display);
 }
@@ -39,6 +39,10 @@
 #define MAX_EPOLL_WATCHES 2
 
 uint16_t tcp_port;
+const char *record_path;
+
+extern int wth_receiver_weston_query_modes(struct receiver *srv);
+extern int wth_receiver_weston_query_decoders(struct receiver *srv);
 
 /** Print out the application help
  */
@@ -47,12 +51,14 @@ static void usage(void)
     printf("Usage: waltham receiver [options]\n");
     printf("Options:\n");
     printf("  -p --port number          TCP port number\n");
+    printf("  -r --record file          Record the input sent to the clients\n");
     printf("  -h --help                 Usage\n");
     printf("  -v --verbose              Set verbose flag (Default:%d)\n", get_verbosity());
 }
 
 static struct option long_options[] = {
     {"port",     required_argument,  0,  'p'},
+    {"record",   required_argument,  0,  'r'},
     {"verbose",  no_argument,    0,  'v'},
     {"help",     no_argument,    0,  'h'},
     {0,          0,              0,   0}
@@ -76,7 +82,7 @@ static int parse_args(int argc, char *argv[])
 
     while ((c = getopt_long(argc,
                             argv,
-                            "p:vh",
+                            "p:r:vh",
                             long_options,
                             &long_index)) != -1)
     {
@@ -85,6 +91,9 @@ static int parse_args(int argc, char *argv[])
         case 'p':
             tcp_port = atoi(optarg);
             break;
+        case 'r':
+            record_path = optarg;
+            break;
         case 'v':
 #if DEBUG
             set_verbosity(1);
@@ -123,6 +132,37 @@ watch_ctl(struct watch *w, int op, uint32_t events)
     return epoll_ctl(w->receiver->epoll_fd, op, w->fd, &ee);
 }
 
+/**
+ * record_open
+ *
+ * Starts the input recording given with -r
+ *
+ * @param srv The receiver
+ *
+ * @return 0 on success, -1 otherwise
+ */
+static int
+record_open(struct receiver *srv)
+{
+    uint32_t header[2] = { INPUT_RECORD_MAGIC, INPUT_RECORD_VERSION };
+    struct timespec ts;
+
+    srv->record = fopen(record_path, "wb");
+    if (!srv->record)
+        return -1;
+
+    if (fwrite(header, sizeof header, 1, srv->record) != 1) {
+        fclose(srv->record);
+        srv->record = NULL;
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    srv->record_start = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    return 0;
+}
+
 /**
 * listen_socket_handle_data
 *
@@ -186,11 +226,19 @@ receiver_mainloop(struct receiver *srv)
     while (srv->running) {
         /* Run any idle tasks at this point. */
 
+        /* Local input dispatched here is sent by the flush below */
+        receiver_prepare_surfaces(srv);
         receiver_flush_clients(srv);
 
         /* Wait for events or signals */
         count = epoll_wait(srv->epoll_fd,
                    ee, ARRAY_LENGTH(ee), -1);
+
+        /* Finish the wayland reads before any handler may use the
+         * local compositor connections.
+         */
+        receiver_dispatch_surfaces(srv);
+
         if (count < 0 && errno != EINTR) {
             perror("Error with epoll_wait");
             break;
@@ -284,6 +332,8 @@ main(int argc, char *argv[])
 {
     struct receiver srv = { 0 };
     struct client *c;
+    struct display_mode *mode;
+    struct decoder *dec;
 
     wth_verbose("%s >>> \n",__func__);
 
@@ -296,6 +346,21 @@ main(int argc, char *argv[])
     set_sigint_handler(&srv.running);
 
     wl_list_init(&srv.client_list);
+    wl_list_init(&srv.mode_list);
+    wl_list_init(&srv.decoder_list);
+
+    /* Modes of the local displays, advertised to the clients */
+    if (wth_receiver_weston_query_modes(&srv) < 0)
+        wth_error("No local display modes to advertise\n");
+
+    /* Codecs the clients can choose from */
+    if (wth_receiver_weston_query_decoders(&srv) == 0)
+        wth_error("No codec pipeline, using receiver_pipeline.cfg\n");
+
+    if (record_path && record_open(&srv) < 0) {
+        perror("Error opening the input recording");
+        exit(1);
+    }
 
     srv.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
     if (srv.epoll_fd == -1) {
@@ -329,6 +394,21 @@ main(int argc, char *argv[])
     close(srv.listen_fd);
     close(srv.epoll_fd);
 
+    wl_list_last_until_empty(mode, &srv.mode_list, link) {
+        wl_list_remove(&mode->link);
+        free(mode);
+    }
+
+    wl_list_last_until_empty(dec, &srv.decoder_list, link) {
+        wl_list_remove(&dec->link);
+        free(dec);
+    }
+
+    free(srv.keymap);
+
+    if (srv.record)
+        fclose(srv.record);
+
     wth_verbose(" <<< %s \n",__func__);
     return 0;
 }
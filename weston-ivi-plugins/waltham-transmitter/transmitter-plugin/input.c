@@ -26,9 +26,11 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
-
-/* for fake stuff */
-#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include "compositor.h"
 
@@ -47,11 +49,6 @@
  * implementation, but no in-tree code is calling it.
  */
 
-/* XXX: all functions and variables with a name, and things marked with a
- * comment, containing the word "fake" are mockups that need to be
- * removed from the final implementation.
- */
-
 static void
 pointer_focus_grab_handler(struct weston_pointer_grab *grab)
 {
@@ -294,12 +291,296 @@ seat_get_pointer_handler(struct wl_listener *listener, void *data)
 		wl_pointer_send_frame(new_pointer);
 }
 
+/* The cursor of a remoted surface is drawn by the receiver on its local
+ * pointer, so that it follows the hand at the local rate instead of
+ * waiting for a video frame. Only the image and the hotspot cross the
+ * network, once per change, on a cursor wthp_surface of the seat.
+ *
+ * wl_pointer.set_cursor never reaches the Weston core handler in a useful
+ * way: pointer->focus is not set for remoted surfaces, so the request is
+ * ignored there. libweston dispatches it with its own wl_pointer
+ * implementation, which cannot be wrapped without losing its destroy
+ * hook, so the request is observed with a protocol logger instead. The
+ * logger only exists while a remoted surface has the pointer focus, and
+ * drops any other request with two pointer compares.
+ */
+
+static uint32_t
+cursor_hash_add(uint32_t hash, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < size; i++)
+		hash = (hash ^ p[i]) * 16777619u;
+
+	return hash;
+}
+
+/** Send the cursor image of the seat to the receiver, if it changed. */
+void
+transmitter_seat_send_cursor(struct weston_transmitter_seat *seat)
+{
+	struct weston_transmitter_remote *remote = seat->remote;
+	struct waltham_display *dpy = remote->display;
+	struct weston_surface *ws = seat->cursor_surface;
+	struct weston_pointer *pointer;
+	struct weston_buffer *buffer;
+	struct wl_shm_buffer *shm = NULL;
+	struct wthp_buffer *wthp_buf;
+	int32_t width, height, stride;
+	uint32_t format, hash;
+	void *data;
+
+	if (!dpy || !dpy->running || !dpy->pointer ||
+	    !dpy->compositor || !dpy->blob_factory)
+		return;
+
+	pointer = weston_seat_get_pointer(seat->base);
+	if (!pointer)
+		return;
+
+	if (!ws) {
+		wthp_pointer_set_cursor(dpy->pointer, pointer->focus_serial,
+					NULL, 0, 0);
+		seat->cursor_hash = 0;
+		transmitter_remote_flush(remote);
+		return;
+	}
+
+	buffer = ws->buffer_ref.buffer;
+	if (buffer)
+		shm = wl_shm_buffer_get(buffer->resource);
+	if (!shm)
+		return;
+
+	width = wl_shm_buffer_get_width(shm);
+	height = wl_shm_buffer_get_height(shm);
+	stride = wl_shm_buffer_get_stride(shm);
+	format = wl_shm_buffer_get_format(shm);
+	if (format != WL_SHM_FORMAT_ARGB8888 &&
+	    format != WL_SHM_FORMAT_XRGB8888)
+		return;
+
+	wl_shm_buffer_begin_access(shm);
+	data = wl_shm_buffer_get_data(shm);
+
+	hash = cursor_hash_add(2166136261u, data, (size_t)stride * height);
+	hash = cursor_hash_add(hash, &width, sizeof width);
+	hash = cursor_hash_add(hash, &height, sizeof height);
+	hash = cursor_hash_add(hash, &seat->cursor_hotspot_x,
+			       sizeof seat->cursor_hotspot_x);
+	hash = cursor_hash_add(hash, &seat->cursor_hotspot_y,
+			       sizeof seat->cursor_hotspot_y);
+
+	if (seat->wthp_cursor && hash == seat->cursor_hash) {
+		wl_shm_buffer_end_access(shm);
+		return;
+	}
+
+	if (!seat->wthp_cursor)
+		seat->wthp_cursor = wthp_compositor_create_surface(dpy->compositor);
+
+	/* the receiver keeps a copy of the image, the buffer is not
+	 * needed past the commit */
+	wthp_buf = wthp_blob_factory_create_buffer(dpy->blob_factory,
+						   stride * height, data,
+						   width, height, stride,
+						   format);
+	wl_shm_buffer_end_access(shm);
+
+	wthp_surface_attach(seat->wthp_cursor, wthp_buf, 0, 0);
+	wthp_surface_damage(seat->wthp_cursor, 0, 0, width, height);
+	wthp_surface_commit(seat->wthp_cursor);
+	wthp_buffer_destroy(wthp_buf);
+
+	wthp_pointer_set_cursor(dpy->pointer, pointer->focus_serial,
+				seat->wthp_cursor,
+				seat->cursor_hotspot_x, seat->cursor_hotspot_y);
+	seat->cursor_hash = hash;
+
+	transmitter_remote_flush(remote);
+}
+
+static void
+seat_cursor_commit_handler(struct wl_listener *listener, void *data)
+{
+	struct weston_transmitter_seat *seat =
+		wl_container_of(listener, seat, cursor_commit_listener);
+
+	transmitter_seat_send_cursor(seat);
+}
+
+static void
+transmitter_seat_set_cursor(struct weston_transmitter_seat *seat,
+			    struct weston_surface *ws,
+			    int32_t hotspot_x, int32_t hotspot_y)
+{
+	if (ws != seat->cursor_surface) {
+		wl_list_remove(&seat->cursor_commit_listener.link);
+		wl_list_init(&seat->cursor_commit_listener.link);
+		wl_list_remove(&seat->cursor_destroy_listener.link);
+		wl_list_init(&seat->cursor_destroy_listener.link);
+
+		seat->cursor_surface = ws;
+		if (ws) {
+			wl_signal_add(&ws->commit_signal,
+				      &seat->cursor_commit_listener);
+			wl_signal_add(&ws->destroy_signal,
+				      &seat->cursor_destroy_listener);
+		}
+	}
+
+	seat->cursor_hotspot_x = hotspot_x;
+	seat->cursor_hotspot_y = hotspot_y;
+
+	transmitter_seat_send_cursor(seat);
+}
+
+static void
+seat_cursor_destroy_handler(struct wl_listener *listener, void *data)
+{
+	struct weston_transmitter_seat *seat =
+		wl_container_of(listener, seat, cursor_destroy_listener);
+
+	transmitter_seat_set_cursor(seat, NULL, 0, 0);
+}
+
+/** Protocol logger catching wl_pointer.set_cursor from the focused client */
+static void
+seat_cursor_logger(void *user_data, enum wl_protocol_logger_type direction,
+		   const struct wl_protocol_logger_message *message)
+{
+	struct weston_transmitter_seat *seat = user_data;
+	struct wl_resource *resource = message->resource;
+	struct wl_resource *surface_resource;
+	struct weston_surface *ws = NULL;
+
+	/* wl_pointer_interface is shared with libweston, so the message
+	 * pointer tells the interface and the request at once */
+	if (message->message !=
+	    &wl_pointer_interface.methods[WL_POINTER_SET_CURSOR] ||
+	    direction != WL_PROTOCOL_LOGGER_REQUEST)
+		return;
+
+	if (wl_resource_get_user_data(resource) !=
+	    weston_seat_get_pointer(seat->base))
+		return;
+
+	if (!seat->pointer_focus || !seat->pointer_focus->surface ||
+	    wl_resource_get_client(seat->pointer_focus->surface->resource) !=
+	    wl_resource_get_client(resource))
+		return;
+
+	/* serial, surface, hotspot_x, hotspot_y */
+	surface_resource = (struct wl_resource *)message->arguments[1].o;
+	if (surface_resource)
+		ws = wl_resource_get_user_data(surface_resource);
+
+	transmitter_seat_set_cursor(seat, ws, message->arguments[2].i,
+				    message->arguments[3].i);
+}
+
+/** Watch wl_pointer.set_cursor while a remoted surface has the focus. */
+static void
+transmitter_seat_watch_cursor(struct weston_transmitter_seat *seat,
+			      bool watch)
+{
+	if (watch && !seat->cursor_logger) {
+		seat->cursor_logger =
+			wl_display_add_protocol_logger(seat->base->compositor->wl_display,
+						       seat_cursor_logger, seat);
+	} else if (!watch && seat->cursor_logger) {
+		wl_protocol_logger_destroy(seat->cursor_logger);
+		seat->cursor_logger = NULL;
+	}
+}
+
+/* gains of the alpha-beta filter, close to critical damping */
+#define PREDICTION_ALPHA 0.5
+#define PREDICTION_BETA 0.15
+/* a longer pause between samples restarts from rest, ms */
+#define PREDICTION_GAP 50
+/* lead never goes further, ms */
+#define PREDICTION_MAX 50
+
+/** Time the position of a sample is sent ahead by, ms.
+ *
+ * The configured input-prediction, or for a negative value the time the
+ * picture takes back to the receiver: encode and decode, which is
+ * pipeline-latency, and half the round trip time.
+ */
+static int32_t
+transmitter_prediction_horizon(struct weston_transmitter_remote *remote)
+{
+	int32_t horizon = remote->input_prediction;
+
+	if (horizon < 0) {
+		horizon = remote->srtt / 2000;
+		if (remote->pipeline_latency > 0)
+			horizon += remote->pipeline_latency;
+	}
+
+	return horizon < PREDICTION_MAX ? horizon : PREDICTION_MAX;
+}
+
+/** Feed a sample to the predictor, and move it ahead by horizon ms.
+ *
+ * The sample position itself is kept exact, only the lead comes from the
+ * filtered velocity, so a finger at rest is not moved.
+ */
+static void
+transmitter_predictor_update(struct transmitter_predictor *p,
+			     int32_t horizon, uint32_t time,
+			     wl_fixed_t *x, wl_fixed_t *y)
+{
+	double zx = wl_fixed_to_double(*x);
+	double zy = wl_fixed_to_double(*y);
+	int32_t dt = (int32_t)(time - p->time);
+	double rx, ry;
+
+	if (!p->valid || dt < 0 || dt > PREDICTION_GAP) {
+		p->x = zx;
+		p->y = zy;
+		p->vx = 0.0;
+		p->vy = 0.0;
+	} else if (dt > 0) {
+		rx = zx - (p->x + p->vx * dt);
+		ry = zy - (p->y + p->vy * dt);
+		p->x += p->vx * dt + PREDICTION_ALPHA * rx;
+		p->y += p->vy * dt + PREDICTION_ALPHA * ry;
+		p->vx += PREDICTION_BETA * rx / dt;
+		p->vy += PREDICTION_BETA * ry / dt;
+	}
+
+	p->valid = true;
+	p->time = time;
+	p->real_x = *x;
+	p->real_y = *y;
+	p->predicted = horizon > 0 && (p->vx != 0.0 || p->vy != 0.0);
+
+	if (p->predicted) {
+		*x = wl_fixed_from_double(zx + p->vx * horizon);
+		*y = wl_fixed_from_double(zy + p->vy * horizon);
+	}
+}
+
+/* A prediction was sent, settle it if no sample follows */
+static void
+transmitter_seat_predict_arm(struct weston_transmitter_seat *seat,
+			     const struct transmitter_predictor *p)
+{
+	if (p->predicted && seat->predict_timer)
+		wl_event_source_timer_update(seat->predict_timer,
+					     PREDICTION_GAP);
+}
+
 static void
 transmitter_seat_create_pointer(struct weston_transmitter_seat *seat)
 {
 	struct weston_pointer *pointer;
 
-	seat->pointer_phase = 0.0;
 	seat->pointer_surface_x = wl_fixed_from_int(-1000000);
 	seat->pointer_surface_y = wl_fixed_from_int(-1000000);
 	seat->pointer_focus = NULL;
@@ -317,6 +598,9 @@ transmitter_seat_create_pointer(struct weston_transmitter_seat *seat)
 	wl_list_remove(&pointer->output_destroy_listener.link);
 	wl_list_init(&pointer->output_destroy_listener.link);
 
+	seat->cursor_commit_listener.notify = seat_cursor_commit_handler;
+	seat->cursor_destroy_listener.notify = seat_cursor_destroy_handler;
+
 	weston_log("Transmitter created pointer=%p for seat %p\n",
 		   pointer, seat->base);
 }
@@ -331,6 +615,7 @@ seat_pointer_focus_destroy_handler(struct wl_listener *listener, void *data)
 	assert(seat->pointer_focus == txs);
 
 	seat->pointer_focus = NULL;
+	transmitter_seat_watch_cursor(seat, false);
 }
 
 void
@@ -356,6 +641,7 @@ transmitter_seat_pointer_enter(struct weston_transmitter_seat *seat,
 		seat_pointer_focus_destroy_handler;
 	wl_signal_add(&txs->destroy_signal,
 		      &seat->pointer_focus_destroy_listener);
+	transmitter_seat_watch_cursor(seat, true);
 
 	/* If pointer-focus gets destroyed, txs will get destroyed, the
 	 * remote surface object is destroyed, and the remote will send a
@@ -364,9 +650,14 @@ transmitter_seat_pointer_enter(struct weston_transmitter_seat *seat,
 
 	seat->pointer_surface_x = surface_x;
 	seat->pointer_surface_y = surface_y;
+	memset(&seat->pointer_predictor, 0, sizeof seat->pointer_predictor);
 
 	pointer->focus_serial = serial;
 
+	/* first enter on a new connection */
+	if (seat->cursor_surface && !seat->wthp_cursor)
+		transmitter_seat_send_cursor(seat);
+
 	/* pointer->focus is not used, because it is a weston_view, while
 	 * remoted surfaces have no views.
 	 *
@@ -405,6 +696,8 @@ transmitter_seat_pointer_leave(struct weston_transmitter_seat *seat,
 	seat->pointer_focus = NULL;
 	wl_list_remove(&seat->pointer_focus_destroy_listener.link);
 	wl_list_init(&seat->pointer_focus_destroy_listener.link);
+	memset(&seat->pointer_predictor, 0, sizeof seat->pointer_predictor);
+	transmitter_seat_watch_cursor(seat, false);
 
 	if (!txs)
 		return;
@@ -451,6 +744,13 @@ transmitter_seat_pointer_motion(struct weston_transmitter_seat *seat,
 		assert(wl_resource_get_client(txs->surface->resource) ==
 		       pointer->focus_client->client);
 
+	if (seat->remote->input_prediction != 0) {
+		transmitter_predictor_update(&seat->pointer_predictor,
+			transmitter_prediction_horizon(seat->remote),
+			time, &surface_x, &surface_y);
+		transmitter_seat_predict_arm(seat, &seat->pointer_predictor);
+	}
+
 	focus_resource_list = &pointer->focus_client->pointer_resources;
 	wl_resource_for_each(resource, focus_resource_list) {
 		wl_pointer_send_motion(resource, time,
@@ -469,6 +769,7 @@ transmitter_seat_pointer_button(struct weston_transmitter_seat *seat,
 	struct wl_list *focus_resource_list;
 	struct wl_resource *resource;
 	struct weston_transmitter_surface *txs;
+	struct transmitter_predictor *predictor;
 
 	pointer = weston_seat_get_pointer(seat->base);
 	assert(pointer);
@@ -481,11 +782,18 @@ transmitter_seat_pointer_button(struct weston_transmitter_seat *seat,
 		assert(wl_resource_get_client(txs->surface->resource) ==
 		       pointer->focus_client->client);
 
+	/* a click lands where the receiver saw it, not ahead */
+	predictor = &seat->pointer_predictor;
 	focus_resource_list = &pointer->focus_client->pointer_resources;
 	wl_resource_for_each(resource, focus_resource_list) {
+		if (predictor->predicted)
+			wl_pointer_send_motion(resource, time,
+					       predictor->real_x,
+					       predictor->real_y);
 		wl_pointer_send_button(resource, serial, time,
 				       button, state);
         }
+	predictor->predicted = false;
 }
 
 void
@@ -527,11 +835,30 @@ transmitter_seat_pointer_frame(struct weston_transmitter_seat *seat)
 		weston_pointer_send_frame(pointer);
 }
 
+/* The receiver sends axis_source, axis_discrete and axis_stop within the
+ * pointer frame of the axis events they belong to. Clients bound before
+ * the event existed do not get it.
+ */
 void
 transmitter_seat_pointer_axis_source(struct weston_transmitter_seat *seat,
 				     uint32_t axis_source)
 {
-	/* ToDo : implement axis event handling */
+	struct weston_pointer *pointer;
+	struct wl_list *focus_resource_list;
+	struct wl_resource *resource;
+
+	pointer = weston_seat_get_pointer(seat->base);
+	assert(pointer);
+
+	if (!pointer->focus_client)
+		return;
+
+	focus_resource_list = &pointer->focus_client->pointer_resources;
+	wl_resource_for_each(resource, focus_resource_list) {
+		if (wl_resource_get_version(resource) >=
+		    WL_POINTER_AXIS_SOURCE_SINCE_VERSION)
+			wl_pointer_send_axis_source(resource, axis_source);
+	}
 }
 
 void
@@ -539,7 +866,22 @@ transmitter_seat_pointer_axis_stop(struct weston_transmitter_seat *seat,
 				   uint32_t time,
 				   uint32_t axis)
 {
-	/* ToDo : implement axis event handling */
+	struct weston_pointer *pointer;
+	struct wl_list *focus_resource_list;
+	struct wl_resource *resource;
+
+	pointer = weston_seat_get_pointer(seat->base);
+	assert(pointer);
+
+	if (!pointer->focus_client)
+		return;
+
+	focus_resource_list = &pointer->focus_client->pointer_resources;
+	wl_resource_for_each(resource, focus_resource_list) {
+		if (wl_resource_get_version(resource) >=
+		    WL_POINTER_AXIS_STOP_SINCE_VERSION)
+			wl_pointer_send_axis_stop(resource, time, axis);
+	}
 }
 
 void
@@ -547,7 +889,88 @@ transmitter_seat_pointer_axis_discrete(struct weston_transmitter_seat *seat,
 				       uint32_t axis,
 				       int32_t discrete)
 {
-	/* ToDo : implement axis event handling */
+	struct weston_pointer *pointer;
+	struct wl_list *focus_resource_list;
+	struct wl_resource *resource;
+
+	pointer = weston_seat_get_pointer(seat->base);
+	assert(pointer);
+
+	if (!pointer->focus_client)
+		return;
+
+	focus_resource_list = &pointer->focus_client->pointer_resources;
+	wl_resource_for_each(resource, focus_resource_list) {
+		if (wl_resource_get_version(resource) >=
+		    WL_POINTER_AXIS_DISCRETE_SINCE_VERSION)
+			wl_pointer_send_axis_discrete(resource, axis,
+						      discrete);
+	}
+}
+
+static void
+focus_resource_destroy(struct transmitter_focus_resource *fr)
+{
+	wl_list_remove(&fr->destroy_listener.link);
+	wl_list_remove(&fr->link);
+	free(fr);
+}
+
+static void
+focus_resource_destroy_handler(struct wl_listener *listener, void *data)
+{
+	struct transmitter_focus_resource *fr =
+		wl_container_of(listener, fr, destroy_listener);
+
+	focus_resource_destroy(fr);
+}
+
+static void
+transmitter_focus_cache_clear(struct transmitter_focus_cache *cache)
+{
+	struct transmitter_focus_resource *fr, *tmp;
+
+	wl_list_for_each_safe(fr, tmp, &cache->resource_list, link)
+		focus_resource_destroy(fr);
+	cache->client = NULL;
+}
+
+/** Gather the resources of the focused client of an input device.
+ *
+ * \param cache The cache of the device in the transmitter seat.
+ * \param resource_list The resources of the device, of all clients.
+ * \param client The focused client, NULL for none.
+ *
+ * Called on focus changes only. The events in between are sent over the
+ * cache, which follows the destruction of its resources.
+ */
+static void
+transmitter_focus_cache_update(struct transmitter_focus_cache *cache,
+			       struct wl_list *resource_list,
+			       struct wl_client *client)
+{
+	struct transmitter_focus_resource *fr;
+	struct wl_resource *resource;
+
+	transmitter_focus_cache_clear(cache);
+	cache->client = client;
+	if (!client)
+		return;
+
+	wl_resource_for_each(resource, resource_list) {
+		if (wl_resource_get_client(resource) != client)
+			continue;
+
+		fr = zalloc(sizeof *fr);
+		if (!fr)
+			continue;
+
+		fr->resource = resource;
+		fr->destroy_listener.notify = focus_resource_destroy_handler;
+		wl_resource_add_destroy_listener(resource,
+						 &fr->destroy_listener);
+		wl_list_insert(cache->resource_list.prev, &fr->link);
+	}
 }
 
 static void
@@ -566,6 +989,24 @@ transmitter_seat_create_keyboard(struct weston_transmitter_seat *seat)
 		   keyboard, seat->base);
 }
 
+/* The keymap and the repeat info of the receiver replace those of the
+ * local compositor for the client, before it gets the focus.
+ */
+static void
+transmitter_keyboard_send_info(struct weston_transmitter_seat *seat,
+			       struct wl_resource *resource)
+{
+	if (seat->keymap_fd >= 0)
+		wl_keyboard_send_keymap(resource, seat->keymap_format,
+					seat->keymap_fd, seat->keymap_size);
+
+	if (seat->repeat_rate >= 0 &&
+	    wl_resource_get_version(resource) >=
+	    WL_KEYBOARD_REPEAT_INFO_SINCE_VERSION)
+		wl_keyboard_send_repeat_info(resource, seat->repeat_rate,
+					     seat->repeat_delay);
+}
+
 static void
 transmitter_seat_keyboard_enter(struct weston_transmitter_seat *seat,
 				uint32_t serial,
@@ -573,7 +1014,7 @@ transmitter_seat_keyboard_enter(struct weston_transmitter_seat *seat,
 				struct wl_array *keys)
 {
 	struct weston_keyboard *keyboard;
-	struct wl_resource *resource = NULL;
+	struct transmitter_focus_resource *fr;
 	struct wl_resource *surface_resource;
 
 	keyboard = weston_seat_get_keyboard(seat->base);
@@ -585,13 +1026,16 @@ transmitter_seat_keyboard_enter(struct weston_transmitter_seat *seat,
 	seat->keyboard_focus = txs;
 	wl_array_copy(&keyboard->keys, keys);
 
-	wl_resource_for_each(resource, &keyboard->resource_list) {
-		if (wl_resource_get_client(resource) == wl_resource_get_client(surface_resource)) {
-			wl_keyboard_send_enter(resource,
-					       serial,
-					       surface_resource,
-					       &keyboard->keys);
-		}
+	transmitter_focus_cache_update(&seat->keyboard_cache,
+				       &keyboard->resource_list,
+				       wl_resource_get_client(surface_resource));
+
+	wl_list_for_each(fr, &seat->keyboard_cache.resource_list, link) {
+		transmitter_keyboard_send_info(seat, fr->resource);
+		wl_keyboard_send_enter(fr->resource,
+				       serial,
+				       surface_resource,
+				       &keyboard->keys);
 	}
 }
 
@@ -600,23 +1044,18 @@ transmitter_seat_keyboard_leave(struct weston_transmitter_seat *seat,
 				uint32_t serial,
 				struct weston_transmitter_surface *txs)
 {
-	struct weston_keyboard *keyboard;
-	struct wl_resource *resource = NULL;
+	struct transmitter_focus_resource *fr;
 	struct wl_resource *surface_resource;
 
-	keyboard = weston_seat_get_keyboard(seat->base);
-	assert(keyboard);
-
 	assert(txs->surface);
 	surface_resource = txs->surface->resource;
 
-	wl_resource_for_each(resource, &keyboard->resource_list) {
-		if (wl_resource_get_client(resource) == wl_resource_get_client(surface_resource)) {
-			wl_keyboard_send_leave(resource,
-					       serial,
-					       surface_resource);
-		}
-	}
+	wl_list_for_each(fr, &seat->keyboard_cache.resource_list, link)
+		wl_keyboard_send_leave(fr->resource,
+				       serial,
+				       surface_resource);
+
+	transmitter_focus_cache_clear(&seat->keyboard_cache);
 }
 
 static void
@@ -626,143 +1065,895 @@ transmitter_seat_keyboard_key(struct weston_transmitter_seat *seat,
 	uint32_t key,
 	uint32_t state)
 {
-	struct weston_keyboard *keyboard;
-	struct wl_resource *resource = NULL;
-
-	keyboard = weston_seat_get_keyboard(seat->base);
-	assert(keyboard);
+	struct transmitter_focus_resource *fr;
 
-	wl_resource_for_each(resource, &keyboard->resource_list) {
-		if (wl_resource_get_client(resource) ==
-		    wl_resource_get_client(seat->keyboard_focus->surface->resource)) {
-			wl_keyboard_send_key(resource,
-					     serial,
-					     time,
-					     key,
-					     state);
-		}
-	}
+	wl_list_for_each(fr, &seat->keyboard_cache.resource_list, link)
+		wl_keyboard_send_key(fr->resource,
+				     serial,
+				     time,
+				     key,
+				     state);
 }
 
 static void
-transmitter_seat_create_touch(struct weston_transmitter_seat *seat)
+transmitter_seat_keyboard_modifiers(struct weston_transmitter_seat *seat,
+				    uint32_t serial,
+				    uint32_t mods_depressed,
+				    uint32_t mods_latched,
+				    uint32_t mods_locked,
+				    uint32_t group)
 {
-	struct weston_touch *touch;
+	struct transmitter_focus_resource *fr;
 
-	seat->touch_focus = NULL;
-	weston_seat_init_touch(seat->base);
+	wl_list_for_each(fr, &seat->keyboard_cache.resource_list, link)
+		wl_keyboard_send_modifiers(fr->resource, serial,
+					   mods_depressed, mods_latched,
+					   mods_locked, group);
+}
 
-	touch = weston_seat_get_touch(seat->base);
+/* Largest keymap taken from a receiver, a full xkb text keymap is some
+ * 60 KiB. */
+#define KEYMAP_MAX (1024 * 1024)
 
-	touch->default_grab.interface = &touch_grab_impl;
+/** Keep the keymap of the receiver for the clients.
+ *
+ * The receiver sends the keymap text once, and again only when it
+ * changes. Clients need a file descriptor to map, so the text is put in
+ * a sealed memfd, sent on every keyboard enter.
+ *
+ * The text comes from the network: only blob_size bytes are read, and
+ * the copy is always NUL-terminated as clients expect.
+ */
+static void
+transmitter_seat_keyboard_keymap(struct weston_transmitter_seat *seat,
+				 uint32_t format,
+				 uint32_t blob_size,
+				 const void *keymap)
+{
+	struct transmitter_focus_resource *fr;
+	uint32_t size;
+	char *map;
+	int fd;
+
+	if (format != WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1 || !keymap ||
+	    blob_size == 0 || blob_size > KEYMAP_MAX) {
+		weston_log("Transmitter: keymap of format %u and %u B "
+			   "rejected\n", format, blob_size);
+		return;
+	}
 
-	weston_log("Transmitter created touch=%p for seat %p\n",
-		   touch, seat->base);
-}
+	size = blob_size;
+	if (((const char *)keymap)[blob_size - 1] != '\0')
+		size++;
 
-static void
-transmitter_seat_touch_down (struct weston_transmitter_seat *seat,
-			     uint32_t serial,
-			     uint32_t time,
-			     struct weston_transmitter_surface *txs,
-			     int32_t touch_id,
-			     wl_fixed_t x,
-			     wl_fixed_t y)
-{
-	struct weston_touch *touch;
-	struct wl_resource *resource = NULL;
-	struct wl_resource *surface_resource;
+	fd = memfd_create("transmitter-keymap", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		weston_log("Transmitter: keymap file of %u B failed: %s\n",
+			   size, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
 
-	touch = weston_seat_get_touch(seat->base);
-	assert(touch);
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	memcpy(map, keymap, blob_size);
+	map[size - 1] = '\0';
+	munmap(map, size);
 
-	assert(txs->surface);
-	surface_resource = txs->surface->resource;
+	/* shared read-only with every client */
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+			       F_SEAL_WRITE | F_SEAL_SEAL);
 
-	seat->touch_focus = txs;
+	if (seat->keymap_fd >= 0)
+		close(seat->keymap_fd);
+	seat->keymap_fd = fd;
+	seat->keymap_format = format;
+	seat->keymap_size = size;
 
-	wl_resource_for_each(resource, &touch->resource_list) {
-		if (wl_resource_get_client(resource) == wl_resource_get_client(surface_resource)) {
-			wl_touch_send_down(resource, serial, time,
-					   surface_resource,
-					   touch_id, x, y);
-		}
-	}
+	wl_list_for_each(fr, &seat->keyboard_cache.resource_list, link)
+		wl_keyboard_send_keymap(fr->resource, format, fd, size);
 }
 
+/** Hand the key repeat of the receiver to the clients.
+ *
+ * Key repeat is generated by the clients from wl_keyboard.repeat_info,
+ * so only presses and releases cross the network.
+ */
 static void
-transmitter_seat_touch_up (struct weston_transmitter_seat *seat,
-			   uint32_t serial,
-			   uint32_t time,
-			   int32_t touch_id)
+transmitter_seat_keyboard_repeat_info(struct weston_transmitter_seat *seat,
+				      int32_t rate,
+				      int32_t delay)
 {
-	struct weston_touch *touch;
-	struct wl_resource *resource = NULL;
+	struct transmitter_focus_resource *fr;
 
-	touch = weston_seat_get_touch(seat->base);
-	assert(touch);
+	seat->repeat_rate = rate;
+	seat->repeat_delay = delay;
 
-	wl_resource_for_each(resource, &touch->resource_list) {
-		if (wl_resource_get_client(resource) ==
-		    wl_resource_get_client(seat->touch_focus->surface->resource)) {
-			wl_touch_send_up(resource, serial, time, touch_id);
-		}
-	}
+	wl_list_for_each(fr, &seat->keyboard_cache.resource_list, link)
+		if (wl_resource_get_version(fr->resource) >=
+		    WL_KEYBOARD_REPEAT_INFO_SINCE_VERSION)
+			wl_keyboard_send_repeat_info(fr->resource, rate, delay);
 }
 
-static void
-transmitter_seat_touch_motion (struct weston_transmitter_seat *seat,
-			       uint32_t time,
-			       int32_t touch_id,
-			       wl_fixed_t x,
-			       wl_fixed_t y)
+/** Take the keyboard focus away when the receiver is gone.
+ *
+ * The clients repeat a key until it is released or the focus leaves,
+ * a key held when the connection drops would repeat forever otherwise.
+ */
+void
+transmitter_seat_keyboard_reset(struct weston_transmitter_seat *seat)
 {
-	struct weston_touch *touch;
-	struct wl_resource *resource = NULL;
-
-	touch = weston_seat_get_touch(seat->base);
-	assert(touch);
+	struct transmitter_focus_resource *fr;
+	uint32_t serial;
 
-	wl_resource_for_each(resource, &touch->resource_list) {
-		if (wl_resource_get_client(resource) ==
-		    wl_resource_get_client(seat->touch_focus->surface->resource)) {
-			wl_touch_send_motion(resource, time, touch_id, x, y);
-		}
+	if (seat->keyboard_focus && seat->keyboard_focus->surface) {
+		serial = wl_display_next_serial(seat->base->compositor->wl_display);
+		wl_list_for_each(fr, &seat->keyboard_cache.resource_list, link)
+			wl_keyboard_send_leave(fr->resource, serial,
+					       seat->keyboard_focus->surface->resource);
 	}
+
+	seat->keyboard_focus = NULL;
+	transmitter_focus_cache_clear(&seat->keyboard_cache);
 }
 
 static void
-transmitter_seat_touch_frame (struct weston_transmitter_seat *seat)
+transmitter_seat_create_touch(struct weston_transmitter_seat *seat)
 {
 	struct weston_touch *touch;
-	struct wl_resource *resource = NULL;
+
+	seat->touch_focus = NULL;
+	weston_seat_init_touch(seat->base);
 
 	touch = weston_seat_get_touch(seat->base);
-	assert(touch);
 
-	wl_resource_for_each(resource, &touch->resource_list) {
-		if (wl_resource_get_client(resource) ==
-		    wl_resource_get_client(seat->touch_focus->surface->resource)) {
-			wl_touch_send_frame(resource);
+	touch->default_grab.interface = &touch_grab_impl;
+
+	weston_log("Transmitter created touch=%p for seat %p\n",
+		   touch, seat->base);
+}
+
+/** Send the queued touch events to the focused client at once.
+ *
+ * \param seat The transmitter seat.
+ * \param frame Whether to end with a touch frame.
+ *
+ * The wthp_touch handlers only queue the events of a frame. They reach
+ * the client as one run of events followed by the frame, over the touch
+ * resources of the client cached at touch down.
+ */
+static void
+transmitter_seat_touch_replay(struct weston_transmitter_seat *seat, bool frame)
+{
+	struct transmitter_focus_resource *fr;
+	struct wl_resource *resource;
+	struct transmitter_touch_event *ev;
+	int i;
+
+	wl_list_for_each(fr, &seat->touch_cache.resource_list, link) {
+		resource = fr->resource;
+
+		for (i = 0; i < seat->touch_event_count; i++) {
+			ev = &seat->touch_events[i];
+
+			switch (ev->type) {
+			case TRANSMITTER_TOUCH_DOWN:
+				wl_touch_send_down(resource, ev->serial,
+						   ev->time, ev->surface,
+						   ev->id, ev->x, ev->y);
+				break;
+			case TRANSMITTER_TOUCH_UP:
+				wl_touch_send_up(resource, ev->serial,
+						 ev->time, ev->id);
+				break;
+			case TRANSMITTER_TOUCH_MOTION:
+				wl_touch_send_motion(resource, ev->time,
+						     ev->id, ev->x, ev->y);
+				break;
+			}
 		}
+
+		if (frame)
+			wl_touch_send_frame(resource);
 	}
+
+	/* replayed events carry local times, they would skew the samples */
+	for (i = 0; i < seat->touch_event_count; i++)
+		if (seat->touch_events[i].type == TRANSMITTER_TOUCH_DOWN &&
+		    !seat->touch_events[i].replayed)
+			transmitter_remote_record_latency(seat->remote,
+				WESTON_TRANSMITTER_INPUT_TOUCH,
+				seat->touch_events[i].time);
+
+	seat->touch_event_count = 0;
+}
+
+static struct transmitter_touch_event *
+transmitter_seat_touch_queue(struct weston_transmitter_seat *seat,
+			     enum transmitter_touch_type type)
+{
+	struct transmitter_touch_event *ev;
+
+	if (!seat->touch_focus)
+		return NULL;
+
+	/* an overlong frame goes out in parts */
+	if (seat->touch_event_count == TRANSMITTER_TOUCH_EVENTS)
+		transmitter_seat_touch_replay(seat, false);
+
+	ev = &seat->touch_events[seat->touch_event_count++];
+	memset(ev, 0, sizeof *ev);
+	ev->type = type;
+	ev->replayed = seat->replaying;
+
+	return ev;
+}
+
+/* The predictor of a touch point, or a free slot for it */
+static struct transmitter_predictor *
+transmitter_seat_touch_predictor(struct weston_transmitter_seat *seat,
+				 int32_t id)
+{
+	struct transmitter_predictor *slot = NULL;
+	int i;
+
+	for (i = 0; i < TRANSMITTER_TOUCH_POINTS; i++) {
+		if (seat->touch_predictor[i].valid &&
+		    seat->touch_predictor[i].id == id)
+			return &seat->touch_predictor[i];
+		if (!seat->touch_predictor[i].valid && !slot)
+			slot = &seat->touch_predictor[i];
+	}
+
+	return slot;
 }
 
 static void
-transmitter_seat_touch_cancel (struct weston_transmitter_seat *seat)
+transmitter_seat_touch_down (struct weston_transmitter_seat *seat,
+			     uint32_t serial,
+			     uint32_t time,
+			     struct weston_transmitter_surface *txs,
+			     int32_t touch_id,
+			     wl_fixed_t x,
+			     wl_fixed_t y)
 {
+	struct transmitter_touch_event *ev;
 	struct weston_touch *touch;
-	struct wl_resource *resource = NULL;
+	struct wl_client *client;
+	struct transmitter_predictor *predictor;
+
+	assert(txs->surface);
+	seat->touch_focus = txs;
 
 	touch = weston_seat_get_touch(seat->base);
 	assert(touch);
 
-	wl_resource_for_each(resource, &touch->resource_list) {
-		if (wl_resource_get_client(resource) ==
-		    wl_resource_get_client(seat->touch_focus->surface->resource)) {
-			wl_touch_send_cancel(resource);
+	/* The frame so far belongs to the previous client. The cache is
+	 * gathered again on every down, to also catch wl_touch objects
+	 * created since the last one.
+	 */
+	client = wl_resource_get_client(txs->surface->resource);
+	if (client != seat->touch_cache.client && seat->touch_event_count)
+		transmitter_seat_touch_replay(seat, true);
+	transmitter_focus_cache_update(&seat->touch_cache,
+				       &touch->resource_list, client);
+
+	ev = transmitter_seat_touch_queue(seat, TRANSMITTER_TOUCH_DOWN);
+	ev->serial = serial;
+	ev->time = time;
+	ev->surface = txs->surface->resource;
+	ev->id = touch_id;
+	ev->x = x;
+	ev->y = y;
+
+	/* the point goes down where it is, the motions are predicted */
+	predictor = transmitter_seat_touch_predictor(seat, touch_id);
+	if (predictor && seat->remote->input_prediction != 0) {
+		memset(predictor, 0, sizeof *predictor);
+		transmitter_predictor_update(predictor, 0, time, &x, &y);
+		predictor->id = touch_id;
+	}
+}
+
+static void
+transmitter_seat_touch_up (struct weston_transmitter_seat *seat,
+			   uint32_t serial,
+			   uint32_t time,
+			   int32_t touch_id)
+{
+	struct transmitter_touch_event *ev;
+	struct transmitter_predictor *predictor;
+
+	/* the point is released where the receiver saw it, not ahead */
+	predictor = transmitter_seat_touch_predictor(seat, touch_id);
+	if (predictor && predictor->valid) {
+		if (predictor->predicted) {
+			ev = transmitter_seat_touch_queue(seat,
+						TRANSMITTER_TOUCH_MOTION);
+			if (ev) {
+				ev->time = time;
+				ev->id = touch_id;
+				ev->x = predictor->real_x;
+				ev->y = predictor->real_y;
+			}
+		}
+		predictor->valid = false;
+	}
+
+	ev = transmitter_seat_touch_queue(seat, TRANSMITTER_TOUCH_UP);
+	if (!ev)
+		return;
+
+	ev->serial = serial;
+	ev->time = time;
+	ev->id = touch_id;
+}
+
+static void
+transmitter_seat_touch_motion (struct weston_transmitter_seat *seat,
+			       uint32_t time,
+			       int32_t touch_id,
+			       wl_fixed_t x,
+			       wl_fixed_t y)
+{
+	struct transmitter_touch_event *ev;
+	struct transmitter_predictor *predictor;
+
+	ev = transmitter_seat_touch_queue(seat, TRANSMITTER_TOUCH_MOTION);
+	if (!ev)
+		return;
+
+	predictor = transmitter_seat_touch_predictor(seat, touch_id);
+	if (predictor && predictor->valid) {
+		transmitter_predictor_update(predictor,
+			transmitter_prediction_horizon(seat->remote),
+			time, &x, &y);
+		transmitter_seat_predict_arm(seat, predictor);
+	}
+
+	ev->time = time;
+	ev->id = touch_id;
+	ev->x = x;
+	ev->y = y;
+}
+
+static void
+transmitter_seat_touch_frame (struct weston_transmitter_seat *seat)
+{
+	transmitter_seat_touch_replay(seat, true);
+}
+
+static void
+transmitter_seat_touch_cancel (struct weston_transmitter_seat *seat)
+{
+	struct transmitter_focus_resource *fr;
+
+	/* the events of the cancelled frame are dropped */
+	seat->touch_event_count = 0;
+	memset(seat->touch_predictor, 0, sizeof seat->touch_predictor);
+
+	wl_list_for_each(fr, &seat->touch_cache.resource_list, link)
+		wl_touch_send_cancel(fr->resource);
+}
+
+/** Send the real positions once the motion stopped for PREDICTION_GAP.
+ *
+ * The last positions sent were ahead of the samples by the velocity of
+ * the motion. Without this, a pointer that hovers or a finger that holds
+ * still would stay up to PREDICTION_MAX px beyond where it is.
+ */
+static int
+transmitter_seat_predict_settle(void *data)
+{
+	struct weston_transmitter_seat *seat = data;
+	struct transmitter_predictor *p = &seat->pointer_predictor;
+	struct transmitter_touch_event *ev;
+	struct weston_pointer *pointer;
+	struct wl_resource *resource;
+	bool touched = false;
+	int i;
+
+	pointer = weston_seat_get_pointer(seat->base);
+	if (p->predicted && pointer && pointer->focus_client) {
+		wl_resource_for_each(resource,
+				     &pointer->focus_client->pointer_resources)
+			wl_pointer_send_motion(resource, p->time + PREDICTION_GAP,
+					       p->real_x, p->real_y);
+		weston_pointer_send_frame(pointer);
+	}
+	p->predicted = false;
+
+	/* a frame of the receiver is being gathered, wait for its end */
+	if (seat->touch_event_count > 0) {
+		wl_event_source_timer_update(seat->predict_timer,
+					     PREDICTION_GAP);
+		return 0;
+	}
+
+	for (i = 0; i < TRANSMITTER_TOUCH_POINTS; i++) {
+		p = &seat->touch_predictor[i];
+		if (!p->valid || !p->predicted)
+			continue;
+
+		ev = transmitter_seat_touch_queue(seat,
+						  TRANSMITTER_TOUCH_MOTION);
+		if (ev) {
+			ev->time = p->time + PREDICTION_GAP;
+			ev->id = p->id;
+			ev->x = p->real_x;
+			ev->y = p->real_y;
+			touched = true;
 		}
+		p->predicted = false;
 	}
+
+	if (touched)
+		transmitter_seat_touch_replay(seat, true);
+
+	return 0;
+}
+
+static void
+latency_add(struct weston_transmitter_latency *h, uint32_t ms)
+{
+	int i = 0;
+
+	while (i < WESTON_TRANSMITTER_LATENCY_BUCKETS - 1 && ms >= (1u << i))
+		i++;
+
+	h->bucket[i]++;
+	h->count++;
+	h->sum += ms;
+	if (ms > h->max)
+		h->max = ms;
+}
+
+/** Account an input event delivered to a client.
+ *
+ * \param remote The remote the event came from.
+ * \param kind The kind of input event.
+ * \param time The event time of the receiver's compositor, in ms.
+ *
+ * The receiver's compositor and its wth_display.sync answers use the same
+ * monotonic clock, so the event time is turned into a local time with the
+ * clock offset of the heartbeat.
+ */
+void
+transmitter_remote_record_latency(struct weston_transmitter_remote *remote,
+				  enum weston_transmitter_input_kind kind,
+				  uint32_t time)
+{
+	struct timespec now;
+	uint32_t now_ms;
+	int32_t latency;
+
+	if (!remote->clock_synced)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	now_ms = (uint32_t)((int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+
+	/* within the error of the clock offset, an event may seem early */
+	latency = (int32_t)(now_ms + remote->clock_offset - time);
+	if (latency < 0)
+		latency = 0;
+
+	latency_add(&remote->input_latency[kind], latency);
+	latency_add(&remote->latency_window[kind], latency);
+}
+
+/* Upper bound in ms of the bucket holding the given percentile */
+static uint32_t
+latency_percentile(const struct weston_transmitter_latency *h, uint32_t pct)
+{
+	uint64_t target = ((uint64_t)h->count * pct + 99) / 100;
+	uint64_t seen = 0;
+	int i;
+
+	for (i = 0; i < WESTON_TRANSMITTER_LATENCY_BUCKETS - 1; i++) {
+		seen += h->bucket[i];
+		if (seen >= target)
+			return 1u << i;
+	}
+
+	return h->max;
+}
+
+/** Log the input latency since the last report and start a new window. */
+void
+transmitter_remote_report_latency(struct weston_transmitter_remote *remote)
+{
+	static const char *names[] = { "touch down", "pointer motion" };
+	struct weston_transmitter_latency *h;
+	int kind;
+
+	for (kind = 0; kind < WESTON_TRANSMITTER_INPUT_KINDS; kind++) {
+		h = &remote->latency_window[kind];
+		if (h->count == 0)
+			continue;
+
+		weston_log("Transmitter: %s latency from %s:%s, %u events: "
+			   "mean %u ms, p50 < %u ms, p99 < %u ms, max %u ms\n",
+			   names[kind], remote->addr, remote->port, h->count,
+			   (uint32_t)(h->sum / h->count),
+			   latency_percentile(h, 50), latency_percentile(h, 99),
+			   h->max);
+		memset(h, 0, sizeof *h);
+	}
+}
+
+/* Input replay: an input recording of waltham-receiver -r played back
+ * through the same seat functions as the events of the receiver, to
+ * benchmark them with a reproducible load.
+ */
+struct transmitter_input_replay {
+	char *path;
+	struct transmitter_input_record *records;
+	size_t count;
+	size_t next;
+	double speed; /* <= 0 as fast as possible */
+	uint64_t start; /* CLOCK_MONOTONIC, us */
+	struct wl_event_source *timer;
+
+	/* processing cost per event type, ns */
+	struct {
+		uint32_t count;
+		uint64_t sum;
+		uint64_t max;
+	} cost[TRANSMITTER_INPUT_RECORD_TYPES];
+};
+
+/* records dispatched per timer run when replaying as fast as possible */
+#define REPLAY_BATCH 64
+
+static uint64_t
+replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct weston_transmitter_surface *
+replay_find_surface(struct weston_transmitter_seat *seat, uint32_t ivi_id)
+{
+	struct weston_transmitter_surface *txs;
+
+	wl_list_for_each(txs, &seat->remote->surface_list, link) {
+		if (txs->ivi_id == ivi_id && txs->surface)
+			return txs;
+	}
+
+	return NULL;
+}
+
+/** Hand one recorded event to the seat.
+ *
+ * Serials and timestamps are new, so that the clients see them in order
+ * with the rest of their input. Events on surfaces that do not exist are
+ * skipped.
+ *
+ * \return false if the event was skipped.
+ */
+static bool
+replay_dispatch(struct weston_transmitter_seat *seat,
+		const struct transmitter_input_record *rec)
+{
+	struct wl_display *display = seat->base->compositor->wl_display;
+	struct weston_transmitter_surface *txs = NULL;
+	const int32_t *arg = rec->arg;
+	struct timespec ts;
+	struct wl_array keys;
+	uint32_t serial;
+	uint32_t time;
+
+	weston_compositor_get_time(&ts);
+	time = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	switch (rec->type) {
+	case TRANSMITTER_INPUT_RECORD_POINTER_ENTER:
+	case TRANSMITTER_INPUT_RECORD_POINTER_LEAVE:
+	case TRANSMITTER_INPUT_RECORD_KEYBOARD_ENTER:
+	case TRANSMITTER_INPUT_RECORD_KEYBOARD_LEAVE:
+	case TRANSMITTER_INPUT_RECORD_TOUCH_DOWN:
+		txs = replay_find_surface(seat, rec->ivi_id);
+		if (!txs)
+			return false;
+		break;
+	}
+
+	serial = wl_display_next_serial(display);
+
+	switch (rec->type) {
+	case TRANSMITTER_INPUT_RECORD_POINTER_ENTER:
+		if (seat->pointer_focus && txs != seat->pointer_focus)
+			transmitter_seat_pointer_leave(seat, serial,
+						       seat->pointer_focus);
+		transmitter_seat_pointer_enter(seat, serial, txs,
+					       arg[0], arg[1]);
+		break;
+	case TRANSMITTER_INPUT_RECORD_POINTER_LEAVE:
+		if (txs != seat->pointer_focus)
+			return false;
+		transmitter_seat_pointer_leave(seat, serial, txs);
+		break;
+	case TRANSMITTER_INPUT_RECORD_POINTER_MOTION:
+		transmitter_seat_pointer_motion(seat, time, arg[0], arg[1]);
+		break;
+	case TRANSMITTER_INPUT_RECORD_POINTER_BUTTON:
+		transmitter_seat_pointer_button(seat, serial, time,
+						arg[0], arg[1]);
+		break;
+	case TRANSMITTER_INPUT_RECORD_POINTER_AXIS:
+		transmitter_seat_pointer_axis(seat, time, arg[0], arg[1]);
+		break;
+	case TRANSMITTER_INPUT_RECORD_POINTER_FRAME:
+		transmitter_seat_pointer_frame(seat);
+		break;
+	case TRANSMITTER_INPUT_RECORD_POINTER_AXIS_SOURCE:
+		transmitter_seat_pointer_axis_source(seat, arg[0]);
+		break;
+	case TRANSMITTER_INPUT_RECORD_POINTER_AXIS_STOP:
+		transmitter_seat_pointer_axis_stop(seat, time, arg[0]);
+		break;
+	case TRANSMITTER_INPUT_RECORD_POINTER_AXIS_DISCRETE:
+		transmitter_seat_pointer_axis_discrete(seat, arg[0], arg[1]);
+		break;
+	case TRANSMITTER_INPUT_RECORD_KEYBOARD_ENTER:
+		/* the pressed keys are not recorded */
+		wl_array_init(&keys);
+		transmitter_seat_keyboard_enter(seat, serial, txs, &keys);
+		wl_array_release(&keys);
+		break;
+	case TRANSMITTER_INPUT_RECORD_KEYBOARD_LEAVE:
+		transmitter_seat_keyboard_leave(seat, serial, txs);
+		break;
+	case TRANSMITTER_INPUT_RECORD_KEYBOARD_KEY:
+		transmitter_seat_keyboard_key(seat, serial, time,
+					      arg[0], arg[1]);
+		break;
+	case TRANSMITTER_INPUT_RECORD_KEYBOARD_MODIFIERS:
+		transmitter_seat_keyboard_modifiers(seat, serial, arg[0],
+						    arg[1], arg[2], arg[3]);
+		break;
+	case TRANSMITTER_INPUT_RECORD_TOUCH_DOWN:
+		transmitter_seat_touch_down(seat, serial, time, txs,
+					    arg[0], arg[1], arg[2]);
+		break;
+	case TRANSMITTER_INPUT_RECORD_TOUCH_UP:
+		transmitter_seat_touch_up(seat, serial, time, arg[0]);
+		break;
+	case TRANSMITTER_INPUT_RECORD_TOUCH_MOTION:
+		transmitter_seat_touch_motion(seat, time, arg[0],
+					      arg[1], arg[2]);
+		break;
+	case TRANSMITTER_INPUT_RECORD_TOUCH_FRAME:
+		transmitter_seat_touch_frame(seat);
+		break;
+	case TRANSMITTER_INPUT_RECORD_TOUCH_CANCEL:
+		transmitter_seat_touch_cancel(seat);
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+static void
+replay_report(struct transmitter_input_replay *replay, uint64_t elapsed)
+{
+	static const char *names[TRANSMITTER_INPUT_RECORD_TYPES] = {
+		NULL,
+		"pointer enter", "pointer leave", "pointer motion",
+		"pointer button", "pointer axis", "pointer frame",
+		"pointer axis source", "pointer axis stop",
+		"pointer axis discrete",
+		"keyboard enter", "keyboard leave", "keyboard key",
+		"keyboard modifiers",
+		"touch down", "touch up", "touch motion", "touch frame",
+		"touch cancel",
+	};
+	uint32_t type;
+
+	weston_log("Transmitter: input replay of %s done, %zu events in "
+		   "%u ms\n", replay->path, replay->count,
+		   (uint32_t)(elapsed / 1000000));
+
+	for (type = 0; type < TRANSMITTER_INPUT_RECORD_TYPES; type++) {
+		if (replay->cost[type].count == 0)
+			continue;
+
+		weston_log("Transmitter: replayed %s, %u events: "
+			   "mean %.2f us, max %.2f us\n", names[type],
+			   replay->cost[type].count,
+			   replay->cost[type].sum / 1000.0 /
+			   replay->cost[type].count,
+			   replay->cost[type].max / 1000.0);
+	}
+}
+
+static int
+replay_timer_handler(void *data)
+{
+	struct weston_transmitter_seat *seat = data;
+	struct transmitter_input_replay *replay = seat->replay;
+	const struct transmitter_input_record *rec;
+	uint64_t elapsed, due, t0, cost;
+	bool dispatched;
+	int batch = 0;
+
+	elapsed = replay_now() - replay->start;
+
+	while (replay->next < replay->count) {
+		rec = &replay->records[replay->next];
+
+		if (replay->speed > 0.0) {
+			due = rec->time * 1000 / replay->speed;
+			if (due > elapsed) {
+				wl_event_source_timer_update(replay->timer,
+					(due - elapsed) / 1000000 + 1);
+				return 0;
+			}
+		} else if (batch++ == REPLAY_BATCH) {
+			wl_event_source_timer_update(replay->timer, 1);
+			return 0;
+		}
+
+		/* types are checked by replay_load() */
+		assert(rec->type < TRANSMITTER_INPUT_RECORD_TYPES);
+		t0 = replay_now();
+		seat->replaying = true;
+		dispatched = replay_dispatch(seat, rec);
+		seat->replaying = false;
+		if (dispatched) {
+			cost = replay_now() - t0;
+			replay->cost[rec->type].count++;
+			replay->cost[rec->type].sum += cost;
+			if (cost > replay->cost[rec->type].max)
+				replay->cost[rec->type].max = cost;
+		}
+		replay->next++;
+	}
+
+	/* the replay is kept, so that it does not start again */
+	replay_report(replay, replay_now() - replay->start);
+
+	return 0;
+}
+
+/** Read a recording, rejecting anything but whole records of known types. */
+static int
+replay_load(struct transmitter_input_replay *replay, const char *path)
+{
+	const size_t record_size = sizeof (struct transmitter_input_record);
+	uint32_t header[2];
+	FILE *fp;
+	long size;
+	size_t i;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -1;
+
+	if (fread(header, sizeof header, 1, fp) != 1 ||
+	    header[0] != TRANSMITTER_INPUT_RECORD_MAGIC) {
+		weston_log("Transmitter: %s is not an input recording\n", path);
+		goto fail;
+	}
+
+	if (header[1] != TRANSMITTER_INPUT_RECORD_VERSION) {
+		weston_log("Transmitter: input recording %s has version %u, "
+			   "expected %u\n", path, header[1],
+			   TRANSMITTER_INPUT_RECORD_VERSION);
+		goto fail;
+	}
+
+	if (fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) < 0)
+		goto fail;
+
+	if ((size_t)size < sizeof header ||
+	    (size - sizeof header) % record_size != 0) {
+		weston_log("Transmitter: input recording %s is truncated\n",
+			   path);
+		goto fail;
+	}
+
+	replay->count = (size - sizeof header) / record_size;
+	replay->records = calloc(replay->count ? replay->count : 1,
+				 record_size);
+	if (!replay->records ||
+	    fseek(fp, sizeof header, SEEK_SET) < 0 ||
+	    fread(replay->records, record_size,
+		  replay->count, fp) != replay->count)
+		goto fail;
+
+	for (i = 0; i < replay->count; i++) {
+		if (replay->records[i].type == 0 ||
+		    replay->records[i].type >= TRANSMITTER_INPUT_RECORD_TYPES) {
+			weston_log("Transmitter: input recording %s has an "
+				   "unknown event type %u at record %zu\n",
+				   path, replay->records[i].type, i);
+			goto fail;
+		}
+	}
+
+	fclose(fp);
+
+	return 0;
+
+fail:
+	fclose(fp);
+
+	return -1;
+}
+
+/** Replay an input recording of waltham-receiver on the seat.
+ *
+ * \param speed Factor on the recorded pace, <= 0 is as fast as possible.
+ *
+ * The recording is played once per seat, further calls do nothing. When
+ * it ends, the processing cost of each event type is written to the log.
+ */
+int
+transmitter_seat_replay_start(struct weston_transmitter_seat *seat,
+			      const char *path, double speed)
+{
+	struct transmitter_input_replay *replay;
+	struct wl_event_loop *loop;
+
+	if (seat->replay)
+		return 0;
+
+	replay = zalloc(sizeof *replay);
+	if (!replay)
+		return -1;
+
+	loop = wl_display_get_event_loop(seat->base->compositor->wl_display);
+	replay->timer = wl_event_loop_add_timer(loop, replay_timer_handler,
+						seat);
+
+	if (!replay->timer || replay_load(replay, path) < 0) {
+		weston_log("Transmitter: cannot replay input from %s\n", path);
+		if (replay->timer)
+			wl_event_source_remove(replay->timer);
+		free(replay->records);
+		free(replay);
+		return -1;
+	}
+
+	replay->path = strdup(path);
+	replay->speed = speed;
+	replay->start = replay_now();
+	seat->replay = replay;
+
+	weston_log("Transmitter: replaying %zu input events from %s\n",
+		   replay->count, path);
+	wl_event_source_timer_update(replay->timer, 1);
+
+	return 0;
+}
+
+static void
+transmitter_seat_replay_destroy(struct weston_transmitter_seat *seat)
+{
+	struct transmitter_input_replay *replay = seat->replay;
+
+	if (!replay)
+		return;
+
+	if (replay->timer)
+		wl_event_source_remove(replay->timer);
+	free(replay->records);
+	free(replay->path);
+	free(replay);
+	seat->replay = NULL;
 }
 
 static char *
@@ -785,9 +1976,21 @@ transmitter_seat_destroy(struct weston_transmitter_seat *seat)
 
 	wl_list_remove(&seat->get_pointer_listener.link);
 	wl_list_remove(&seat->pointer_focus_destroy_listener.link);
+	wl_list_remove(&seat->cursor_commit_listener.link);
+	wl_list_remove(&seat->cursor_destroy_listener.link);
+	transmitter_focus_cache_clear(&seat->keyboard_cache);
+	transmitter_focus_cache_clear(&seat->touch_cache);
+	if (seat->keymap_fd >= 0)
+		close(seat->keymap_fd);
+
+	transmitter_seat_watch_cursor(seat, false);
+	if (seat->wthp_cursor)
+		wthp_surface_destroy(seat->wthp_cursor);
+
+	transmitter_seat_replay_destroy(seat);
 
-	if (seat->pointer_timer)
-		wl_event_source_remove(seat->pointer_timer);
+	if (seat->predict_timer)
+		wl_event_source_remove(seat->predict_timer);
 
 	free(seat);
 }
@@ -858,6 +2061,9 @@ pointer_handle_motion(struct wthp_pointer *wthp_pointer,
 	transmitter_seat_pointer_motion(seat, time,
 					surface_x,
 					surface_y);
+	transmitter_remote_record_latency(remote,
+					  WESTON_TRANSMITTER_INPUT_POINTER,
+					  time);
 }
 
 static void
@@ -900,14 +2106,30 @@ pointer_handle_axis(struct wthp_pointer *wthp_pointer,
 static void
 pointer_handle_frame(struct wthp_pointer *wthp_pointer)
 {
-	/* ToDo : implement pointer handle frame */
+	struct waltham_display *dpy =
+		wth_object_get_user_data((struct wth_object *)wthp_pointer);
+	struct weston_transmitter_remote *remote = dpy->remote;
+	struct wl_list *seat_list = &remote->seat_list;
+	struct weston_transmitter_seat *seat;
+
+	seat = wl_container_of(seat_list->next, seat, link);
+
+	transmitter_seat_pointer_frame(seat);
 }
 
 static void
 pointer_handle_axis_source(struct wthp_pointer *wthp_pointer,
 			   uint32_t axis_source)
 {
-	/* ToDo : implement pointer handle axis source */
+	struct waltham_display *dpy =
+		wth_object_get_user_data((struct wth_object *)wthp_pointer);
+	struct weston_transmitter_remote *remote = dpy->remote;
+	struct wl_list *seat_list = &remote->seat_list;
+	struct weston_transmitter_seat *seat;
+
+	seat = wl_container_of(seat_list->next, seat, link);
+
+	transmitter_seat_pointer_axis_source(seat, axis_source);
 }
 
 static void
@@ -915,7 +2137,15 @@ pointer_handle_axis_stop(struct wthp_pointer *wthp_pointer,
 			 uint32_t time,
 			 uint32_t axis)
 {
-	/* ToDo : implement pointer handle axis stop */
+	struct waltham_display *dpy =
+		wth_object_get_user_data((struct wth_object *)wthp_pointer);
+	struct weston_transmitter_remote *remote = dpy->remote;
+	struct wl_list *seat_list = &remote->seat_list;
+	struct weston_transmitter_seat *seat;
+
+	seat = wl_container_of(seat_list->next, seat, link);
+
+	transmitter_seat_pointer_axis_stop(seat, time, axis);
 }
 
 static void
@@ -923,7 +2153,15 @@ pointer_handle_axis_discrete(struct wthp_pointer *wthp_pointer,
 			     uint32_t axis,
 			     int32_t discrete)
 {
-	/* ToDo : implement pointer handle axis discrete */
+	struct waltham_display *dpy =
+		wth_object_get_user_data((struct wth_object *)wthp_pointer);
+	struct weston_transmitter_remote *remote = dpy->remote;
+	struct wl_list *seat_list = &remote->seat_list;
+	struct weston_transmitter_seat *seat;
+
+	seat = wl_container_of(seat_list->next, seat, link);
+
+	transmitter_seat_pointer_axis_discrete(seat, axis, discrete);
 }
 
 static const struct wthp_pointer_listener pointer_listener = {
@@ -944,7 +2182,16 @@ keyboard_handle_keymap(struct wthp_keyboard * wthp_keyboard,
 	uint32_t keymap_sz,
 	void * keymap)
 {
-	/* ToDo : implement keyboard handle keymap */
+	struct waltham_display *dpy =
+		wth_object_get_user_data((struct wth_object *)wthp_keyboard);
+	struct weston_transmitter_remote *remote = dpy->remote;
+	struct wl_list *seat_list = &remote->seat_list;
+	struct weston_transmitter_seat *seat;
+
+	seat = wl_container_of(seat_list->next, seat, link);
+
+	/* keymap_sz is the length of the blob as decoded by Waltham */
+	transmitter_seat_keyboard_keymap(seat, format, keymap_sz, keymap);
 }
 
 static void
@@ -1025,7 +2272,16 @@ keyboard_handle_modifiers(struct wthp_keyboard *wthp_keyboard,
 	uint32_t mods_locked,
 	uint32_t group)
 {
-	weston_log("keyboard_handle_modifiers\n");
+	struct waltham_display *dpy =
+		wth_object_get_user_data((struct wth_object *)wthp_keyboard);
+	struct weston_transmitter_remote *remote = dpy->remote;
+	struct wl_list *seat_list = &remote->seat_list;
+	struct weston_transmitter_seat *seat;
+
+	seat = wl_container_of(seat_list->next, seat, link);
+
+	transmitter_seat_keyboard_modifiers(seat, serial, mods_depressed,
+					    mods_latched, mods_locked, group);
 }
 
 static void
@@ -1033,7 +2289,15 @@ keyboard_handle_repeat_info(struct wthp_keyboard *wthp_keyboard,
 	int32_t rate,
 	int32_t delay)
 {
-	weston_log("keyboard_handle_repeat_info\n");
+	struct waltham_display *dpy =
+		wth_object_get_user_data((struct wth_object *)wthp_keyboard);
+	struct weston_transmitter_remote *remote = dpy->remote;
+	struct wl_list *seat_list = &remote->seat_list;
+	struct weston_transmitter_seat *seat;
+
+	seat = wl_container_of(seat_list->next, seat, link);
+
+	transmitter_seat_keyboard_repeat_info(seat, rate, delay);
 }
 
 static const struct wthp_keyboard_listener keyboard_listener = {
@@ -1177,6 +2441,7 @@ int
 transmitter_remote_create_seat(struct weston_transmitter_remote *remote)
 {
 	struct weston_transmitter_seat *seat = NULL;
+	struct wl_event_loop *loop;
 	char *name = NULL;
 	struct weston_seat *weston_seat = NULL;
 
@@ -1184,8 +2449,22 @@ transmitter_remote_create_seat(struct weston_transmitter_remote *remote)
 	if (!seat)
 		goto fail;
 
+	seat->remote = remote;
 	wl_list_init(&seat->get_pointer_listener.link);
 	wl_list_init(&seat->pointer_focus_destroy_listener.link);
+	wl_list_init(&seat->cursor_commit_listener.link);
+	wl_list_init(&seat->cursor_destroy_listener.link);
+	wl_list_init(&seat->keyboard_cache.resource_list);
+	seat->keymap_fd = -1;
+	seat->repeat_rate = -1;
+	wl_list_init(&seat->touch_cache.resource_list);
+
+	loop = wl_display_get_event_loop(remote->transmitter->compositor->wl_display);
+	seat->predict_timer = wl_event_loop_add_timer(loop,
+						      transmitter_seat_predict_settle,
+						      seat);
+	if (!seat->predict_timer)
+		goto fail;
 
 	/* XXX: get the name from remote */
 	name = make_seat_name(remote, "default");
@@ -1244,76 +2523,10 @@ transmitter_remote_create_seat(struct weston_transmitter_remote *remote)
 	return 0;
 
 fail:
+	if (seat && seat->predict_timer)
+		wl_event_source_remove(seat->predict_timer);
 	free(seat);
 	free(name);
 
 	return -1;
 }
-
-static void
-fake_pointer_get_position(struct weston_transmitter_seat *seat, double step,
-			  wl_fixed_t *x, wl_fixed_t *y)
-{
-	double s, c;
-
-	seat->pointer_phase += step;
-	while (seat->pointer_phase > 2.0 * M_PI)
-		seat->pointer_phase -= 2.0 * M_PI;
-
-	sincos(seat->pointer_phase, &s, &c);
-	*x = wl_fixed_from_double(100.0 + 50.0 * c);
-	*y = wl_fixed_from_double(100.0 + 50.0 * s);
-}
-
-static int
-fake_pointer_timer_handler(void *data)
-{
-	struct weston_transmitter_seat *seat = data;
-	wl_fixed_t x, y;
-	uint32_t time;
-	struct timespec timespec;
-
-	weston_compositor_get_time(&timespec);
-	time=timespec.tv_sec * 1000 + timespec.tv_nsec / 1000000;
-
-	fake_pointer_get_position(seat, 18.0 / 180.0 * M_PI, &x, &y);
-	transmitter_seat_pointer_motion(seat, time, x, y);
-	transmitter_seat_pointer_frame(seat);
-
-	wl_event_source_timer_update(seat->pointer_timer, 100);
-
-	return 0;
-}
-
-int
-transmitter_seat_fake_pointer_input(struct weston_transmitter_seat *seat,
-				    struct weston_transmitter_surface *txs)
-{
-	struct wl_event_loop *loop;
-	wl_fixed_t x, y;
-	uint32_t serial = 5;
-
-	/* remove focus from earlier surface */
-	transmitter_seat_pointer_leave(seat, serial++, seat->pointer_focus);
-	transmitter_seat_pointer_frame(seat);
-
-	/* set pointer focus to surface */
-	fake_pointer_get_position(seat, 0.0, &x, &y);
-	transmitter_seat_pointer_enter(seat, serial++, txs, x, y);
-	transmitter_seat_pointer_frame(seat);
-
-	if (!seat->pointer_timer) {
-		/* schedule timer for motion */
-		loop = wl_display_get_event_loop(seat->base->compositor->wl_display);
-		seat->pointer_timer = wl_event_loop_add_timer(loop,
-						fake_pointer_timer_handler, seat);
-		wl_event_source_timer_update(seat->pointer_timer, 100);
-	}
-
-	/* XXX: if the now focused surface disappears, we should call
-	 * transmitter_seat_pointer_leave() as part of the mockup. Otherwise
-	 * you get a "Transmitter Warning: no pointer->focus_client?".
-	 */
-
-	return 0;
-}
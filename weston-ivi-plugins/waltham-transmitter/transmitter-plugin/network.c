@@ -0,0 +1,593 @@
+/*
+ * Copyright (C) 2017 Advanced Driver Information Technology Joint Venture GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Network thread of the Transmitter.
+ *
+ * Everything that may block on the network is done here, away from the
+ * compositor thread: name resolution and the TCP connect to the receivers.
+ * A connected socket is handed back to the compositor thread, which wraps
+ * it into a wth_connection and drives it without blocking from the Weston
+ * event loop. Waltham objects never cross threads.
+ *
+ * The connection I/O, the input events and the commits stay on the
+ * compositor thread on purpose: libwaltham is not thread-safe, its
+ * listeners call straight into libweston, and with a non-blocking socket
+ * that polls for writable the compositor thread never waits on it.
+ *
+ * The two threads talk through a pair of single-producer single-consumer
+ * rings, each with an eventfd to wake up the consumer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "compositor.h"
+
+#include "plugin.h"
+
+#define NET_RING_SIZE 32
+#define NET_MAX_EVENTS 8
+
+enum net_msg_type {
+	NET_MSG_CONNECT,	/* compositor -> net */
+	NET_MSG_QUIT,		/* compositor -> net */
+	NET_MSG_CONNECTED,	/* net -> compositor, fd < 0 on failure */
+};
+
+struct net_msg {
+	enum net_msg_type type;
+	struct weston_transmitter_remote *remote;
+	/* NET_MSG_CONNECT, owned by the net thread once pushed */
+	struct net_connect *nc;
+	char *addr;
+	char *port;
+	int timeout;	/* ms */
+	int fd;
+	int error;
+};
+
+/* single producer, single consumer */
+struct net_ring {
+	struct net_msg msgs[NET_RING_SIZE];
+	unsigned int head; /* written by the producer */
+	unsigned int tail; /* written by the consumer */
+	int wake_fd; /* eventfd */
+};
+
+struct net_connect {
+	struct wl_list link; /* transmitter_net::connect_list or result_list */
+	struct weston_transmitter_remote *remote;
+	int fd;
+	int error;
+	struct addrinfo *res;
+	struct addrinfo *ai; /* address being tried */
+	struct timespec deadline; /* of the whole connect */
+	struct timespec attempt_deadline; /* of the address being tried */
+};
+
+struct transmitter_net {
+	struct weston_transmitter *transmitter;
+	pthread_t thread;
+	int epoll_fd;
+
+	struct net_ring cmd;	/* compositor -> net */
+	struct net_ring result;	/* net -> compositor */
+	struct wl_event_source *result_source;
+
+	/* net thread only */
+	struct wl_list connect_list; /* net_connect::link */
+	struct wl_list result_list; /* net_connect::link, ring was full */
+	bool quit;
+};
+
+static int
+net_ring_push(struct net_ring *ring, const struct net_msg *msg)
+{
+	unsigned int head = ring->head;
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+
+	if (head - tail == NET_RING_SIZE)
+		return -1;
+
+	ring->msgs[head % NET_RING_SIZE] = *msg;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	/* Published, the consumer owns the message now whatever the write
+	 * does. Past EINTR it only fails with EAGAIN, when the counter is
+	 * saturated and a wakeup is pending anyway. */
+	while (write(ring->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+		;
+
+	return 0;
+}
+
+static bool
+net_ring_pop(struct net_ring *ring, struct net_msg *msg)
+{
+	unsigned int tail = ring->tail;
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return false;
+
+	*msg = ring->msgs[tail % NET_RING_SIZE];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static void
+net_ring_clear_wakeup(struct net_ring *ring)
+{
+	uint64_t count;
+
+	while (read(ring->wake_fd, &count, sizeof(count)) > 0)
+		;
+}
+
+/** Hand the outcome of a connect to the compositor thread.
+ *
+ * \return false when the result ring is full, the caller keeps nc then.
+ */
+static bool
+net_post_result(struct transmitter_net *net, struct net_connect *nc)
+{
+	struct net_msg msg = {
+		.type = NET_MSG_CONNECTED,
+		.remote = nc->remote,
+		.fd = nc->fd,
+		.error = nc->error,
+	};
+
+	if (net_ring_push(&net->result, &msg) < 0)
+		return false;
+
+	free(nc);
+	return true;
+}
+
+/** Post the results kept back while the result ring was full.
+ *
+ * \return the ms to wait before trying again, -1 when none is left.
+ */
+static int
+net_post_pending(struct transmitter_net *net)
+{
+	struct net_connect *nc, *tmp;
+
+	wl_list_for_each_safe(nc, tmp, &net->result_list, link) {
+		wl_list_remove(&nc->link);
+		if (!net_post_result(net, nc)) {
+			wl_list_insert(&net->result_list, &nc->link);
+			return 1;
+		}
+	}
+
+	return -1;
+}
+
+static int64_t
+net_ms_until(const struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)(deadline->tv_sec - now.tv_sec) * 1000 +
+	       (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+static void
+net_deadline_set(struct timespec *deadline, int64_t ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += ms / 1000;
+	deadline->tv_nsec += (ms % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+static void
+net_connect_finish(struct transmitter_net *net, struct net_connect *nc,
+		   int error)
+{
+	if (nc->fd >= 0)
+		epoll_ctl(net->epoll_fd, EPOLL_CTL_DEL, nc->fd, NULL);
+	if (error && nc->fd >= 0) {
+		close(nc->fd);
+		nc->fd = -1;
+	}
+	nc->error = error;
+
+	if (nc->res)
+		freeaddrinfo(nc->res);
+	nc->res = NULL;
+
+	/* kept for later, the remote must learn the outcome */
+	wl_list_remove(&nc->link);
+	if (!net_post_result(net, nc))
+		wl_list_insert(net->result_list.prev, &nc->link);
+}
+
+/** Connect to the next address of the receiver that accepts a socket.
+ *
+ * The time left is shared between the addresses still to try, so that an
+ * address that does not answer at all, like IPv6 without a route, leaves
+ * time for the others.
+ *
+ * \return 0 when a connect is in progress, the error of the last address
+ * when none is left.
+ */
+static int
+net_connect_next(struct transmitter_net *net, struct net_connect *nc)
+{
+	struct epoll_event ee;
+	struct addrinfo *ai;
+	int64_t left;
+	int error = EHOSTUNREACH;
+	int count;
+
+	for (; nc->ai; nc->ai = nc->ai->ai_next) {
+		nc->fd = socket(nc->ai->ai_family,
+				nc->ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				nc->ai->ai_protocol);
+		if (nc->fd < 0) {
+			error = errno;
+			continue;
+		}
+
+		if (connect(nc->fd, nc->ai->ai_addr, nc->ai->ai_addrlen) < 0 &&
+		    errno != EINPROGRESS) {
+			error = errno;
+			close(nc->fd);
+			nc->fd = -1;
+			continue;
+		}
+
+		ee.events = EPOLLOUT;
+		ee.data.ptr = nc;
+		if (epoll_ctl(net->epoll_fd, EPOLL_CTL_ADD, nc->fd, &ee) < 0) {
+			error = errno;
+			close(nc->fd);
+			nc->fd = -1;
+			continue;
+		}
+
+		count = 0;
+		for (ai = nc->ai; ai; ai = ai->ai_next)
+			count++;
+		left = net_ms_until(&nc->deadline);
+		net_deadline_set(&nc->attempt_deadline,
+				 left > count ? left / count : 1);
+		return 0;
+	}
+
+	return error;
+}
+
+/** The address being tried failed, go on with the next one. */
+static void
+net_connect_retry(struct transmitter_net *net, struct net_connect *nc,
+		  int error)
+{
+	epoll_ctl(net->epoll_fd, EPOLL_CTL_DEL, nc->fd, NULL);
+	close(nc->fd);
+	nc->fd = -1;
+
+	if (nc->ai->ai_next && net_ms_until(&nc->deadline) > 0) {
+		nc->ai = nc->ai->ai_next;
+		error = net_connect_next(net, nc);
+		if (!error)
+			return;
+	}
+
+	net_connect_finish(net, nc, error);
+}
+
+/** Start a non-blocking connect, the result is posted when it completes. */
+static void
+net_connect_start(struct transmitter_net *net, struct net_msg *msg)
+{
+	struct net_connect *nc = msg->nc;
+	struct addrinfo hints;
+	int error;
+
+	nc->remote = msg->remote;
+	nc->fd = -1;
+	net_deadline_set(&nc->deadline, msg->timeout);
+	wl_list_insert(&net->connect_list, &nc->link);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(msg->addr, msg->port, &hints, &nc->res) != 0) {
+		nc->res = NULL;
+		net_connect_finish(net, nc, EHOSTUNREACH);
+		goto out;
+	}
+
+	nc->ai = nc->res;
+	error = net_connect_next(net, nc);
+	if (error)
+		net_connect_finish(net, nc, error);
+
+out:
+	free(msg->addr);
+	free(msg->port);
+}
+
+static void
+net_handle_commands(struct transmitter_net *net)
+{
+	struct net_msg msg;
+
+	net_ring_clear_wakeup(&net->cmd);
+
+	while (net_ring_pop(&net->cmd, &msg)) {
+		switch (msg.type) {
+		case NET_MSG_CONNECT:
+			net_connect_start(net, &msg);
+			break;
+		case NET_MSG_QUIT:
+			net->quit = true;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/** Fail the connects past their deadline, return the ms to the next one. */
+static int
+net_expire_connects(struct transmitter_net *net)
+{
+	struct net_connect *nc, *tmp;
+	int64_t left;
+	int timeout = -1;
+
+	wl_list_for_each_safe(nc, tmp, &net->connect_list, link) {
+		left = net_ms_until(&nc->attempt_deadline);
+		if (left <= 0) {
+			net_connect_retry(net, nc, ETIMEDOUT);
+			continue;
+		}
+		if (timeout < 0 || left < timeout)
+			timeout = left;
+	}
+
+	return timeout;
+}
+
+static void *
+net_thread_main(void *data)
+{
+	struct transmitter_net *net = data;
+	struct epoll_event ee[NET_MAX_EVENTS];
+	struct net_connect *nc, *tmp;
+	socklen_t len;
+	int count, i, error, timeout;
+
+	while (!net->quit) {
+		timeout = net_expire_connects(net);
+		if (net_post_pending(net) >= 0 &&
+		    (timeout < 0 || timeout > 1))
+			timeout = 1;
+
+		count = epoll_wait(net->epoll_fd, ee, NET_MAX_EVENTS,
+				   timeout);
+
+		for (i = 0; i < count; i++) {
+			nc = ee[i].data.ptr;
+			if (!nc) {
+				net_handle_commands(net);
+				continue;
+			}
+
+			error = 0;
+			len = sizeof(error);
+			if (getsockopt(nc->fd, SOL_SOCKET, SO_ERROR,
+				       &error, &len) < 0)
+				error = errno;
+			if (error)
+				net_connect_retry(net, nc, error);
+			else
+				net_connect_finish(net, nc, 0);
+		}
+	}
+
+	wl_list_for_each_safe(nc, tmp, &net->connect_list, link) {
+		if (nc->fd >= 0)
+			close(nc->fd);
+		if (nc->res)
+			freeaddrinfo(nc->res);
+		wl_list_remove(&nc->link);
+		free(nc);
+	}
+
+	wl_list_for_each_safe(nc, tmp, &net->result_list, link) {
+		if (nc->fd >= 0)
+			close(nc->fd);
+		wl_list_remove(&nc->link);
+		free(nc);
+	}
+
+	return NULL;
+}
+
+/* compositor thread */
+static int
+net_handle_results(int fd, uint32_t mask, void *data)
+{
+	struct transmitter_net *net = data;
+	struct weston_transmitter_remote *remote;
+	struct net_msg msg;
+	bool found;
+
+	net_ring_clear_wakeup(&net->result);
+
+	while (net_ring_pop(&net->result, &msg)) {
+		/* the remote may have been destroyed meanwhile */
+		found = false;
+		wl_list_for_each(remote, &net->transmitter->remote_list, link) {
+			if (remote == msg.remote) {
+				found = true;
+				break;
+			}
+		}
+
+		if (found)
+			transmitter_remote_connected(msg.remote, msg.fd, msg.error);
+		else if (msg.fd >= 0)
+			close(msg.fd);
+	}
+
+	return 0;
+}
+
+/** Ask the network thread to connect to the receiver of \c remote.
+ *
+ * \param remote The remote to connect.
+ * \param timeout Connect timeout in ms.
+ * \return 0 on success, -1 if the request could not be queued.
+ *
+ * transmitter_remote_connected() is called from the compositor event loop
+ * with the outcome.
+ */
+int
+transmitter_net_connect(struct weston_transmitter_remote *remote, int timeout)
+{
+	struct transmitter_net *net = remote->transmitter->net;
+	struct net_msg msg = {
+		.type = NET_MSG_CONNECT,
+		.remote = remote,
+		.timeout = timeout,
+		.fd = -1,
+	};
+
+	/* allocated here, so that running out of memory is reported to the
+	 * caller instead of through the result ring */
+	msg.nc = zalloc(sizeof(*msg.nc));
+	msg.addr = strdup(remote->addr);
+	msg.port = strdup(remote->port);
+	if (!msg.nc || !msg.addr || !msg.port ||
+	    net_ring_push(&net->cmd, &msg) < 0) {
+		free(msg.nc);
+		free(msg.addr);
+		free(msg.port);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+transmitter_net_init(struct weston_transmitter *txr)
+{
+	struct transmitter_net *net;
+	struct epoll_event ee;
+
+	net = zalloc(sizeof(*net));
+	if (!net)
+		return -1;
+
+	net->transmitter = txr;
+	wl_list_init(&net->connect_list);
+	wl_list_init(&net->result_list);
+	net->cmd.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	net->result.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	net->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (net->cmd.wake_fd < 0 || net->result.wake_fd < 0 ||
+	    net->epoll_fd < 0)
+		goto fail;
+
+	ee.events = EPOLLIN;
+	ee.data.ptr = NULL;
+	if (epoll_ctl(net->epoll_fd, EPOLL_CTL_ADD, net->cmd.wake_fd, &ee) < 0)
+		goto fail;
+
+	net->result_source = wl_event_loop_add_fd(txr->loop,
+						  net->result.wake_fd,
+						  WL_EVENT_READABLE,
+						  net_handle_results, net);
+	if (!net->result_source)
+		goto fail;
+
+	if (pthread_create(&net->thread, NULL, net_thread_main, net) != 0) {
+		wl_event_source_remove(net->result_source);
+		goto fail;
+	}
+
+	txr->net = net;
+	return 0;
+
+fail:
+	weston_log("Transmitter: failed to start the network thread\n");
+	if (net->epoll_fd >= 0)
+		close(net->epoll_fd);
+	if (net->cmd.wake_fd >= 0)
+		close(net->cmd.wake_fd);
+	if (net->result.wake_fd >= 0)
+		close(net->result.wake_fd);
+	free(net);
+	return -1;
+}
+
+void
+transmitter_net_destroy(struct weston_transmitter *txr)
+{
+	struct transmitter_net *net = txr->net;
+	struct net_msg msg = { .type = NET_MSG_QUIT };
+
+	if (!net)
+		return;
+
+	/* the ring cannot stay full for long, the thread keeps draining it */
+	while (net_ring_push(&net->cmd, &msg) < 0)
+		usleep(1000);
+	pthread_join(net->thread, NULL);
+
+	wl_event_source_remove(net->result_source);
+	while (net_ring_pop(&net->result, &msg))
+		if (msg.fd >= 0)
+			close(msg.fd);
+
+	close(net->epoll_fd);
+	close(net->cmd.wake_fd);
+	close(net->result.wake_fd);
+	free(net);
+	txr->net = NULL;
+}
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
 
 #include "compositor.h"
 #include "compositor-drm.h"
@@ -62,6 +63,17 @@
  * exclusive with weston_compositor_add_output().
  */
 
+/* frame completion fallback while the receiver paces the output, in ms */
+#define REMOTE_FRAME_TIMEOUT 1000
+/* wp_presentation_feedback.kind.vsync, the protocol header is not installed
+ * along with libweston.
+ */
+#define PRESENTATION_KIND_VSYNC 0x1
+/* bit/s kept for a stream without damage, so that it can start again */
+#define BANDWIDTH_MIN_BITRATE 256000
+/* calm overload control periods before a degraded stream is restored */
+#define STREAM_RESTORE_PERIODS 4
+
 static struct waltham_renderer_interface *waltham_renderer;
 
 static char *
@@ -122,6 +134,11 @@ transmitter_output_disable(struct weston_output *base)
 {
 	struct weston_transmitter_output *output = wl_container_of(base, output, base);
 	wl_event_source_remove(output->finish_frame_timer);
+	wl_event_source_remove(output->phase_timer);
+	if (output->remote_frame_cb) {
+		wthp_callback_free(output->remote_frame_cb);
+		output->remote_frame_cb = NULL;
+	}
 	return 0;
 }
 
@@ -131,6 +148,8 @@ transmitter_output_destroy(struct weston_transmitter_output *output)
 	wl_list_remove(&output->link);
 
 	struct weston_head *head=weston_output_get_first_head(&output->base);
+	if (output->renderer && output->renderer->destroy)
+		output->renderer->destroy(&output->base);
 	free_mode_list(&output->base.mode_list);
 	weston_head_release(head);
 	free(head);
@@ -147,16 +166,208 @@ transmitter_output_destroy_(struct weston_output *base)
 	transmitter_output_destroy(output);
 }
 
+/** Refresh period of the current mode, in ms. */
 static int
-transmitter_output_finish_frame_handler(void *data)
+transmitter_output_refresh_period(struct weston_transmitter_output *output)
+{
+	int32_t refresh = output->base.current_mode->refresh;
+
+	if (refresh <= 1000)
+		return 16;
+
+	return 1000000 / refresh;
+}
+
+static int64_t
+timespec_to_nsec(const struct timespec *a)
+{
+	return (int64_t)a->tv_sec * 1000000000 + a->tv_nsec;
+}
+
+/** Track the receiver's frames on the local presentation clock.
+ *
+ * \param output The remote output.
+ * \param remote_msec Frame time reported by the receiver, in its clock.
+ *
+ * The frame interval is averaged, intervals spanning several frames of
+ * the receiver are divided down to one frame.
+ */
+static void
+transmitter_output_update_vblank(struct weston_transmitter_output *output,
+				 uint32_t remote_msec)
+{
+	struct weston_transmitter_remote *remote = output->remote;
+	struct timespec mono, now;
+	int64_t vblank, interval, period = output->remote_period;
+	int32_t delta_ms;
+	int64_t n;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	weston_compositor_read_presentation_clock(output->base.compositor, &now);
+
+	/* wraps consistently, the frame is at most a few seconds old */
+	delta_ms = (int32_t)(remote_msec - remote->clock_offset -
+			     (uint32_t)(timespec_to_nsec(&mono) / 1000000));
+	vblank = timespec_to_nsec(&now) + (int64_t)delta_ms * 1000000;
+
+	interval = vblank - output->remote_vblank;
+	if (output->remote_vblank && interval > 0 && interval < 200000000) {
+		if (period == 0 || interval < period * 3 / 4) {
+			period = interval;
+		} else {
+			n = (interval + period / 2) / period;
+			period = (7 * period + interval / n) / 8;
+		}
+		output->remote_period = period;
+	}
+	output->remote_vblank = vblank;
+}
+
+/** Delay in ms of the frame finish that phase-locks the next repaint.
+ *
+ * libweston starts the next repaint one refresh period after the finish,
+ * minus the repaint window. The finish is delayed so that the repaint
+ * starts pipeline-latency plus half the RTT before a vblank of the
+ * receiver, for the frame to be decoded just in time. The finish itself
+ * is reported at the time it happens, which is what presentation
+ * feedback gets.
+ *
+ * \return The delay, 0 to finish now.
+ */
+static int
+transmitter_output_phase_delay(struct weston_transmitter_output *output,
+			       const struct timespec *now)
+{
+	struct weston_transmitter_remote *remote = output->remote;
+	int64_t period = output->remote_period;
+	int64_t lead, next, refresh, repaint, finish;
+
+	if (remote->pipeline_latency < 0 || !remote->clock_synced ||
+	    period == 0 || output->remote_vblank == 0 ||
+	    output->base.current_mode->refresh <= 0)
+		return 0;
+
+	lead = (int64_t)remote->pipeline_latency * 1000000 +
+	       remote->srtt * 1000 / 2;
+	refresh = 1000000000000LL / output->base.current_mode->refresh;
+	repaint = (int64_t)output->base.compositor->repaint_msec * 1000000;
+
+	/* first receiver vblank whose repaint can still be aimed at */
+	next = output->remote_vblank;
+	finish = next - lead - refresh + repaint;
+	if (finish < timespec_to_nsec(now))
+		next += ((timespec_to_nsec(now) - finish) / period + 1) * period;
+	finish = next - lead - refresh + repaint;
+
+	return (finish - timespec_to_nsec(now)) / 1000000;
+}
+
+static void
+transmitter_output_finish(struct weston_transmitter_output *output,
+			  uint32_t presented_flags)
+{
+	struct timespec now;
+
+	weston_compositor_read_presentation_clock(output->base.compositor, &now);
+	weston_output_finish_frame(&output->base, &now, presented_flags);
+}
+
+static int
+transmitter_output_phase_handler(void *data)
 {
 	struct weston_transmitter_output *output = data;
+
+	transmitter_output_finish(output, output->phase_flags);
+	return 0;
+}
+
+/** Complete the frame of the last repaint, if not done already. */
+static void
+transmitter_output_frame_done(struct weston_transmitter_output *output,
+			      uint32_t presented_flags)
+{
 	struct timespec now;
+	int delay = 0;
+
+	if (!output->frame_pending)
+		return;
+
+	output->frame_pending = false;
+	wl_event_source_timer_update(output->finish_frame_timer, 0);
+
 	weston_compositor_read_presentation_clock(output->base.compositor, &now);
-	weston_output_finish_frame(&output->base, &now, 0);
+	if (presented_flags)
+		delay = transmitter_output_phase_delay(output, &now);
+	if (delay > 0) {
+		output->phase_flags = presented_flags;
+		wl_event_source_timer_update(output->phase_timer, delay);
+		return;
+	}
+
+	transmitter_output_finish(output, presented_flags);
+}
+
+/** The receiver presented the surface, see waltham_surface_frame_done(). */
+static void
+remote_frame_handle_done(struct wthp_callback *cb, uint32_t time)
+{
+	struct weston_transmitter_output *output =
+		wth_object_get_user_data((struct wth_object *)cb);
+
+	wthp_callback_free(cb);
+	output->remote_frame_cb = NULL;
+	output->remote_paced = true;
+
+	if (output->remote->clock_synced && time)
+		transmitter_output_update_vblank(output, time);
+
+	transmitter_output_frame_done(output, PRESENTATION_KIND_VSYNC);
+}
+
+static const struct wthp_callback_listener remote_frame_listener = {
+	remote_frame_handle_done
+};
+
+/** Ask the receiver for a frame callback, sent with the next commit. */
+static void
+transmitter_output_request_frame(struct weston_transmitter_output *output,
+				 struct weston_transmitter_surface *txs)
+{
+	if (output->remote_frame_cb || !txs || !txs->wthp_surf)
+		return;
+
+	output->remote_frame_cb = wthp_surface_frame(txs->wthp_surf);
+	wthp_callback_set_listener(output->remote_frame_cb,
+				   &remote_frame_listener, output);
+}
+
+/** Fallback when the receiver does not answer the frame callback.
+ *
+ * Receivers that do not support frame callbacks are paced by the refresh
+ * rate of the output mode instead.
+ */
+static int
+transmitter_output_finish_frame_handler(void *data)
+{
+	struct weston_transmitter_output *output = data;
+
+	transmitter_output_frame_done(output, 0);
 	return 0;
 }
 
+/** Wait for the frame of this repaint to be shown by the receiver. */
+static void
+transmitter_output_wait_frame(struct weston_transmitter_output *output)
+{
+	int timeout = transmitter_output_refresh_period(output);
+
+	if (output->remote_frame_cb && output->remote_paced)
+		timeout = REMOTE_FRAME_TIMEOUT;
+
+	output->frame_pending = true;
+	wl_event_source_timer_update(output->finish_frame_timer, timeout);
+}
+
 static void
 transmitter_start_repaint_loop(struct weston_output *base)
 {
@@ -164,6 +375,34 @@ transmitter_start_repaint_loop(struct weston_output *base)
 	weston_output_finish_frame(&output->base,NULL, WP_PRESENTATION_FEEDBACK_INVALID);
 }
 
+/** Whether the frame being repainted is dropped by the overload control. */
+static bool
+transmitter_output_degraded(struct weston_transmitter_output *output)
+{
+	switch (output->degrade) {
+	case TRANSMITTER_DEGRADE_NONE:
+		return false;
+	case TRANSMITTER_DEGRADE_PAUSE:
+		return true;
+	default:
+		return output->frame_count++ & 1;
+	}
+}
+
+/** Count the damage sent with a frame, for the bandwidth allocation. */
+static void
+transmitter_output_account_damage(struct weston_transmitter_output *output,
+				  pixman_region32_t *damage)
+{
+	pixman_box32_t *rects;
+	int i, n;
+
+	rects = pixman_region32_rectangles(damage, &n);
+	for (i = 0; i < n; i++)
+		output->damage_acc += (uint64_t)(rects[i].x2 - rects[i].x1) *
+				      (rects[i].y2 - rects[i].y1);
+}
+
 static int
 transmitter_output_repaint(struct weston_output *base,
 			   pixman_region32_t *damage,void *repaint_data)
@@ -175,6 +414,7 @@ transmitter_output_repaint(struct weston_output *base,
 		weston_get_transmitter_api(txr->compositor);
 	struct weston_transmitter_surface* txs;
 	struct weston_compositor *compositor = base->compositor;
+	struct transmitter_candidate *cand;
 	struct weston_view *view;
 	bool found_output = false;
 	struct timespec ts;
@@ -187,6 +427,7 @@ transmitter_output_repaint(struct weston_output *base,
 	 * If the surface hasn't been conbined to weston_transmitter_surface,
 	 * then call push_to_remote.
 	 * If the surface has already been combined, call gather_state.
+	 * Only the surfaces routed to this remote are considered.
 	 */
 	if (wl_list_empty(&compositor->view_list))
 		goto out;
@@ -194,9 +435,10 @@ transmitter_output_repaint(struct weston_output *base,
 	if (remote->status != WESTON_TRANSMITTER_CONNECTION_READY)
 		goto out;
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link) {
+	wl_list_for_each(cand, &remote->candidate_list, link) {
 		bool found_surface = false;
-		if (view->output == &output->base && (view->surface->width >= 64 && view->surface->height >= 64)) {
+		view = transmitter_candidate_view(cand, output);
+		if (view) {
 			found_output = true;
 			wl_list_for_each(txs, &remote->surface_list, link) {
 				if (txs->surface == view->surface) {
@@ -205,6 +447,27 @@ transmitter_output_repaint(struct weston_output *base,
 						transmitter_api->surface_push_to_remote
 							(view->surface, remote, NULL);
 
+					/* not shown by the receiver, nothing
+					 * to capture until it is visible again
+					 */
+					if (txs->hidden)
+						break;
+
+					output->priority = remote->priority +
+							   txs->priority +
+							   transmitter_candidate_priority(cand);
+					if (transmitter_output_degraded(output))
+						break;
+
+					/* flow control, keep the buffer for
+					 * the repaint on the next ack
+					 */
+					if (transmitter_surface_window_full(txs)) {
+						txs->frame_dropped = true;
+						output->frames_skipped++;
+						break;
+					}
+
 					output->renderer->dmafd =
 						api->get_dma_fd_from_view(&output->base, view, &output->renderer->buf_stride);
 					if(output->renderer->dmafd < 0) {
@@ -223,6 +486,8 @@ transmitter_output_repaint(struct weston_output *base,
 
 					output->renderer->repaint_output(output);
 					output->renderer->dmafd = NULL;
+					transmitter_output_account_damage(output, damage);
+					transmitter_output_request_frame(output, txs);
 					transmitter_api->surface_gather_state(txs);
 					weston_buffer_reference(&view->surface->buffer_ref, NULL);
 					break;
@@ -242,6 +507,8 @@ transmitter_output_repaint(struct weston_output *base,
 
 				output->renderer->repaint_output(output);
 				output->renderer->dmafd = NULL;
+				transmitter_output_account_damage(output, damage);
+				transmitter_output_request_frame(output, txs);
 				transmitter_api->surface_gather_state(txs);
 				weston_buffer_reference(&view->surface->buffer_ref, NULL);
 				break;
@@ -251,11 +518,11 @@ transmitter_output_repaint(struct weston_output *base,
 	if (!found_output)
 		goto out;
 
-	wl_event_source_timer_update(output->finish_frame_timer,1);
+	transmitter_output_wait_frame(output);
 	return 0;
 
 out:
-	wl_event_source_timer_update(output->finish_frame_timer,1);
+	transmitter_output_wait_frame(output);
 	return 0;
 }
 
@@ -267,16 +534,59 @@ transmitter_assign_planes(struct weston_output *base,void *repaint_data) {
 	struct weston_transmitter_output* output = wl_container_of(base, output, base);
 	struct weston_transmitter_remote* remote = output->remote;
 	struct weston_transmitter_surface* txs;
-	struct weston_compositor *compositor = base->compositor;
+	struct transmitter_candidate *cand;
 	struct weston_view *view;
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link) {
-		if (view->output == &output->base && (view->surface->width >= 64 && view->surface->height >= 64)) {
+	wl_list_for_each(cand, &remote->candidate_list, link) {
+		view = transmitter_candidate_view(cand, output);
+		if (view)
 			view->surface->keep_buffer = true;
-		}
 	}
+
+	/* runs before weston sends the frame callbacks of this repaint */
+	wl_list_for_each(txs, &remote->surface_list, link)
+		transmitter_surface_stash_frames(txs);
 }
 
+static struct weston_mode *
+transmitter_output_find_mode(struct weston_transmitter_output *output,
+			     const struct weston_mode *target)
+{
+	struct weston_mode *mode;
+
+	wl_list_for_each(mode, &output->base.mode_list, link)
+		if (mode->width == target->width &&
+		    mode->height == target->height &&
+		    mode->refresh == target->refresh)
+			return mode;
+
+	return NULL;
+}
+
+/** Switch to one of the modes advertised by the receiver.
+ *
+ * Only the mode list is updated; the encoder follows the size of the
+ * remoted surface, and frame pacing follows the receiver's frame
+ * callbacks.
+ */
+static int
+transmitter_output_switch_mode(struct weston_output *base,
+			       struct weston_mode *target)
+{
+	struct weston_transmitter_output *output =
+		wl_container_of(base, output, base);
+	struct weston_mode *mode;
+
+	mode = transmitter_output_find_mode(output, target);
+	if (!mode)
+		return -1;
+
+	base->current_mode->flags &= ~WL_OUTPUT_MODE_CURRENT;
+	mode->flags |= WL_OUTPUT_MODE_CURRENT;
+	base->current_mode = mode;
+
+	return 0;
+}
 
 static int
 transmitter_output_enable(struct weston_output *base)
@@ -290,13 +600,17 @@ transmitter_output_enable(struct weston_output *base)
 	output->base.assign_planes = transmitter_assign_planes;
 	output->base.set_backlight = NULL;
 	output->base.set_dpms = NULL;
-	output->base.switch_mode = NULL;
+	output->base.switch_mode = transmitter_output_switch_mode;
 
 	loop = wl_display_get_event_loop(base->compositor->wl_display);
 	output->finish_frame_timer =
 			wl_event_loop_add_timer(loop,
 						transmitter_output_finish_frame_handler,
 						output);
+	output->phase_timer =
+			wl_event_loop_add_timer(loop,
+						transmitter_output_phase_handler,
+						output);
 	return 0;
 }
 
@@ -318,15 +632,16 @@ int transmitter_output_detach_head(struct weston_output *output,
 
 int
 transmitter_remote_create_output(struct weston_transmitter_remote *remote,
-				 const struct weston_transmitter_output_info *info)
+				 const struct weston_transmitter_output_info *info,
+				 uint32_t index)
 {
 	struct weston_transmitter_output *output;
 	struct weston_transmitter *txr = remote->transmitter;
 	struct weston_head *head;
 	const char *make = strdup(WESTON_TRANSMITTER_OUTPUT_MAKE);
-	const char *model = make_model(remote, 1);
+	const char *model = make_model(remote, index + 1);
 	const char *serial_number = strdup("0");
-	const char *connector_name = make_model(remote, 1);
+	const char *connector_name = make_model(remote, index + 1);
 
 	head=zalloc(sizeof *head);
 	if (!head){
@@ -348,7 +663,7 @@ transmitter_remote_create_output(struct weston_transmitter_remote *remote,
 
 	/* x and y is fake value */
 	wl_list_init(&output->base.mode_list);
-	output->base.name = make_model(remote, 1);
+	output->base.name = make_model(remote, index + 1);
 	/* WL_OUTPUT_MODE_CURRENT already set */
 	weston_output_init(&output->base, remote->transmitter->compositor,output->base.name);
 	if (make_mode_list(&output->base.mode_list, info) < 0)
@@ -365,7 +680,7 @@ transmitter_remote_create_output(struct weston_transmitter_remote *remote,
 	output->base.disable = transmitter_output_disable;
 	output->base.assign_planes = NULL;
 	output->base.set_dpms = NULL;
-	output->base.switch_mode = NULL;
+	output->base.switch_mode = transmitter_output_switch_mode;
 	output->base.gamma_size = 0;
 	output->base.set_gamma = NULL;
 
@@ -378,6 +693,7 @@ transmitter_remote_create_output(struct weston_transmitter_remote *remote,
 	output->base.detach_head = transmitter_output_detach_head;
 
 	output->remote = remote;
+	output->index = index;
 	wl_list_insert(&remote->output_list, &output->link);
 
 	if (txr->waltham_renderer->display_create(output) < 0) {
@@ -402,3 +718,226 @@ fail:
 
 	return -1;
 }
+
+static struct weston_transmitter_output *
+transmitter_remote_find_output(struct weston_transmitter_remote *remote,
+			       uint32_t index)
+{
+	struct weston_transmitter_output *output;
+
+	wl_list_for_each(output, &remote->output_list, link)
+		if (output->index == index)
+			return output;
+
+	return NULL;
+}
+
+/** Follow the displays advertised by the receiver.
+ *
+ * Called after the handshake, once the registry globals are known. Each
+ * receiver display gets a remote output: the first one is the output
+ * created from weston.ini, the others are created here. The modes of a
+ * display are added to its output, and the output switches to the
+ * display's current mode unless a size was configured for it.
+ */
+void
+transmitter_remote_update_outputs(struct weston_transmitter_remote *remote)
+{
+	struct transmitter_remote_mode *rm;
+	struct weston_transmitter_output *output;
+	struct weston_transmitter_output_info info;
+	struct weston_mode *mode;
+	bool configured;
+
+	wl_list_for_each(rm, &remote->display->mode_list, link) {
+		output = transmitter_remote_find_output(remote, rm->output);
+		if (!output) {
+			memset(&info, 0, sizeof info);
+			info.subpixel = WL_OUTPUT_SUBPIXEL_NONE;
+			info.transform = WL_OUTPUT_TRANSFORM_NORMAL;
+			info.scale = 1;
+			info.mode = rm->mode;
+			info.mode.flags |= WL_OUTPUT_MODE_CURRENT;
+			if (transmitter_remote_create_output(remote, &info,
+							     rm->output) < 0)
+				weston_log("Transmitter: failed to create output %u for %s.\n",
+					   rm->output, remote->model);
+			continue;
+		}
+
+		mode = transmitter_output_find_mode(output, &rm->mode);
+		if (!mode) {
+			mode = zalloc(sizeof *mode);
+			if (!mode)
+				continue;
+			*mode = rm->mode;
+			mode->flags &= ~WL_OUTPUT_MODE_CURRENT;
+			wl_list_insert(output->base.mode_list.prev, &mode->link);
+		}
+
+		configured = output->index == 0 &&
+			     remote->width != 0 && remote->height != 0;
+		if (!(rm->mode.flags & WL_OUTPUT_MODE_CURRENT) || configured ||
+		    mode == output->base.current_mode)
+			continue;
+
+		if (weston_output_mode_set_native(&output->base, mode,
+						  output->base.current_scale) < 0)
+			weston_log("Transmitter: %s cannot switch to %dx%d@%d.\n",
+				   output->base.name, mode->width,
+				   mode->height, mode->refresh);
+	}
+}
+
+/* bandwidth weight, the damage area scaled by the priority */
+static uint64_t
+transmitter_output_weight(struct weston_transmitter_output *output)
+{
+	int32_t priority = output->priority > 0 ? output->priority : 0;
+
+	return output->damage_avg * (uint64_t)(priority + 1);
+}
+
+static void
+transmitter_output_set_bitrate(struct weston_transmitter_output *output,
+			       uint32_t bitrate)
+{
+	if (bitrate == output->bitrate)
+		return;
+
+	output->bitrate = bitrate;
+	if (output->renderer && output->renderer->set_bitrate)
+		output->renderer->set_bitrate(&output->base, bitrate);
+}
+
+/** Split the bandwidth budget of a remote across its outputs.
+ *
+ * Every output runs its own encoder. Outputs which sent nothing during the
+ * last period only keep BANDWIDTH_MIN_BITRATE; this covers idle clients as
+ * well as surfaces hidden on the receiver. The rest of the budget goes to
+ * the active outputs in proportion to their smoothed damage area, times
+ * their priority plus one. The sum
+ * of the allocations never exceeds the budget.
+ */
+void
+transmitter_remote_allocate_bandwidth(struct weston_transmitter_remote *remote)
+{
+	struct weston_transmitter_output *output;
+	uint64_t budget = (uint64_t)remote->bandwidth * 1000;
+	uint64_t total = 0;
+	uint64_t rest, share;
+	int count = 0, active = 0;
+
+	if (remote->bandwidth <= 0)
+		return;
+
+	wl_list_for_each(output, &remote->output_list, link) {
+		output->damage_avg = (3 * output->damage_avg +
+				      output->damage_acc) / 4;
+		if (output->damage_acc) {
+			total += transmitter_output_weight(output);
+			active++;
+		}
+		count++;
+	}
+	if (count == 0)
+		return;
+
+	/* nothing to weigh, or not even the minimum for everyone */
+	if (active == 0 || budget < (uint64_t)count * BANDWIDTH_MIN_BITRATE) {
+		wl_list_for_each(output, &remote->output_list, link) {
+			output->damage_acc = 0;
+			transmitter_output_set_bitrate(output, budget / count);
+		}
+		return;
+	}
+
+	rest = budget - (uint64_t)count * BANDWIDTH_MIN_BITRATE;
+	wl_list_for_each(output, &remote->output_list, link) {
+		share = BANDWIDTH_MIN_BITRATE;
+		if (output->damage_acc && total)
+			share += (double)rest * transmitter_output_weight(output) /
+				 total;
+		output->damage_acc = 0;
+		transmitter_output_set_bitrate(output, share);
+	}
+}
+
+static const char *const degrade_names[] = {
+	[TRANSMITTER_DEGRADE_NONE] = "full rate",
+	[TRANSMITTER_DEGRADE_FRAMERATE] = "half frame rate",
+	[TRANSMITTER_DEGRADE_RESOLUTION] = "half resolution",
+	[TRANSMITTER_DEGRADE_PAUSE] = "paused",
+};
+
+static void
+transmitter_output_set_degrade(struct weston_transmitter_output *output,
+			       enum transmitter_degrade degrade)
+{
+	bool resumed = output->degrade == TRANSMITTER_DEGRADE_PAUSE;
+
+	output->degrade = degrade;
+	weston_log("Transmitter: %s (priority %d) %s.\n", output->base.name,
+		   output->priority, degrade_names[degrade]);
+
+	if (output->renderer && output->renderer->set_scale)
+		output->renderer->set_scale(&output->base,
+			degrade >= TRANSMITTER_DEGRADE_RESOLUTION ? 2 : 1);
+
+	/* the receiver has not seen a frame for a while */
+	if (resumed) {
+		if (output->renderer && output->renderer->force_keyframe)
+			output->renderer->force_keyframe(&output->base);
+		weston_output_schedule_repaint(&output->base);
+	}
+}
+
+/** Degrade or restore one stream, depending on the load of the last period.
+ *
+ * Frames skipped by flow control mean that a receiver, the link or the
+ * encoders cannot keep up. Then the lowest priority output which is not
+ * paused yet goes one step down: half frame rate, then half resolution,
+ * then paused. The outputs of the highest priority are never degraded, so
+ * with equal priorities nothing changes. After STREAM_RESTORE_PERIODS calm
+ * periods the highest priority degraded output goes one step back up.
+ */
+void
+transmitter_control_streams(struct weston_transmitter *txr)
+{
+	struct weston_transmitter_remote *remote;
+	struct weston_transmitter_output *output;
+	struct weston_transmitter_output *victim = NULL, *restore = NULL;
+	bool overload = false;
+	bool first = true;
+	int32_t top = 0;
+
+	wl_list_for_each(remote, &txr->remote_list, link) {
+		wl_list_for_each(output, &remote->output_list, link) {
+			if (output->frames_skipped)
+				overload = true;
+			output->frames_skipped = 0;
+
+			if (first || output->priority > top)
+				top = output->priority;
+			first = false;
+
+			if (output->degrade != TRANSMITTER_DEGRADE_PAUSE &&
+			    (!victim || output->priority < victim->priority))
+				victim = output;
+			if (output->degrade != TRANSMITTER_DEGRADE_NONE &&
+			    (!restore || output->priority > restore->priority))
+				restore = output;
+		}
+	}
+
+	if (overload) {
+		txr->calm_periods = 0;
+		if (victim && victim->priority < top)
+			transmitter_output_set_degrade(victim,
+						       victim->degrade + 1);
+	} else if (restore &&
+		   ++txr->calm_periods >= STREAM_RESTORE_PERIODS) {
+		txr->calm_periods = 0;
+		transmitter_output_set_degrade(restore, restore->degrade - 1);
+	}
+}
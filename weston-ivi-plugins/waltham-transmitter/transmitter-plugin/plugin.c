@@ -23,30 +23,62 @@
  * SOFTWARE.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
 #include <linux/input.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "compositor.h"
 
 #include "weston.h"
 #include "plugin.h"
 #include "transmitter_api.h"
+#include "waltham-renderer.h"
 #include "plugin-registry.h"
 #include "ivi-layout-export.h"
 
 /* waltham */
 #include <errno.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <waltham-object.h>
 #include <waltham-client.h>
 #include <waltham-connection.h>
 
 #define MAX_EPOLL_WATCHES 2
-#define ESTABLISH_CONNECTION_PERIOD 2000
 #define RETRY_CONNECTION_PERIOD 5000
+/* reconnect backoff bounds, in ms */
+#define RECONNECT_DELAY_MIN 100
+#define RECONNECT_DELAY_MAX 5000
+/* heartbeat defaults, in ms */
+#define HEARTBEAT_INTERVAL 1000
+#define HEARTBEAT_TIMEOUT 3000
+/* encode + decode time the capture is scheduled ahead of, in ms */
+#define PIPELINE_LATENCY 10
+/* frames sent to the receiver and not acknowledged yet, per surface */
+#define MAX_FRAMES_IN_FLIGHT 2
+/* TCP connect and Waltham handshake deadlines, in ms */
+#define CONNECT_TIMEOUT 3000
+#define HANDSHAKE_TIMEOUT 3000
+/* bandwidth reallocation period, ms */
+#define BANDWIDTH_PERIOD 500
+/* overload control period, ms */
+#define STREAM_CONTROL_PERIOD 500
+
+#define LATENCY_REPORT_PERIOD 10000
+
+/* marking of the Waltham connection, which carries input and control */
+#define SOCKET_DSCP 46 /* expedited forwarding */
+#define SOCKET_PRIORITY 6 /* TC_PRIO_INTERACTIVE */
 
 /* XXX: all functions and variables with a name, and things marked with a
  * comment, containing the word "fake" are mockups that need to be
@@ -80,6 +112,75 @@ transmitter_surface_ivi_resize(struct weston_transmitter_surface *txs,
 	txs->resize_handler(txs->resize_handler_data, width, height);
 }
 
+/** Hand the stashed frame callbacks back to the weston_surface.
+ *
+ * They are sent by the next repaint of the surface, or destroyed along
+ * with the surface.
+ */
+static void
+transmitter_surface_release_frames(struct weston_transmitter_surface *txs)
+{
+	if (!txs->surface || wl_list_empty(&txs->frame_callback_list))
+		return;
+
+	wl_list_insert_list(&txs->surface->frame_callback_list,
+			    &txs->frame_callback_list);
+	wl_list_init(&txs->frame_callback_list);
+}
+
+/** Keep the frame callbacks of a hidden surface from being sent.
+ *
+ * Called from assign_planes, before weston collects the frame callbacks
+ * of the repainted surfaces, so that the client stops drawing while the
+ * receiver does not show it.
+ */
+void
+transmitter_surface_stash_frames(struct weston_transmitter_surface *txs)
+{
+	if (!txs->hidden || !txs->surface)
+		return;
+
+	wl_list_insert_list(txs->frame_callback_list.prev,
+			    &txs->surface->frame_callback_list);
+	wl_list_init(&txs->surface->frame_callback_list);
+}
+
+/** The receiver reports whether it shows the surface.
+ *
+ * A configure of 0x0 means that the surface is not on any of the
+ * receiver's displays: nothing is captured nor encoded for it until a
+ * configure with a size arrives. The receiver sizes are not relayed to
+ * the application.
+ */
+static void
+ivi_surface_handle_configure(struct wthp_ivi_surface *ivi_surface,
+			     int32_t width, int32_t height)
+{
+	struct weston_transmitter_surface *txs =
+		wth_object_get_user_data((struct wth_object *)ivi_surface);
+	struct weston_transmitter_output *output;
+	bool hidden = width == 0 && height == 0;
+
+	if (hidden == txs->hidden || !txs->remote)
+		return;
+
+	txs->hidden = hidden;
+	if (hidden)
+		return;
+
+	/* The encoder skipped frames, the receiver needs a key frame */
+	transmitter_surface_release_frames(txs);
+	wl_list_for_each(output, &txs->remote->output_list, link) {
+		if (output->renderer && output->renderer->force_keyframe)
+			output->renderer->force_keyframe(&output->base);
+		weston_output_schedule_repaint(&output->base);
+	}
+}
+
+static const struct wthp_ivi_surface_listener ivi_surface_listener = {
+	ivi_surface_handle_configure
+};
+
 static void
 transmitter_surface_configure(struct weston_transmitter_surface *txs,
 			      int32_t dx, int32_t dy)
@@ -92,31 +193,143 @@ transmitter_surface_configure(struct weston_transmitter_surface *txs,
 	txs->attach_dy += dy;
 }
 
+/** The receiver acknowledged the frame \c serial of the surface.
+ *
+ * The receiver acks at the repaint of its window that follows the commit,
+ * not when the video of the frame is decoded, so this paces the surface
+ * by the repaints of the receiver only.
+ *
+ * Receivers without flow control answer with 0 as soon as the buffer is
+ * attached, that counts as one frame.
+ */
 static void
 buffer_send_complete(struct wthp_buffer *b, uint32_t serial)
 {
-	if (b)
-		wthp_buffer_destroy(b);
+	struct transmitter_buffer *tb;
+	struct weston_transmitter_surface *txs = NULL;
+	struct weston_transmitter_output *output;
+
+	if (!b)
+		return;
+
+	tb = wth_object_get_user_data((struct wth_object *)b);
+	if (tb) {
+		txs = tb->txs;
+		wl_list_remove(&tb->link);
+		free(tb);
+	}
+	wthp_buffer_destroy(b);
+
+	if (!txs)
+		return;
+
+	if (serial == 0)
+		txs->frame_acked++;
+	else if ((int32_t)(serial - txs->frame_acked) > 0)
+		txs->frame_acked = serial;
+
+	/* the skipped frame is captured again from the latest content */
+	if (txs->frame_dropped && txs->remote &&
+	    !transmitter_surface_window_full(txs)) {
+		txs->frame_dropped = false;
+		wl_list_for_each(output, &txs->remote->output_list, link)
+			weston_output_schedule_repaint(&output->base);
+	}
 }
 
 static const struct wthp_buffer_listener buffer_listener = {
 	buffer_send_complete
 };
 
+/** Stop using a broken connection and schedule the reconnect.
+ *
+ * Only stops polling the socket here, the Waltham objects are released
+ * from retry_timer_handler() outside of any Waltham dispatch.
+ */
+static void
+transmitter_remote_connection_lost(struct weston_transmitter_remote *remote)
+{
+	remote->display->running = false;
+	if (remote->source) {
+		wl_event_source_remove(remote->source);
+		remote->source = NULL;
+	}
+
+	if (remote->handshake_cb) {
+		/* the receiver went away during the handshake */
+		wl_event_source_timer_update(remote->establish_timer, 1);
+		return;
+	}
+
+	if (remote->status == WESTON_TRANSMITTER_CONNECTION_DISCONNECTED)
+		return;
+
+	weston_log("Transmitter: lost connection to %s:%s\n",
+		   remote->addr, remote->port);
+
+	remote->status = WESTON_TRANSMITTER_CONNECTION_DISCONNECTED;
+	wl_event_source_timer_update(remote->retry_timer, 1);
+}
+
+/** Flush the Waltham connection without blocking.
+ *
+ * If the socket is full, it is polled for writable as well and the rest
+ * is flushed from waltham_mainloop() once there is room again.
+ */
+void
+transmitter_remote_flush(struct weston_transmitter_remote *remote)
+{
+	struct waltham_display *dpy = remote->display;
+	bool writable_poll;
+	int ret;
+
+	if (!dpy->connection || !remote->source)
+		return;
+
+	ret = wth_connection_flush(dpy->connection);
+	if (ret < 0 && errno != EAGAIN) {
+		weston_log("Transmitter: flush to %s:%s failed: %s\n",
+			   remote->addr, remote->port, strerror(errno));
+		transmitter_remote_connection_lost(remote);
+		return;
+	}
+
+	writable_poll = ret < 0;
+	if (writable_poll == dpy->writable_poll)
+		return;
+
+	dpy->writable_poll = writable_poll;
+	wl_event_source_fd_update(remote->source, writable_poll ?
+				  WL_EVENT_READABLE | WL_EVENT_WRITABLE :
+				  WL_EVENT_READABLE);
+}
+
+/** Whether max-frames-in-flight frames of the surface are unacknowledged.
+ *
+ * A frame is then skipped before it is encoded, the next one is captured
+ * from the latest content once the receiver catches up. The acks follow
+ * the repaints of the receiver window, not the decode of the video, so
+ * this keeps commits at the pace of the receiver but does not bound the
+ * frames queued in the encoder or on the UDP stream.
+ */
+bool
+transmitter_surface_window_full(struct weston_transmitter_surface *txs)
+{
+	int32_t max = txs->remote->max_frames_in_flight;
+
+	return max > 0 && (int32_t)(txs->frame_seq - txs->frame_acked) >= max;
+}
+
 static void
 transmitter_surface_gather_state(struct weston_transmitter_surface *txs)
 {
 	struct weston_transmitter_remote *remote = txs->remote;
 	struct waltham_display *dpy = remote->display;
+	struct transmitter_buffer *tb;
 	int ret;
 
 	if(!dpy->running) {
-		if(remote->status != WESTON_TRANSMITTER_CONNECTION_DISCONNECTED) {
-			remote->status = WESTON_TRANSMITTER_CONNECTION_DISCONNECTED;
-			wth_connection_destroy(remote->display->connection);
-			wl_event_source_remove(remote->source);
-			wl_event_source_timer_update(remote->retry_timer, 1);
-		}
+		transmitter_remote_connection_lost(remote);
 	}
 	else {
 		/* TODO: transmit surface state to remote */
@@ -135,22 +348,36 @@ transmitter_surface_gather_state(struct weston_transmitter_surface *txs)
 		data = malloc(stride * height);
 		data_sz = stride * height;
 
-		/* fake sending buffer */
-		txs->wthp_buf = wthp_blob_factory_create_buffer(remote->display->blob_factory,
-								data_sz,
-								data,
-								surf->width,
-								surf->height,
-								stride,
-								PIXMAN_FORMAT_BPP(comp->read_format));
+		/* echoed by the receiver in wthp_buffer.complete */
+		if (++txs->frame_seq == 0)
+			txs->frame_seq = 1;
+		if (data && data_sz >= (int32_t)sizeof(txs->frame_seq))
+			memcpy(data, &txs->frame_seq, sizeof(txs->frame_seq));
 
-		wthp_buffer_set_listener(txs->wthp_buf, &buffer_listener, txs);
+		tb = zalloc(sizeof *tb);
+		if (!tb) {
+			free(data);
+			return;
+		}
 
-		wthp_surface_attach(txs->wthp_surf, txs->wthp_buf, txs->attach_dx, txs->attach_dy);
+		/* fake sending buffer */
+		tb->obj = wthp_blob_factory_create_buffer(remote->display->blob_factory,
+							  data_sz,
+							  data,
+							  surf->width,
+							  surf->height,
+							  stride,
+							  PIXMAN_FORMAT_BPP(comp->read_format));
+		tb->txs = txs;
+		wl_list_insert(&txs->buffer_list, &tb->link);
+
+		wthp_buffer_set_listener(tb->obj, &buffer_listener, tb);
+
+		wthp_surface_attach(txs->wthp_surf, tb->obj, txs->attach_dx, txs->attach_dy);
 		wthp_surface_damage(txs->wthp_surf, txs->attach_dx, txs->attach_dy, surf->width, surf->height);
 		wthp_surface_commit(txs->wthp_surf);
 
-		wth_connection_flush(remote->display->connection);
+		transmitter_remote_flush(remote);
 		free(data);
 		data=NULL;
 		txs->attach_dx = 0;
@@ -158,6 +385,27 @@ transmitter_surface_gather_state(struct weston_transmitter_surface *txs)
 	}
 }
 
+/** Forget the frames of the surface that the receiver did not acknowledge.
+ *
+ * \param destroy Destroy them on the receiver, otherwise they are only
+ * released locally, as when the connection is gone.
+ */
+static void
+transmitter_surface_drop_buffers(struct weston_transmitter_surface *txs,
+				 bool destroy)
+{
+	struct transmitter_buffer *tb, *tmp;
+
+	wl_list_for_each_safe(tb, tmp, &txs->buffer_list, link) {
+		if (destroy)
+			wthp_buffer_destroy(tb->obj);
+		else
+			wthp_buffer_free(tb->obj);
+		wl_list_remove(&tb->link);
+		free(tb);
+	}
+}
+
 /** Mark the weston_transmitter_surface dead.
  *
  * Stop all remoting actions on this surface.
@@ -174,6 +422,7 @@ transmitter_surface_zombify(struct weston_transmitter_surface *txs)
 
 	wl_signal_emit(&txs->destroy_signal, txs);
 
+	transmitter_surface_release_frames(txs);
 	wl_list_remove(&txs->surface_destroy_listener.link);
 	txs->surface = NULL;
 
@@ -182,6 +431,7 @@ transmitter_surface_zombify(struct weston_transmitter_surface *txs)
 	remote = txs->remote;
 	if (!remote->display->compositor)
 		weston_log("remote->compositor is NULL\n");
+	transmitter_surface_drop_buffers(txs, txs->wthp_surf != NULL);
 	if (txs->wthp_surf)
 		wthp_surface_destroy(txs->wthp_surf);
 	if (txs->wthp_ivi_surface)
@@ -225,50 +475,173 @@ sync_output_destroy_handler(struct wl_listener *listener, void *data)
 	weston_surface_force_output(txs->surface, NULL);
 }
 
+/* weston_surface -> ivi id, fed by the ivi-layout notifications */
+struct transmitter_ivi_id {
+	struct wl_listener surface_destroy_listener;
+	uint32_t id_surface;
+};
+
+static void
+ivi_id_surface_destroyed(struct wl_listener *listener, void *data)
+{
+	struct transmitter_ivi_id *ivi_id =
+		wl_container_of(listener, ivi_id, surface_destroy_listener);
+
+	wl_list_remove(&ivi_id->surface_destroy_listener.link);
+	free(ivi_id);
+}
+
+/** Find the ivi id of a surface, without scanning the ivi-layout. */
+static struct transmitter_ivi_id *
+transmitter_ivi_id_get(struct weston_surface *ws)
+{
+	struct transmitter_ivi_id *ivi_id;
+	struct wl_listener *listener;
+
+	listener = wl_signal_get(&ws->destroy_signal, ivi_id_surface_destroyed);
+	if (!listener)
+		return NULL;
+
+	return wl_container_of(listener, ivi_id, surface_destroy_listener);
+}
+
+static void
+transmitter_ivi_id_add(struct weston_transmitter *txr,
+		       struct ivi_layout_surface *ivisurf)
+{
+	struct weston_surface *ws = txr->lyt->surface_get_weston_surface(ivisurf);
+	struct transmitter_ivi_id *ivi_id;
+
+	if (!ws || transmitter_ivi_id_get(ws))
+		return;
+
+	ivi_id = zalloc(sizeof *ivi_id);
+	if (!ivi_id)
+		return;
+
+	ivi_id->id_surface = txr->lyt->get_id_of_surface(ivisurf);
+	ivi_id->surface_destroy_listener.notify = ivi_id_surface_destroyed;
+	wl_signal_add(&ws->destroy_signal, &ivi_id->surface_destroy_listener);
+}
+
+static void
+ivi_surface_created(struct wl_listener *listener, void *data)
+{
+	struct weston_transmitter *txr =
+		wl_container_of(listener, txr, ivi_surface_created_listener);
+
+	transmitter_ivi_id_add(txr, data);
+	transmitter_routes_update(txr);
+}
+
+static void
+ivi_surface_removed(struct wl_listener *listener, void *data)
+{
+	struct weston_transmitter *txr =
+		wl_container_of(listener, txr, ivi_surface_removed_listener);
+	struct weston_surface *ws = txr->lyt->surface_get_weston_surface(data);
+	struct transmitter_ivi_id *ivi_id;
+
+	if (!ws)
+		return;
+
+	ivi_id = transmitter_ivi_id_get(ws);
+	if (ivi_id)
+		ivi_id_surface_destroyed(&ivi_id->surface_destroy_listener, ws);
+	transmitter_routes_update(txr);
+}
+
+/** Track the ivi ids of surfaces as ivi-layout creates and removes them. */
+static void
+transmitter_ivi_id_init(struct weston_transmitter *txr)
+{
+	struct ivi_layout_surface **pp_surface = NULL;
+	int32_t surface_length = 0;
+	int32_t i;
+
+	wl_list_init(&txr->ivi_surface_created_listener.link);
+	wl_list_init(&txr->ivi_surface_removed_listener.link);
+
+	txr->lyt = weston_plugin_api_get(txr->compositor, IVI_LAYOUT_API_NAME,
+					 sizeof(*txr->lyt));
+	if (!txr->lyt) {
+		weston_log("Transmitter: ivi-layout not found\n");
+		return;
+	}
+
+	txr->ivi_surface_created_listener.notify = ivi_surface_created;
+	txr->lyt->add_listener_create_surface(&txr->ivi_surface_created_listener);
+	txr->ivi_surface_removed_listener.notify = ivi_surface_removed;
+	txr->lyt->add_listener_remove_surface(&txr->ivi_surface_removed_listener);
+
+	/* surfaces created before the Transmitter was loaded */
+	txr->lyt->get_surfaces(&surface_length, &pp_surface);
+	for (i = 0; i < surface_length; i++)
+		transmitter_ivi_id_add(txr, pp_surface[i]);
+	free(pp_surface);
+}
+
+static int32_t
+transmitter_surface_priority(struct weston_transmitter *txr, uint32_t ivi_id)
+{
+	struct transmitter_surface_config *cfg;
+
+	wl_list_for_each(cfg, &txr->surface_config_list, link)
+		if (cfg->ivi_id == ivi_id)
+			return cfg->priority;
+
+	return 0;
+}
+
 static void
 transmitter_surface_set_ivi_id(struct weston_transmitter_surface *txs)
 {
         struct weston_transmitter_remote *remote = txs->remote;
 	struct waltham_display *dpy = remote->display;
-	struct weston_surface *ws;
-	struct ivi_layout_surface **pp_surface = NULL;
-	struct ivi_layout_surface *ivi_surf = NULL;
-	int32_t surface_length = 0;
-	int32_t ret = 0;
-	int32_t i = 0;
+	struct transmitter_ivi_id *ivi_id;
+	struct weston_transmitter_seat *seat;
 
-	ret = txs->lyt->get_surfaces(&surface_length, &pp_surface);
-	if(!ret)
-		weston_log("No ivi_surface\n");
+	assert(txs->surface);
+	if (!txs->surface)
+		return;
 
-	ws = txs->surface;
-
-	for(i = 0; i < surface_length; i++) {
-		ivi_surf = pp_surface[i];
-		if (ivi_surf->surface == ws) {
-			assert(txs->surface);
-			if (!txs->surface)
-				return;
-			if(!dpy)
-				weston_log("no content in waltham_display\n");
-			if(!dpy->compositor)
-				weston_log("no content in compositor object\n");
-			if(!dpy->seat)
-				weston_log("no content in seat object\n");
-			if(!dpy->application)
-				weston_log("no content in ivi-application object\n");
-
-			txs->wthp_ivi_surface = wthp_ivi_application_surface_create
-				(dpy->application, ivi_surf->id_surface,  txs->wthp_surf);
-			wth_connection_flush(remote->display->connection);
-			weston_log("surface ID %d\n", ivi_surf->id_surface);
-			if(!txs->wthp_ivi_surface){
-				weston_log("Failed to create txs->ivi_surf\n");
-			}
+	ivi_id = transmitter_ivi_id_get(txs->surface);
+	if (!ivi_id) {
+		weston_log("No ivi_surface\n");
+		return;
+	}
+	txs->priority = transmitter_surface_priority(remote->transmitter,
+						     ivi_id->id_surface);
+
+	if(!dpy)
+		weston_log("no content in waltham_display\n");
+	if(!dpy->compositor)
+		weston_log("no content in compositor object\n");
+	if(!dpy->seat)
+		weston_log("no content in seat object\n");
+	if(!dpy->application)
+		weston_log("no content in ivi-application object\n");
+
+	txs->wthp_ivi_surface = wthp_ivi_application_surface_create
+		(dpy->application, ivi_id->id_surface,  txs->wthp_surf);
+	weston_log("surface ID %d\n", ivi_id->id_surface);
+	if(!txs->wthp_ivi_surface){
+		weston_log("Failed to create txs->ivi_surf\n");
+		return;
+	}
+	wthp_ivi_surface_set_listener(txs->wthp_ivi_surface,
+				      &ivi_surface_listener, txs);
+	txs->ivi_id = ivi_id->id_surface;
+
+	/* the recording refers to surfaces, it starts with the first one */
+	if (remote->input_replay && !wl_list_empty(&remote->seat_list)) {
+		seat = wl_container_of(remote->seat_list.next, seat, link);
+		if (transmitter_seat_replay_start(seat, remote->input_replay,
+						  remote->input_replay_speed) < 0) {
+			free(remote->input_replay);
+			remote->input_replay = NULL;
 		}
 	}
-	free(pp_surface);
-	pp_surface = NULL;
 }
 
 static struct weston_transmitter_surface *
@@ -315,9 +688,9 @@ transmitter_surface_push_to_remote(struct weston_surface *ws,
 
 		wl_list_init(&txs->frame_callback_list);
 		wl_list_init(&txs->feedback_list);
+		wl_list_init(&txs->buffer_list);
 
-		txs->lyt = weston_plugin_api_get(txr->compositor,
-						 IVI_LAYOUT_API_NAME, sizeof(txs->lyt));
+		txs->lyt = txr->lyt;
 	}
 
 	/* TODO: create the content stream connection... */
@@ -326,8 +699,8 @@ transmitter_surface_push_to_remote(struct weston_surface *ws,
 	if (!txs->wthp_surf) {
 		weston_log("txs->wthp_surf is NULL\n");
 		txs->wthp_surf = wthp_compositor_create_surface(remote->display->compositor);
-		wth_connection_flush(remote->display->connection);
 		transmitter_surface_set_ivi_id(txs);
+		transmitter_remote_flush(remote);
 	}
 
 	return txs;
@@ -339,6 +712,83 @@ transmitter_surface_get_stream_status(struct weston_transmitter_surface *txs)
 	return txs->status;
 }
 
+/** Remember one display mode advertised by the receiver.
+ *
+ * The receiver lists the modes of its displays as registry globals named
+ * "wthp_output_mode/<display>/<width>x<height>@<mHz>/<wl_output mode flags>".
+ */
+static void
+registry_add_mode(struct waltham_display *dpy, const char *interface)
+{
+	struct transmitter_remote_mode *rm;
+	uint32_t output, flags;
+	int32_t width, height, refresh;
+
+	if (sscanf(interface, "wthp_output_mode/%u/%dx%d@%d/%u",
+		   &output, &width, &height, &refresh, &flags) != 5 ||
+	    width <= 0 || height <= 0 || refresh <= 0) {
+		weston_log("Transmitter: ignoring bad mode '%s'.\n",
+			   interface);
+		return;
+	}
+
+	rm = zalloc(sizeof *rm);
+	if (!rm)
+		return;
+
+	rm->output = output;
+	rm->mode.flags = flags & (WL_OUTPUT_MODE_CURRENT |
+				  WL_OUTPUT_MODE_PREFERRED);
+	rm->mode.width = width;
+	rm->mode.height = height;
+	rm->mode.refresh = refresh;
+	wl_list_insert(dpy->mode_list.prev, &rm->link);
+}
+
+/** Consider one decoder advertised by the receiver.
+ *
+ * The receiver lists its decoders as "wthp_decoder/<codec>/<cost>". A codec
+ * is usable if we have a transmitter_pipeline_<codec>.cfg for it; the
+ * cheapest usable one is kept.
+ */
+static void
+registry_add_decoder(struct waltham_display *dpy, uint32_t name,
+		     const char *interface)
+{
+	char codec[16];
+	char path[64];
+	uint32_t cost;
+
+	if (sscanf(interface, "wthp_decoder/%15[^/]/%u", codec, &cost) != 2) {
+		weston_log("Transmitter: ignoring bad decoder '%s'.\n",
+			   interface);
+		return;
+	}
+
+	snprintf(path, sizeof path, TRANSMITTER_PIPELINE_DIR
+		 "/transmitter_pipeline_%s.cfg", codec);
+	if (access(path, R_OK) < 0)
+		return;
+
+	if (dpy->decoder[0] && cost >= dpy->decoder_cost)
+		return;
+
+	snprintf(dpy->decoder, sizeof dpy->decoder, "%s", interface);
+	dpy->decoder_name = name;
+	dpy->decoder_cost = cost;
+}
+
+static void
+registry_clear_modes(struct waltham_display *dpy)
+{
+	struct transmitter_remote_mode *rm, *tmp;
+
+	wl_list_for_each_safe(rm, tmp, &dpy->mode_list, link) {
+		wl_list_remove(&rm->link);
+		free(rm);
+	}
+}
+
 /* waltham */
 /* The server advertises a global interface.
  * We can store the ad for later and/or bind to it immediately
@@ -369,6 +819,14 @@ registry_handle_global(struct wthp_registry *registry,
 	} else if (strcmp(interface, "wthp_ivi_application") == 0) {
 	        assert(!dpy->application);
 		dpy->application = (struct wthp_ivi_application *)wthp_registry_bind(registry, name, interface, 1);
+	} else if (strncmp(interface, "wthp_output_mode/", 17) == 0) {
+		/* Not bound: the receiver describes its displays in the
+		 * interface name, see transmitter_remote_update_outputs().
+		 */
+		registry_add_mode(dpy, interface);
+	} else if (strncmp(interface, "wthp_decoder/", 13) == 0) {
+		/* bound in transmitter_remote_select_codec() */
+		registry_add_decoder(dpy, name, interface);
 	}
 }
 
@@ -396,13 +854,13 @@ conn_ready_notify(struct wl_listener *l, void *data)
 		if(remote->height != 0) {
 			info.mode.width = remote->width;
 			info.mode.height = remote->height;
-			info.mode.refresh= 60;
+			info.mode.refresh= 60000;
 		}
 	}
 	/* Outputs and seats are dynamic, do not guarantee they are all
 	 * present when signalling connection status.
 	 */
-	transmitter_remote_create_output(remote, &info);
+	transmitter_remote_create_output(remote, &info, 0);
 	transmitter_remote_create_seat(remote);
 }
 
@@ -432,6 +890,7 @@ connection_handle_data(struct watch *w, uint32_t events)
 {
 	struct waltham_display *dpy = wl_container_of(w, dpy, conn_watch);
 	struct weston_transmitter_remote *remote = dpy->remote;
+	int on = 1;
 	int ret;
 
 
@@ -451,7 +910,9 @@ connection_handle_data(struct watch *w, uint32_t events)
 		/* Flush out again. If the flush completes, stop
 		 * polling for writable as everything has been written.
 		 */
-		ret = wth_connection_flush(dpy->connection);
+		transmitter_remote_flush(remote);
+		if (!dpy->running)
+			return;
 	}
 
 	if (events & EPOLLIN) {
@@ -467,6 +928,10 @@ connection_handle_data(struct watch *w, uint32_t events)
 
 			return;
 		}
+
+		/* acknowledge the next input right away as well */
+		setsockopt(dpy->conn_watch.fd, IPPROTO_TCP, TCP_QUICKACK,
+			   &on, sizeof(on));
 	}
 
 	if (events & EPOLLHUP) {
@@ -484,22 +949,39 @@ waltham_mainloop(int fd, uint32_t mask, void *data)
 	struct weston_transmitter_remote *remote = data;
 	struct watch *w;
 	int ret;
-	int running_display;
-	running_display = 0;
 
 	struct waltham_display *dpy = remote->display;
+	uint32_t events = 0;
+
 	w = &dpy->conn_watch;
 	if (!dpy)
 		goto not_running;
 
+	/* connection_handle_data() speaks epoll */
+	if (mask & WL_EVENT_READABLE)
+		events |= EPOLLIN;
+	if (mask & WL_EVENT_WRITABLE)
+		events |= EPOLLOUT;
+	if (mask & WL_EVENT_HANGUP)
+		events |= EPOLLHUP;
+	if (mask & WL_EVENT_ERROR)
+		events |= EPOLLERR;
+
 	if (!dpy->connection)
 		dpy->running = false;
 
 	if (!dpy->running)
 		goto not_running;
 
-	running_display++;
-	/* Dispatch queued events. */
+	/* Read what this wakeup brought in, and flush more if the socket
+	 * signalled writable. See connection_handle_data().
+	 */
+	w->cb(w, events);
+
+	/* Dispatch it in the same wakeup, so that input reaches the clients
+	 * without waiting for more traffic. This is also done after a hang
+	 * up, so that e.g. a final touch up is not lost.
+	 */
 	ret = wth_connection_dispatch(dpy->connection);
 	if (ret < 0) {
 		dpy->running = false;
@@ -514,40 +996,261 @@ waltham_mainloop(int fd, uint32_t mask, void *data)
 	/* Flush out buffered requests. If the Waltham socket is
 	 * full, poll it for writable too, and continue flushing then.
 	 */
-	ret = wth_connection_flush(dpy->connection);
+	transmitter_remote_flush(remote);
 
-	if (0 < running_display) {
-		/* Waltham events only read in the callback, not dispatched,
-		 * if the Waltham socket signalled readable. If it signalled
-		 * writable, flush more. See connection_handle_data().
-		 */
-		w->cb(w, mask);
-	}
+	if (dpy->running)
+		return;
 
 not_running:
-	;
+	transmitter_remote_connection_lost(remote);
 }
 
+/** Let the kernel detect a dead peer within the heartbeat deadline.
+ *
+ * Keepalive probes cover an idle link, TCP_USER_TIMEOUT covers data that
+ * stays unacknowledged, both of which the heartbeat alone cannot tell
+ * apart from a slow receiver.
+ */
+static void
+transmitter_remote_set_keepalive(struct weston_transmitter_remote *remote,
+				 int fd)
+{
+	int on = 1;
+	int idle, intvl = 1, cnt;
+	unsigned int user_timeout;
+
+	if (remote->heartbeat_timeout <= 0)
+		return;
+
+	idle = remote->heartbeat_interval / 1000;
+	if (idle < 1)
+		idle = 1;
+	cnt = remote->heartbeat_timeout / 1000;
+	if (cnt < 1)
+		cnt = 1;
+	user_timeout = remote->heartbeat_timeout;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl)) < 0 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt)) < 0 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT,
+		       &user_timeout, sizeof(user_timeout)) < 0)
+		weston_log("Transmitter: failed to set keepalive on %s:%s: %s\n",
+			   remote->addr, remote->port, strerror(errno));
+}
+
+/** Keep input and control messages ahead of bulk traffic.
+ *
+ * Nagle would hold a small message until the previous one is acknowledged,
+ * and a delayed ACK of the receiver's input adds up to 40 ms more. The
+ * DSCP mark is for the network, the socket priority for the local qdisc;
+ * IP_TOS resets the priority, so it is set first. TCP_QUICKACK does not
+ * stick and is set again after every read.
+ */
+/* Set one socket option, a failure does not stop the others */
+static void
+transmitter_remote_setsockopt(struct weston_transmitter_remote *remote,
+			      int fd, int level, int name, int value,
+			      const char *what)
+{
+	if (setsockopt(fd, level, name, &value, sizeof(value)) < 0)
+		weston_log("Transmitter: failed to set %s on %s:%s: %s\n",
+			   what, remote->addr, remote->port, strerror(errno));
+}
+
+static void
+transmitter_remote_set_low_latency(struct weston_transmitter_remote *remote,
+				   int fd)
+{
+	int domain = AF_INET;
+	socklen_t len = sizeof(domain);
+
+	/* the dscp is checked to be 0..63 by read_config */
+	if (remote->dscp >= 0) {
+		getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+		if (domain == AF_INET6)
+			transmitter_remote_setsockopt(remote, fd, IPPROTO_IPV6,
+						      IPV6_TCLASS,
+						      remote->dscp << 2,
+						      "IPV6_TCLASS");
+		else
+			transmitter_remote_setsockopt(remote, fd, IPPROTO_IP,
+						      IP_TOS, remote->dscp << 2,
+						      "IP_TOS");
+	}
+
+	transmitter_remote_setsockopt(remote, fd, IPPROTO_TCP, TCP_NODELAY,
+				      1, "TCP_NODELAY");
+	transmitter_remote_setsockopt(remote, fd, IPPROTO_TCP, TCP_QUICKACK,
+				      1, "TCP_QUICKACK");
+	transmitter_remote_setsockopt(remote, fd, SOL_SOCKET, SO_PRIORITY,
+				      SOCKET_PRIORITY, "SO_PRIORITY");
+}
+
+static int64_t
+timespec_to_usec(const struct timespec *a)
+{
+	return (int64_t)a->tv_sec * 1000000 + a->tv_nsec / 1000;
+}
+
+static int64_t
+timespec_sub_to_usec(const struct timespec *a, const struct timespec *b)
+{
+	return (int64_t)(a->tv_sec - b->tv_sec) * 1000000 +
+	       (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+/** Heartbeat answer, updates the RTT estimates as in RFC 6298. */
+static void
+heartbeat_handle_done(struct wthp_callback *cb, uint32_t data)
+{
+	struct weston_transmitter_remote *remote =
+		wth_object_get_user_data((struct wth_object *)cb);
+	struct timespec now;
+	int64_t rtt, err;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rtt = timespec_sub_to_usec(&now, &remote->heartbeat_sent);
+
+	wthp_callback_free(cb);
+	remote->heartbeat_cb = NULL;
+
+	/* The receiver answers with its clock in ms, taken as the middle of
+	 * the round trip. Only samples with a better than average RTT are
+	 * used, the others have a larger error.
+	 */
+	if (data && (!remote->clock_synced || rtt <= remote->srtt)) {
+		remote->clock_offset = data -
+			(uint32_t)((timespec_to_usec(&remote->heartbeat_sent) +
+				    rtt / 2) / 1000);
+		remote->clock_synced = true;
+	}
+
+	if (remote->srtt == 0) {
+		remote->srtt = rtt;
+		remote->rttvar = rtt / 2;
+	} else {
+		err = remote->srtt - rtt;
+		if (err < 0)
+			err = -err;
+		remote->rttvar = (3 * remote->rttvar + err) / 4;
+		remote->srtt = (7 * remote->srtt + rtt) / 8;
+	}
+}
+
+static const struct wthp_callback_listener heartbeat_listener = {
+	heartbeat_handle_done
+};
+
+/** Share the bandwidth budget of the remote again. */
+static int
+bandwidth_timer_handler(void *data)
+{
+	struct weston_transmitter_remote *remote = data;
+
+	transmitter_remote_allocate_bandwidth(remote);
+	wl_event_source_timer_update(remote->bandwidth_timer,
+				     BANDWIDTH_PERIOD);
+
+	return 0;
+}
+
+static int
+latency_timer_handler(void *data)
+{
+	struct weston_transmitter_remote *remote = data;
+
+	transmitter_remote_report_latency(remote);
+	wl_event_source_timer_update(remote->latency_timer,
+				     remote->latency_report);
+
+	return 0;
+}
+
+/** Probe the receiver with wth_display.sync.
+ *
+ * Only one probe is in flight at a time. If it is not answered within
+ * heartbeat-timeout, the connection is considered dead. Without a
+ * timeout, the probes only measure the round trip time.
+ */
+static int
+heartbeat_timer_handler(void *data)
+{
+	struct weston_transmitter_remote *remote = data;
+	struct waltham_display *dpy = remote->display;
+	struct timespec now;
+	int32_t elapsed, next;
+
+	if (!dpy->running || remote->status != WESTON_TRANSMITTER_CONNECTION_READY ||
+	    remote->heartbeat_interval <= 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	next = remote->heartbeat_interval;
+
+	if (remote->heartbeat_cb) {
+		elapsed = timespec_sub_to_usec(&now, &remote->heartbeat_sent) / 1000;
+		if (remote->heartbeat_timeout > 0 &&
+		    elapsed >= remote->heartbeat_timeout) {
+			weston_log("Transmitter: %s:%s did not answer for %d ms\n",
+				   remote->addr, remote->port, elapsed);
+			transmitter_remote_connection_lost(remote);
+			return 0;
+		}
+		if (remote->heartbeat_timeout > 0 &&
+		    remote->heartbeat_timeout - elapsed < next)
+			next = remote->heartbeat_timeout - elapsed;
+	} else {
+		remote->heartbeat_cb = wth_display_sync(dpy->display);
+		wthp_callback_set_listener(remote->heartbeat_cb,
+					   &heartbeat_listener, remote);
+		remote->heartbeat_sent = now;
+		transmitter_remote_flush(remote);
+		if (remote->heartbeat_timeout > 0 &&
+		    remote->heartbeat_timeout < next)
+			next = remote->heartbeat_timeout;
+	}
+
+	/* 0 would disarm the timer */
+	if (next < 1)
+		next = 1;
+	wl_event_source_timer_update(remote->heartbeat_timer, next);
+
+	return 0;
+}
+
+static void
+handshake_handle_done(struct wthp_callback *cb, uint32_t data);
+
+static const struct wthp_callback_listener handshake_listener = {
+	handshake_handle_done
+};
+
+/** Start the Waltham handshake on a connected socket.
+ *
+ * The registry is requested and followed by a wth_display.sync, the
+ * globals have all been advertised once it is answered, see
+ * handshake_handle_done(). Nothing here waits for the receiver.
+ */
 static int
-waltham_client_init(struct waltham_display *dpy)
+waltham_client_init(struct waltham_display *dpy, int fd)
 {
 	if (!dpy)
 		return -1;
-	/*
-	 * get server_address from controller (adrress is set to weston.ini)
-	 */
-	dpy->connection = wth_connect_to_server(dpy->remote->addr, dpy->remote->port);
+
+	dpy->connection = wth_connection_from_fd(fd, WTH_CONNECTION_SIDE_CLIENT);
 	if(!dpy->connection) {
-		return -2;
-	}
-	else {
-		dpy->remote->status = WESTON_TRANSMITTER_CONNECTION_READY;
-		wl_signal_emit(&dpy->remote->connection_status_signal, dpy->remote);
+		close(fd);
+		return -1;
 	}
 
 	dpy->conn_watch.display = dpy;
 	dpy->conn_watch.cb = connection_handle_data;
-	dpy->conn_watch.fd = wth_connection_get_fd(dpy->connection);
+	dpy->conn_watch.fd = fd;
+	transmitter_remote_set_keepalive(dpy->remote, dpy->conn_watch.fd);
+	transmitter_remote_set_low_latency(dpy->remote, dpy->conn_watch.fd);
+	dpy->writable_poll = false;
 	dpy->remote->source = wl_event_loop_add_fd(dpy->remote->transmitter->loop,
 						   dpy->conn_watch.fd,
 						   WL_EVENT_READABLE,
@@ -564,39 +1267,17 @@ waltham_client_init(struct waltham_display *dpy)
 	dpy->registry = wth_display_get_registry(dpy->display);
 	wthp_registry_set_listener(dpy->registry, &registry_listener, dpy);
 
-	/* Roundtrip ensures all globals' ads have been received. */
-	if (wth_connection_roundtrip(dpy->connection) < 0) {
-		weston_log("Roundtrip failed.\n");
-		return -1;
-	}
-
-	if (!dpy->compositor) {
-		weston_log("Did not find wthp_compositor, quitting.\n");
-		return -1;
-	}
+	/* The sync answer ensures all globals' ads have been received. */
+	dpy->remote->handshake_cb = wth_display_sync(dpy->display);
+	wthp_callback_set_listener(dpy->remote->handshake_cb,
+				   &handshake_listener, dpy->remote);
 
 	dpy->running = true;
+	transmitter_remote_flush(dpy->remote);
 
 	return 0;
 }
 
-static int
-establish_timer_handler(void *data)
-{
-	struct weston_transmitter_remote *remote = data;
-	int ret;
-
-	ret = waltham_client_init(remote->display);
-	if(ret == -2) {
-		wl_event_source_timer_update(remote->establish_timer,
-					     ESTABLISH_CONNECTION_PERIOD);
-		return 0;
-	}
-	remote->status = WESTON_TRANSMITTER_CONNECTION_READY;
-	wl_signal_emit(&remote->connection_status_signal, remote);
-	return 0;
-}
-
 static void
 init_globals(struct waltham_display *dpy)
 {
@@ -607,19 +1288,277 @@ init_globals(struct waltham_display *dpy)
 	dpy->pointer = NULL;
 	dpy->keyboard = NULL;
 	dpy->touch = NULL;
+	dpy->decoder[0] = '\0';
+	registry_clear_modes(dpy);
 }
 
 static void
 disconnect_surface(struct weston_transmitter_remote *remote)
 {
 	struct weston_transmitter_surface *txs;
+	struct weston_transmitter_seat *seat;
+
 	wl_list_for_each(txs, &remote->surface_list, link)
 	{
 		free(txs->wthp_ivi_surface);
 		txs->wthp_ivi_surface = NULL;
 		free(txs->wthp_surf);
 		txs->wthp_surf = NULL;
+		transmitter_surface_drop_buffers(txs, false);
+		txs->frame_acked = txs->frame_seq;
+		txs->frame_dropped = false;
+		txs->hidden = false;
+		transmitter_surface_release_frames(txs);
+	}
+
+	/* the cursor is sent again on the next pointer enter, and the
+	 * keys held are released */
+	wl_list_for_each(seat, &remote->seat_list, link) {
+		if (seat->wthp_cursor)
+			wthp_surface_free(seat->wthp_cursor);
+		seat->wthp_cursor = NULL;
+		transmitter_seat_keyboard_reset(seat);
+	}
+}
+
+/** Release everything tied to the current Waltham connection.
+ *
+ * The transmitter surfaces themselves are kept, so that they can be
+ * resumed on the next connection by transmitter_remote_resume().
+ */
+static void
+transmitter_remote_reset(struct weston_transmitter_remote *remote)
+{
+	struct waltham_display *dpy = remote->display;
+	struct weston_transmitter_output *output;
+
+	dpy->running = false;
+	if (remote->source) {
+		wl_event_source_remove(remote->source);
+		remote->source = NULL;
+	}
+	wl_event_source_timer_update(remote->heartbeat_timer, 0);
+	wl_event_source_timer_update(remote->bandwidth_timer, 0);
+	wl_event_source_timer_update(remote->latency_timer, 0);
+	if (remote->heartbeat_cb) {
+		wthp_callback_free(remote->heartbeat_cb);
+		remote->heartbeat_cb = NULL;
+	}
+	if (remote->handshake_cb) {
+		wthp_callback_free(remote->handshake_cb);
+		remote->handshake_cb = NULL;
+	}
+	if (dpy->registry) {
+		registry_handle_global_remove(dpy->registry, 1);
+		dpy->registry = NULL;
+	}
+	if (dpy->connection) {
+		wth_connection_destroy(dpy->connection);
+		dpy->connection = NULL;
+	}
+	wl_list_for_each(output, &remote->output_list, link) {
+		if (output->remote_frame_cb) {
+			wthp_callback_free(output->remote_frame_cb);
+			output->remote_frame_cb = NULL;
+		}
+		output->remote_paced = false;
+		output->remote_period = 0;
+		output->remote_vblank = 0;
+	}
+	init_globals(dpy);
+	disconnect_surface(remote);
+}
+
+/** Recreate the remote objects of all live surfaces in one burst.
+ *
+ * Called once the handshake with the receiver is done. The seat objects
+ * are already bound from the registry during the handshake; here the
+ * surfaces and their ivi surfaces are created again and sent with a
+ * single flush, and the encoders are asked for a key frame so that the
+ * receiver can show a picture as soon as the next frame arrives.
+ */
+static void
+transmitter_remote_resume(struct weston_transmitter_remote *remote)
+{
+	struct waltham_display *dpy = remote->display;
+	struct weston_transmitter_surface *txs;
+	struct weston_transmitter_output *output;
+	int count = 0;
+
+	wl_list_for_each(txs, &remote->surface_list, link) {
+		if (!txs->surface || txs->wthp_surf)
+			continue;
+
+		txs->wthp_surf = wthp_compositor_create_surface(dpy->compositor);
+		transmitter_surface_set_ivi_id(txs);
+		count++;
+	}
+	if (count)
+		transmitter_remote_flush(remote);
+
+	wl_list_for_each(output, &remote->output_list, link) {
+		if (output->renderer && output->renderer->force_keyframe)
+			output->renderer->force_keyframe(&output->base);
+		weston_output_schedule_repaint(&output->base);
+	}
+
+	if (count)
+		weston_log("Transmitter: resumed %d surface(s) on %s:%s\n",
+			   count, remote->addr, remote->port);
+}
+
+/** Delay in ms before the next connection attempt.
+ *
+ * The delay doubles on every failed attempt, up to RECONNECT_DELAY_MAX.
+ * Half of it is randomized, so that several transmitters that lost the
+ * same receiver do not retry in lockstep.
+ */
+static int
+transmitter_remote_next_delay(struct weston_transmitter_remote *remote)
+{
+	uint32_t delay = remote->reconnect_delay;
+
+	if (delay < RECONNECT_DELAY_MIN)
+		delay = RECONNECT_DELAY_MIN;
+
+	remote->reconnect_delay = delay * 2;
+	if (remote->reconnect_delay > RECONNECT_DELAY_MAX)
+		remote->reconnect_delay = RECONNECT_DELAY_MAX;
+
+	return delay / 2 + rand_r(&remote->jitter_seed) % (delay / 2 + 1);
+}
+
+/** Connection attempt, or deadline of the pending handshake.
+ *
+ * The TCP connect runs on the network thread, see network.c, and the
+ * result comes back in transmitter_remote_connected().
+ */
+static int
+establish_timer_handler(void *data)
+{
+	struct weston_transmitter_remote *remote = data;
+
+	if (remote->display->connection) {
+		if (remote->handshake_cb)
+			weston_log("Transmitter: handshake with %s:%s failed\n",
+				   remote->addr, remote->port);
+		transmitter_remote_reset(remote);
+		wl_event_source_timer_update(remote->establish_timer,
+					     transmitter_remote_next_delay(remote));
+		return 0;
+	}
+
+	if (remote->connecting)
+		return 0;
+
+	if (transmitter_net_connect(remote, CONNECT_TIMEOUT) < 0) {
+		wl_event_source_timer_update(remote->establish_timer,
+					     transmitter_remote_next_delay(remote));
+		return 0;
+	}
+	remote->connecting = true;
+
+	return 0;
+}
+
+/** Result of the connect started by establish_timer_handler().
+ *
+ * \param remote The remote the connect was for.
+ * \param fd The connected socket, or -1.
+ * \param error errno value of the failure when \c fd is -1.
+ */
+void
+transmitter_remote_connected(struct weston_transmitter_remote *remote,
+			     int fd, int error)
+{
+	remote->connecting = false;
+
+	if (fd < 0 || waltham_client_init(remote->display, fd) < 0) {
+		if (fd >= 0)
+			weston_log("Transmitter: handshake with %s:%s failed\n",
+				   remote->addr, remote->port);
+		transmitter_remote_reset(remote);
+		wl_event_source_timer_update(remote->establish_timer,
+					     transmitter_remote_next_delay(remote));
+		return;
+	}
+
+	wl_event_source_timer_update(remote->establish_timer,
+				     HANDSHAKE_TIMEOUT);
+}
+
+/** Tell the receiver which codec we encode with.
+ *
+ * The choice is made by binding the receiver's decoder global, before any
+ * surface is created, so that the receiver builds the matching pipeline.
+ * Without a common codec both sides fall back to their default pipeline
+ * files.
+ */
+static void
+transmitter_remote_select_codec(struct weston_transmitter_remote *remote)
+{
+	struct waltham_display *dpy = remote->display;
+	struct wth_object *obj;
+	char codec[16];
+
+	if (!dpy->decoder[0] ||
+	    sscanf(dpy->decoder, "wthp_decoder/%15[^/]", codec) != 1) {
+		if (remote->codec[0])
+			weston_log("Transmitter: no common codec with %s, using the default pipeline.\n",
+				   remote->model);
+		remote->codec[0] = '\0';
+		return;
+	}
+
+	obj = wthp_registry_bind(dpy->registry, dpy->decoder_name,
+				 dpy->decoder, 1);
+	/* nothing to talk to, the bind itself is the message */
+	if (obj)
+		wth_object_delete(obj);
+
+	if (strcmp(remote->codec, codec) != 0)
+		weston_log("Transmitter: %s decodes %s, cost %u.\n",
+			   remote->model, codec, dpy->decoder_cost);
+	snprintf(remote->codec, sizeof remote->codec, "%s", codec);
+}
+
+static void
+handshake_handle_done(struct wthp_callback *cb, uint32_t data)
+{
+	struct weston_transmitter_remote *remote =
+		wth_object_get_user_data((struct wth_object *)cb);
+
+	wthp_callback_free(cb);
+	remote->handshake_cb = NULL;
+
+	if (!remote->display->compositor) {
+		weston_log("Did not find wthp_compositor, quitting.\n");
+		/* torn down by establish_timer_handler(), not from dispatch */
+		remote->display->running = false;
+		wl_event_source_timer_update(remote->establish_timer, 1);
+		return;
 	}
+
+	wl_event_source_timer_update(remote->establish_timer, 0);
+	remote->reconnect_delay = 0;
+	remote->srtt = 0;
+	remote->rttvar = 0;
+	remote->clock_synced = false;
+	remote->status = WESTON_TRANSMITTER_CONNECTION_READY;
+	transmitter_remote_select_codec(remote);
+	transmitter_remote_update_outputs(remote);
+	transmitter_remote_resume(remote);
+	wl_signal_emit(&remote->connection_status_signal, remote);
+	wl_event_source_timer_update(remote->retry_timer,
+				     RETRY_CONNECTION_PERIOD);
+	if (remote->heartbeat_interval > 0)
+		wl_event_source_timer_update(remote->heartbeat_timer, 1);
+	if (remote->bandwidth > 0)
+		wl_event_source_timer_update(remote->bandwidth_timer,
+					     BANDWIDTH_PERIOD);
+	if (remote->latency_report > 0)
+		wl_event_source_timer_update(remote->latency_timer,
+					     remote->latency_report);
 }
 
 static int
@@ -630,11 +1569,9 @@ retry_timer_handler(void *data)
 
 	if(!dpy->running)
 	{
-		registry_handle_global_remove(dpy->registry, 1);
-		init_globals(dpy);
-		disconnect_surface(remote);
+		transmitter_remote_reset(remote);
 		wl_event_source_timer_update(remote->establish_timer,
-					     ESTABLISH_CONNECTION_PERIOD);
+					     transmitter_remote_next_delay(remote));
 
 		return 0;
 	}
@@ -644,6 +1581,81 @@ retry_timer_handler(void *data)
 	return 0;
 }
 
+/** Netlink notification of a link or address change.
+ *
+ * A remote waiting in backoff is retried right away when an interface
+ * comes up or gets an address, instead of waiting for the timer.
+ */
+static int
+link_monitor_handle_data(int fd, uint32_t mask, void *data)
+{
+	struct weston_transmitter *txr = data;
+	struct weston_transmitter_remote *remote;
+	struct nlmsghdr *nh;
+	struct ifinfomsg *ifi;
+	char buf[4096];
+	bool link_up = false;
+	ssize_t len;
+
+	while ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == RTM_NEWADDR) {
+				link_up = true;
+			} else if (nh->nlmsg_type == RTM_NEWLINK) {
+				ifi = NLMSG_DATA(nh);
+				if (ifi->ifi_flags & IFF_RUNNING)
+					link_up = true;
+			}
+		}
+	}
+
+	if (!link_up)
+		return 0;
+
+	wl_list_for_each(remote, &txr->remote_list, link) {
+		/* connected, or not torn down yet by retry_timer_handler() */
+		if (!remote->display || remote->display->connection ||
+		    remote->connecting)
+			continue;
+
+		remote->reconnect_delay = 0;
+		wl_event_source_timer_update(remote->establish_timer, 1);
+	}
+
+	return 0;
+}
+
+static void
+transmitter_link_monitor_init(struct weston_transmitter *txr)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_ROUTE);
+	if (fd < 0) {
+		weston_log("Transmitter: no link monitoring: %s\n",
+			   strerror(errno));
+		return;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		weston_log("Transmitter: no link monitoring: %s\n",
+			   strerror(errno));
+		close(fd);
+		return;
+	}
+
+	txr->link_fd = fd;
+	txr->link_source = wl_event_loop_add_fd(txr->loop, fd,
+						WL_EVENT_READABLE,
+						link_monitor_handle_data, txr);
+}
+
 static struct weston_transmitter_remote *
 transmitter_connect_to_remote(struct weston_transmitter *txr)
 {
@@ -658,6 +1670,7 @@ transmitter_connect_to_remote(struct weston_transmitter *txr)
 		if (!remote->display)
 			return NULL;
 		remote->display->remote = remote;
+		wl_list_init(&remote->display->mode_list);
 		/* set connection establish timer */
 		loop_est = wl_display_get_event_loop(txr->compositor->wl_display);
 		remote->establish_timer =
@@ -667,6 +1680,15 @@ transmitter_connect_to_remote(struct weston_transmitter *txr)
 		loop_retry = wl_display_get_event_loop(txr->compositor->wl_display);
 		remote->retry_timer =
 			wl_event_loop_add_timer(loop_retry, retry_timer_handler, remote);
+		remote->heartbeat_timer =
+			wl_event_loop_add_timer(txr->loop, heartbeat_timer_handler,
+						remote);
+		remote->bandwidth_timer =
+			wl_event_loop_add_timer(txr->loop, bandwidth_timer_handler,
+						remote);
+		remote->latency_timer =
+			wl_event_loop_add_timer(txr->loop, latency_timer_handler,
+						remote);
 		if (ret < 0) {
 			weston_log("Fatal: Transmitter waltham connecting failed.\n");
 			return NULL;
@@ -711,10 +1733,31 @@ transmitter_remote_destroy(struct weston_transmitter_remote *remote)
 	wl_list_for_each_safe(output, otmp, &remote->output_list, link)
 		transmitter_output_destroy(output);
 
+	transmitter_remote_clear_routes(remote);
+
+	if (remote->display)
+		registry_clear_modes(remote->display);
+
 	free(remote->addr);
+	free(remote->input_replay);
 	wl_list_remove(&remote->link);
 
-	wl_event_source_remove(remote->source);
+	if (remote->source)
+		wl_event_source_remove(remote->source);
+	if (remote->heartbeat_timer)
+		wl_event_source_remove(remote->heartbeat_timer);
+	if (remote->bandwidth_timer)
+		wl_event_source_remove(remote->bandwidth_timer);
+	if (remote->latency_timer)
+		wl_event_source_remove(remote->latency_timer);
+	if (remote->establish_timer)
+		wl_event_source_remove(remote->establish_timer);
+	if (remote->retry_timer)
+		wl_event_source_remove(remote->retry_timer);
+	if (remote->heartbeat_cb)
+		wthp_callback_free(remote->heartbeat_cb);
+	if (remote->handshake_cb)
+		wthp_callback_free(remote->handshake_cb);
 
 	free(remote);
 }
@@ -727,6 +1770,7 @@ transmitter_compositor_destroyed(struct wl_listener *listener, void *data)
 	struct weston_transmitter_surface *txs;
 	struct weston_transmitter *txr =
 		wl_container_of(listener, txr, compositor_destroy_listener);
+	struct transmitter_surface_config *cfg, *tmp;
 
 	assert(data == txr->compositor);
 
@@ -737,6 +1781,8 @@ transmitter_compositor_destroyed(struct wl_listener *listener, void *data)
 		}
 	}
 
+	transmitter_routes_destroy(txr);
+
 	/*
 	 * Remove the head in case the list is not empty, to avoid
 	 * transmitter_remote_destroy() accessing freed memory if the shell
@@ -744,6 +1790,24 @@ transmitter_compositor_destroyed(struct wl_listener *listener, void *data)
 	 */
 	wl_list_remove(&txr->remote_list);
 
+	transmitter_net_destroy(txr);
+
+	wl_list_remove(&txr->ivi_surface_created_listener.link);
+	wl_list_remove(&txr->ivi_surface_removed_listener.link);
+
+	if (txr->link_source) {
+		wl_event_source_remove(txr->link_source);
+		close(txr->link_fd);
+	}
+
+	if (txr->stream_timer)
+		wl_event_source_remove(txr->stream_timer);
+
+	wl_list_for_each_safe(cfg, tmp, &txr->surface_config_list, link) {
+		wl_list_remove(&cfg->link);
+		free(cfg);
+	}
+
 	free(txr);
 }
 
@@ -777,6 +1841,13 @@ transmitter_get_weston_surface(struct weston_transmitter_surface *txs)
 	return txs->surface;
 }
 
+static const struct weston_transmitter_latency *
+transmitter_remote_get_input_latency(struct weston_transmitter_remote *remote,
+				     enum weston_transmitter_input_kind kind)
+{
+	return &remote->input_latency[kind];
+}
+
 static const struct weston_transmitter_api transmitter_api_impl = {
 	transmitter_get,
 	transmitter_connect_to_remote,
@@ -789,6 +1860,7 @@ static const struct weston_transmitter_api transmitter_api_impl = {
 	transmitter_surface_gather_state,
 	transmitter_register_connection_status,
 	transmitter_get_weston_surface,
+	transmitter_remote_get_input_latency,
 };
 
 static void
@@ -805,13 +1877,62 @@ static const struct weston_transmitter_ivi_api transmitter_ivi_api_impl = {
 	transmitter_surface_set_resize_callback,
 };
 
+/** Optional keys of a [transmitter-output] section. */
+static void
+transmitter_remote_read_config(struct weston_transmitter_remote *remote,
+			       struct weston_config_section *section)
+{
+	weston_config_section_get_int(section, "heartbeat-interval",
+				      &remote->heartbeat_interval,
+				      HEARTBEAT_INTERVAL);
+	weston_config_section_get_int(section, "heartbeat-timeout",
+				      &remote->heartbeat_timeout,
+				      HEARTBEAT_TIMEOUT);
+	/* <= 0 disables the heartbeat, or the deadline of its probes */
+	if (remote->heartbeat_interval < 0)
+		remote->heartbeat_interval = 0;
+	if (remote->heartbeat_timeout < 0)
+		remote->heartbeat_timeout = 0;
+	weston_config_section_get_int(section, "pipeline-latency",
+				      &remote->pipeline_latency,
+				      PIPELINE_LATENCY);
+	weston_config_section_get_int(section, "max-frames-in-flight",
+				      &remote->max_frames_in_flight,
+				      MAX_FRAMES_IN_FLIGHT);
+	weston_config_section_get_int(section, "priority",
+				      &remote->priority, 0);
+	weston_config_section_get_int(section, "bandwidth",
+				      &remote->bandwidth, 0);
+	weston_config_section_get_int(section, "dscp",
+				      &remote->dscp, SOCKET_DSCP);
+	/* 6 bits, < 0 disables the mark */
+	if (remote->dscp > 63) {
+		weston_log("Transmitter: dscp %d of %s:%s is not 0..63, "
+			   "using %d\n", remote->dscp, remote->addr,
+			   remote->port, SOCKET_DSCP);
+		remote->dscp = SOCKET_DSCP;
+	} else if (remote->dscp < 0) {
+		remote->dscp = -1;
+	}
+	weston_config_section_get_int(section, "latency-report",
+				      &remote->latency_report,
+				      LATENCY_REPORT_PERIOD);
+	weston_config_section_get_int(section, "input-prediction",
+				      &remote->input_prediction, 0);
+	weston_config_section_get_string(section, "input-replay",
+					 &remote->input_replay, NULL);
+	weston_config_section_get_double(section, "input-replay-speed",
+					 &remote->input_replay_speed, 1.0);
+}
+
 static int
 transmitter_create_remote(struct weston_transmitter *txr,
 			  const char *model,
 			  const char *addr,
 			  const char *port,
 	                  const char *width,
-	                  const char *height)
+	                  const char *height,
+			  struct weston_config_section *section)
 {
 	struct weston_transmitter_remote *remote;
 
@@ -827,10 +1948,13 @@ transmitter_create_remote(struct weston_transmitter *txr,
 	remote->width = atoi(width);
 	remote->height = atoi(height);
 	remote->status = WESTON_TRANSMITTER_CONNECTION_INITIALIZING;
+	remote->jitter_seed = time(NULL) ^ getpid() ^ (uintptr_t)remote;
+	transmitter_remote_read_config(remote, section);
 	wl_signal_init(&remote->connection_status_signal);
 	wl_list_init(&remote->output_list);
 	wl_list_init(&remote->surface_list);
 	wl_list_init(&remote->seat_list);
+	wl_list_init(&remote->candidate_list);
 	wl_signal_init(&remote->conn_establish_signal);
 	remote->establish_listener.notify = conn_ready_notify;
 	wl_signal_add(&remote->conn_establish_signal, &remote->establish_listener);
@@ -838,6 +1962,42 @@ transmitter_create_remote(struct weston_transmitter *txr,
 	return 0;
 }
 
+/** Read a [transmitter-surface] section, options of one ivi surface. */
+static void
+transmitter_read_surface_config(struct weston_transmitter *txr,
+				struct weston_config_section *section)
+{
+	struct transmitter_surface_config *cfg;
+	uint32_t ivi_id;
+
+	if (weston_config_section_get_uint(section, "ivi-id", &ivi_id, 0) < 0) {
+		weston_log("Transmitter: [transmitter-surface] without ivi-id.\n");
+		return;
+	}
+
+	cfg = zalloc(sizeof *cfg);
+	if (!cfg)
+		return;
+
+	cfg->ivi_id = ivi_id;
+	weston_config_section_get_int(section, "priority", &cfg->priority, 0);
+	wl_list_insert(txr->surface_config_list.prev, &cfg->link);
+}
+
+static int
+stream_timer_handler(void *data)
+{
+	struct weston_transmitter *txr = data;
+
+	transmitter_control_streams(txr);
+	/* layer membership changes are not notified by ivi-layout */
+	if (txr->route_layers)
+		transmitter_routes_update(txr);
+	wl_event_source_timer_update(txr->stream_timer, STREAM_CONTROL_PERIOD);
+
+	return 0;
+}
+
 struct wet_compositor {
 	struct weston_config *config;
 	struct wet_output_config *parsed_options;
@@ -858,6 +2018,7 @@ transmitter_get_server_config(struct weston_transmitter *txr)
 	char *port = NULL;
 	char *width = '0';
 	char *height = '0';
+	int32_t sessions;
 	int ret;
 
 	section = weston_config_get_section(config, "remote", NULL, NULL);
@@ -884,10 +2045,20 @@ transmitter_get_server_config(struct weston_transmitter *txr)
 								  &height, 0))
 				continue;
 			ret = transmitter_create_remote(txr, model, addr,
-							port, width, height);
+							port, width, height,
+							section);
 			if (ret < 0) {
 				weston_log("Fatal: Transmitter create_remote failed.\n");
 			}
+		} else if (0 == strcmp(name, "transmitter-surface")) {
+			transmitter_read_surface_config(txr, section);
+		} else if (0 == strcmp(name, "transmitter-route")) {
+			transmitter_route_read_config(txr, section);
+		} else if (0 == strcmp(name, "transmitter")) {
+			weston_config_section_get_int(section,
+						      "max-hw-encoder-sessions",
+						      &sessions, 0);
+			txr->waltham_renderer->set_hw_sessions(sessions);
 		}
 	}
 }
@@ -904,6 +2075,8 @@ wet_module_init(struct weston_compositor *compositor, int *argc, char *argv[])
 		return -1;
 	}
 	wl_list_init(&txr->remote_list);
+	wl_list_init(&txr->surface_config_list);
+	wl_list_init(&txr->route_list);
 
 	txr->compositor = compositor;
 	txr->compositor_destroy_listener.notify =
@@ -939,8 +2112,19 @@ wet_module_init(struct weston_compositor *compositor, int *argc, char *argv[])
 	weston_log("Transmitter initialized.\n");
 
 	txr->loop = wl_display_get_event_loop(compositor->wl_display);
+	if (transmitter_net_init(txr) < 0)
+		goto fail;
+	transmitter_link_monitor_init(txr);
+	transmitter_ivi_id_init(txr);
 	transmitter_get_server_config(txr);
 	transmitter_connect_to_remote(txr);
+	transmitter_routes_update(txr);
+
+	txr->stream_timer = wl_event_loop_add_timer(txr->loop,
+						    stream_timer_handler, txr);
+	if (txr->stream_timer)
+		wl_event_source_timer_update(txr->stream_timer,
+					     STREAM_CONTROL_PERIOD);
 
 	return 0;
 
@@ -71,6 +71,7 @@ struct waltham_display {
 	struct wth_display *display;
 
 	bool running;
+	bool writable_poll; /* socket full, see transmitter_remote_flush() */
 
 	struct wthp_registry *registry;
 
@@ -85,6 +86,13 @@ struct waltham_display {
         struct wthp_ivi_application *application;
 	struct wtimer *fiddle_timer;
 
+	struct wl_list mode_list; /* transmitter_remote_mode::link */
+
+	/* cheapest decoder global we have a pipeline for */
+	char decoder[64];
+	uint32_t decoder_name;
+	uint32_t decoder_cost;
+
 	struct weston_transmitter_remote *remote;
 	char *addr;
 	char *port;
@@ -107,6 +115,23 @@ struct weston_transmitter {
 	struct wl_signal connected_signal;
 	struct wl_event_loop *loop;
 
+	int link_fd; /* netlink, link and address changes */
+	struct wl_event_source *link_source;
+
+	struct transmitter_net *net; /* network thread, see network.c */
+
+	struct wl_list surface_config_list; /* transmitter_surface_config::link */
+	struct wl_list route_list; /* transmitter_route::link, see route.c */
+	bool route_layers; /* some rule matches a layer */
+
+	/* overload control, see transmitter_control_streams() */
+	struct wl_event_source *stream_timer;
+	uint32_t calm_periods; /* periods without skipped frames */
+
+	const struct ivi_layout_interface *lyt;
+	struct wl_listener ivi_surface_created_listener;
+	struct wl_listener ivi_surface_removed_listener;
+
 	struct waltham_renderer_interface *waltham_renderer;
 };
 
@@ -126,17 +151,59 @@ struct weston_transmitter_remote {
 	struct wl_list output_list; /* weston_transmitter_output::link */
 	struct wl_list surface_list; /* weston_transmitter_surface::link */
 	struct wl_list seat_list; /* weston_transmitter_seat::link */
+	struct wl_list candidate_list; /* transmitter_candidate::link */
 
         struct wl_listener establish_listener;
 
         struct wl_event_source *establish_timer; /* for establish connection */
 	struct wl_event_source *retry_timer; /* for retry connection */
+	bool connecting; /* connect pending on the network thread */
+	struct wthp_callback *handshake_cb; /* registry sync in flight */
+	uint32_t reconnect_delay; /* next backoff, ms */
+	unsigned int jitter_seed;
+
+	/* heartbeat over wth_display.sync */
+	struct wl_event_source *heartbeat_timer;
+	struct wthp_callback *heartbeat_cb; /* probe in flight */
+	struct timespec heartbeat_sent;
+	int32_t heartbeat_interval; /* ms, 0 disables */
+	int32_t heartbeat_timeout; /* ms */
+	int64_t srtt; /* smoothed RTT, us, 0 until first sample */
+	int64_t rttvar; /* RTT variation, us */
+	bool clock_synced;
+	uint32_t clock_offset; /* receiver ms - local CLOCK_MONOTONIC ms */
+	int32_t pipeline_latency; /* ms, encode + decode, <0 no phase lock */
+	int32_t max_frames_in_flight; /* per surface, 0 is unlimited */
+	char codec[16]; /* negotiated with the receiver, "" for the default pipeline */
+	int32_t priority; /* of all its streams, see transmitter_control_streams() */
+	int32_t bandwidth; /* kbit/s shared by the outputs, 0 is unlimited */
+	struct wl_event_source *bandwidth_timer;
+
+	/* input latency, see transmitter_remote_record_latency() */
+	struct weston_transmitter_latency input_latency[WESTON_TRANSMITTER_INPUT_KINDS];
+	struct weston_transmitter_latency latency_window[WESTON_TRANSMITTER_INPUT_KINDS];
+	int32_t latency_report; /* log period, ms, 0 disables */
+	struct wl_event_source *latency_timer;
+	int32_t dscp; /* of the Waltham connection, <0 leaves it unmarked */
+
+	int32_t input_prediction; /* ms of touch and pointer lead, 0 disables, <0 measured */
+
+	/* input recording replayed on the seat, see transmitter_seat_replay_start() */
+	char *input_replay;
+	double input_replay_speed; /* <= 0 replays as fast as possible */
 
 	struct waltham_display *display; /* waltham */
 	struct wl_event_source *source;
 };
 
 
+/* a frame sent to the receiver and not acknowledged yet */
+struct transmitter_buffer {
+	struct wl_list link; /* weston_transmitter_surface::buffer_list */
+	struct wthp_buffer *obj;
+	struct weston_transmitter_surface *txs;
+};
+
 struct weston_transmitter_surface {
 	struct weston_transmitter_remote *remote;
 	struct wl_list link; /* weston_transmitter_remote::surface_list */
@@ -160,10 +227,20 @@ struct weston_transmitter_surface {
 	struct wl_list frame_callback_list; /* weston_frame_callback::link */
 	struct wl_list feedback_list; /* weston_presentation_feedback::link */
 
+	/* flow control, frames acknowledged by wthp_buffer.complete */
+	uint32_t frame_seq; /* last frame sent */
+	uint32_t frame_acked; /* last frame acknowledged by the receiver */
+	bool frame_dropped; /* a frame was skipped, send it on the next ack */
+
+	/* hidden on the receiver, see ivi_surface_handle_configure() */
+	bool hidden;
+	int32_t priority; /* from [transmitter-surface], added to the remote's */
+	uint32_t ivi_id; /* 0 until the ivi surface is created on the remote */
+
 	/* waltham */
 	struct wthp_surface *wthp_surf;
 	struct wthp_blob_factory *wthp_blob;
-	struct wthp_buffer *wthp_buf;
+	struct wl_list buffer_list; /* transmitter_buffer::link, in flight */
         struct wthp_ivi_surface *wthp_ivi_surface;
         struct wthp_ivi_application *wthp_ivi_application;
 };
@@ -182,6 +259,36 @@ struct weston_transmitter_output_info {
 	struct weston_mode mode;
 };
 
+/* a [transmitter-surface] section of weston.ini */
+struct transmitter_surface_config {
+	struct wl_list link; /* weston_transmitter::surface_config_list */
+	uint32_t ivi_id;
+	int32_t priority;
+};
+
+/* a surface routed to a remote, see route.c */
+struct transmitter_candidate {
+	struct wl_list link; /* weston_transmitter_remote::candidate_list */
+	struct weston_surface *surface;
+	struct wl_listener surface_destroy_listener;
+	const struct transmitter_route *route; /* NULL without rules */
+};
+
+/* how far a stream is degraded under overload, lowest priority first */
+enum transmitter_degrade {
+	TRANSMITTER_DEGRADE_NONE = 0,
+	TRANSMITTER_DEGRADE_FRAMERATE, /* every other frame */
+	TRANSMITTER_DEGRADE_RESOLUTION, /* and half size, if the pipeline can scale */
+	TRANSMITTER_DEGRADE_PAUSE, /* nothing sent */
+};
+
+/* a display mode advertised by the receiver, see registry_handle_global() */
+struct transmitter_remote_mode {
+	struct wl_list link; /* waltham_display::mode_list */
+	uint32_t output; /* index of the receiver display */
+	struct weston_mode mode;
+};
+
 struct weston_transmitter_output {
 	struct weston_output base;
 
@@ -196,16 +303,125 @@ struct weston_transmitter_output {
 
 	struct weston_transmitter_remote *remote;
 	struct wl_list link; /* weston_transmitter_remote::output_list */
+	uint32_t index; /* receiver display shown by this output */
 
 	struct frame *frame;
         struct wl_event_source *finish_frame_timer;
+	struct wl_event_source *phase_timer; /* delays the finish, see transmitter_output_phase_delay() */
+	uint32_t phase_flags; /* presented_flags of the delayed finish */
 	struct wl_callback *frame_cb;
+	struct wthp_callback *remote_frame_cb; /* wthp_surface.frame in flight */
+	bool remote_paced; /* the receiver answers frame callbacks */
+	bool frame_pending; /* repainted, not finished yet */
+	int64_t remote_period; /* ns, receiver frame interval, 0 if unknown */
+	int64_t remote_vblank; /* ns, last receiver frame, presentation clock */
+
+	/* share of the remote bandwidth, see transmitter_remote_allocate_bandwidth() */
+	uint64_t damage_acc; /* pixels sent since the last allocation */
+	uint64_t damage_avg; /* smoothed pixels per allocation period */
+	uint32_t bitrate; /* bit/s, 0 until allocated */
+
+	/* overload control, see transmitter_control_streams() */
+	int32_t priority; /* of the last stream sent */
+	enum transmitter_degrade degrade;
+	uint32_t frames_skipped; /* by flow control during the period */
+	uint32_t frame_count;
 	struct renderer *renderer;
 };
 
+enum transmitter_touch_type {
+	TRANSMITTER_TOUCH_DOWN,
+	TRANSMITTER_TOUCH_UP,
+	TRANSMITTER_TOUCH_MOTION,
+};
+
+/* touch event queued until the touch frame of the receiver */
+struct transmitter_touch_event {
+	enum transmitter_touch_type type;
+	uint32_t serial;
+	uint32_t time;
+	int32_t id;
+	wl_fixed_t x;
+	wl_fixed_t y;
+	struct wl_resource *surface; /* down only */
+	bool replayed; /* from input-replay, no latency sample */
+};
+
+#define TRANSMITTER_TOUCH_EVENTS 32
+
+/* Input recording of waltham-receiver -r, same definitions as there. The
+ * file is TRANSMITTER_INPUT_RECORD_MAGIC and TRANSMITTER_INPUT_RECORD_VERSION
+ * followed by the records, all in host byte order.
+ */
+#define TRANSMITTER_INPUT_RECORD_MAGIC 0x52495457 /* "WTIR" */
+#define TRANSMITTER_INPUT_RECORD_VERSION 1
+
+enum transmitter_input_record_type {
+	TRANSMITTER_INPUT_RECORD_POINTER_ENTER = 1,	/* x, y */
+	TRANSMITTER_INPUT_RECORD_POINTER_LEAVE,
+	TRANSMITTER_INPUT_RECORD_POINTER_MOTION,	/* x, y */
+	TRANSMITTER_INPUT_RECORD_POINTER_BUTTON,	/* button, state */
+	TRANSMITTER_INPUT_RECORD_POINTER_AXIS,		/* axis, value */
+	TRANSMITTER_INPUT_RECORD_POINTER_FRAME,
+	TRANSMITTER_INPUT_RECORD_POINTER_AXIS_SOURCE,	/* source */
+	TRANSMITTER_INPUT_RECORD_POINTER_AXIS_STOP,	/* axis */
+	TRANSMITTER_INPUT_RECORD_POINTER_AXIS_DISCRETE,	/* axis, discrete */
+	TRANSMITTER_INPUT_RECORD_KEYBOARD_ENTER,
+	TRANSMITTER_INPUT_RECORD_KEYBOARD_LEAVE,
+	TRANSMITTER_INPUT_RECORD_KEYBOARD_KEY,		/* key, state */
+	TRANSMITTER_INPUT_RECORD_KEYBOARD_MODIFIERS,	/* depressed, latched, locked, group */
+	TRANSMITTER_INPUT_RECORD_TOUCH_DOWN,		/* id, x, y */
+	TRANSMITTER_INPUT_RECORD_TOUCH_UP,		/* id */
+	TRANSMITTER_INPUT_RECORD_TOUCH_MOTION,		/* id, x, y */
+	TRANSMITTER_INPUT_RECORD_TOUCH_FRAME,
+	TRANSMITTER_INPUT_RECORD_TOUCH_CANCEL,
+	TRANSMITTER_INPUT_RECORD_TYPES
+};
+
+/* one event the receiver sent */
+struct transmitter_input_record {
+	uint64_t time; /* us since the recording started */
+	uint32_t type; /* enum transmitter_input_record_type */
+	uint32_t ivi_id; /* surface of enter, leave and touch down */
+	int32_t arg[4];
+};
+
+struct transmitter_input_replay;
+
+/* Alpha-beta filter of the velocity of a touch point or of the pointer,
+ * which positions are sent ahead by, see transmitter_predictor_update().
+ */
+struct transmitter_predictor {
+	bool valid; /* touch: the slot is used by id */
+	int32_t id;
+	uint32_t time; /* of the last sample, receiver ms */
+	double x, y; /* filtered position */
+	double vx, vy; /* px per ms */
+	wl_fixed_t real_x, real_y; /* last sample */
+	bool predicted; /* the position last sent is not the sample */
+};
+
+#define TRANSMITTER_TOUCH_POINTS 10
+
+/* The resources of the focused client of an input device, gathered on
+ * focus changes so that every event does not walk the resources of all
+ * the clients. See transmitter_focus_cache_update().
+ */
+struct transmitter_focus_cache {
+	struct wl_client *client;
+	struct wl_list resource_list; /* transmitter_focus_resource::link */
+};
+
+struct transmitter_focus_resource {
+	struct wl_list link; /* transmitter_focus_cache::resource_list */
+	struct wl_resource *resource;
+	struct wl_listener destroy_listener;
+};
+
 struct weston_transmitter_seat {
 	struct weston_seat *base;
 	struct wl_list link;
+	struct weston_transmitter_remote *remote;
 
 	/* pointer */
 	wl_fixed_t pointer_surface_x;
@@ -214,16 +430,42 @@ struct weston_transmitter_seat {
 	struct wl_listener get_pointer_listener;
 	struct weston_transmitter_surface *pointer_focus;
 	struct wl_listener pointer_focus_destroy_listener;
-
-	struct wl_event_source *pointer_timer; /* fake */
-
-	double pointer_phase; /* fake */
+	struct transmitter_predictor pointer_predictor;
+
+	/* cursor of the focused client, drawn locally by the receiver,
+	 * see transmitter_seat_send_cursor() */
+	struct wl_protocol_logger *cursor_logger;
+	struct weston_surface *cursor_surface;
+	struct wl_listener cursor_commit_listener;
+	struct wl_listener cursor_destroy_listener;
+	int32_t cursor_hotspot_x;
+	int32_t cursor_hotspot_y;
+	struct wthp_surface *wthp_cursor; /* NULL until sent on this connection */
+	uint32_t cursor_hash; /* of the image and hotspot last sent */
+
+	/* NULL unless the remote has input-replay */
+	struct transmitter_input_replay *replay;
+	bool replaying; /* a recorded event is being dispatched */
 
 	/* keyboard */
 	struct weston_transmitter_surface *keyboard_focus;
+	struct transmitter_focus_cache keyboard_cache;
+	int keymap_fd; /* of the receiver, -1 until received */
+	uint32_t keymap_format;
+	uint32_t keymap_size;
+	int32_t repeat_rate; /* of the receiver, -1 until received */
+	int32_t repeat_delay;
 
 	/* touch */
 	struct weston_transmitter_surface *touch_focus;
+	struct transmitter_focus_cache touch_cache;
+	struct transmitter_touch_event touch_events[TRANSMITTER_TOUCH_EVENTS];
+	int touch_event_count;
+	struct transmitter_predictor touch_predictor[TRANSMITTER_TOUCH_POINTS];
+
+	/* moves the predicted positions back to the samples once the motion
+	 * stops, see transmitter_seat_predict_settle() */
+	struct wl_event_source *predict_timer;
 };
 
 struct ivi_layout_surface {
@@ -244,13 +486,65 @@ struct ivi_layout_surface {
 	struct wl_list view_list;	/* ivi_layout_view::surf_link */
 };
 
+int
+transmitter_net_init(struct weston_transmitter *txr);
+
+void
+transmitter_net_destroy(struct weston_transmitter *txr);
+
+int
+transmitter_net_connect(struct weston_transmitter_remote *remote, int timeout);
+
+void
+transmitter_remote_connected(struct weston_transmitter_remote *remote,
+			     int fd, int error);
+
+void
+transmitter_remote_flush(struct weston_transmitter_remote *remote);
+
+int
+transmitter_route_read_config(struct weston_transmitter *txr,
+			      struct weston_config_section *section);
+
+void
+transmitter_routes_update(struct weston_transmitter *txr);
+
+void
+transmitter_routes_destroy(struct weston_transmitter *txr);
+
+void
+transmitter_remote_clear_routes(struct weston_transmitter_remote *remote);
+
+struct weston_view *
+transmitter_candidate_view(struct transmitter_candidate *cand,
+			   struct weston_transmitter_output *output);
+
+int32_t
+transmitter_candidate_priority(const struct transmitter_candidate *cand);
+
+bool
+transmitter_surface_window_full(struct weston_transmitter_surface *txs);
+
+void
+transmitter_surface_stash_frames(struct weston_transmitter_surface *txs);
+
 void
 transmitter_surface_ivi_resize(struct weston_transmitter_surface *txs,
 			       int32_t width, int32_t height);
 
 int
 transmitter_remote_create_output(struct weston_transmitter_remote *remote,
-			const struct weston_transmitter_output_info *info);
+			const struct weston_transmitter_output_info *info,
+			uint32_t index);
+
+void
+transmitter_remote_update_outputs(struct weston_transmitter_remote *remote);
+
+void
+transmitter_remote_allocate_bandwidth(struct weston_transmitter_remote *remote);
+
+void
+transmitter_control_streams(struct weston_transmitter *txr);
 
 void
 transmitter_output_destroy(struct weston_transmitter_output *output);
@@ -258,9 +552,23 @@ transmitter_output_destroy(struct weston_transmitter_output *output);
 int
 transmitter_remote_create_seat(struct weston_transmitter_remote *remote);
 
+void
+transmitter_remote_record_latency(struct weston_transmitter_remote *remote,
+				  enum weston_transmitter_input_kind kind,
+				  uint32_t time);
+
+void
+transmitter_remote_report_latency(struct weston_transmitter_remote *remote);
+
 void
 transmitter_seat_destroy(struct weston_transmitter_seat *seat);
 
+void
+transmitter_seat_send_cursor(struct weston_transmitter_seat *seat);
+
+void
+transmitter_seat_keyboard_reset(struct weston_transmitter_seat *seat);
+
 /* The below are the functions to be called from the network protocol
  * input event handlers.
  */
@@ -313,11 +621,9 @@ transmitter_seat_pointer_axis_discrete(struct weston_transmitter_seat *seat,
 				       uint32_t axis,
 				       int32_t discrete);
 
-/* Fake functions for mockup testing: */
-
 int
-transmitter_seat_fake_pointer_input(struct weston_transmitter_seat *seat,
-				    struct weston_transmitter_surface *txs);
+transmitter_seat_replay_start(struct weston_transmitter_seat *seat,
+			      const char *path, double speed);
 
 void
 seat_capabilities(struct wthp_seat *wthp_seat,
@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2017 Advanced Driver Information Technology Joint Venture GmbH
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Routing of ivi surfaces to remotes.
+ *
+ * [transmitter-route] sections of weston.ini map an ivi surface id, or all
+ * the surfaces of an ivi layer, to the remote of a [transmitter-output]:
+ *
+ *	[transmitter-route]
+ *	layer-id=1000
+ *	output-name=transmitter_1
+ *	priority=5
+ *
+ * Every remote keeps the list of its candidate surfaces, rebuilt when ivi
+ * surfaces come and go, and periodically for the layer rules since
+ * ivi-layout does not notify layer membership changes. The repaint of a
+ * remote output only looks at the views of its candidates.
+ *
+ * Without any rule every ivi surface is a candidate of every remote, and
+ * surfaces smaller than 64x64 are left out as before.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compositor.h"
+
+#include "plugin.h"
+
+struct transmitter_route {
+	struct wl_list link; /* weston_transmitter::route_list */
+	uint32_t ivi_id; /* 0 if the rule matches a layer */
+	uint32_t layer_id;
+	char *remote; /* output-name of a [transmitter-output] */
+	int32_t priority; /* added to the stream priority */
+};
+
+/* below this size a surface is not sent on the default route */
+#define DEFAULT_ROUTE_MIN_SIZE 64
+
+/** Read a [transmitter-route] section. */
+int
+transmitter_route_read_config(struct weston_transmitter *txr,
+			      struct weston_config_section *section)
+{
+	struct transmitter_route *route;
+
+	route = zalloc(sizeof *route);
+	if (!route)
+		return -1;
+
+	weston_config_section_get_uint(section, "ivi-id", &route->ivi_id, 0);
+	weston_config_section_get_uint(section, "layer-id",
+				       &route->layer_id, 0);
+	weston_config_section_get_string(section, "output-name",
+					 &route->remote, NULL);
+	weston_config_section_get_int(section, "priority",
+				      &route->priority, 0);
+
+	if (!route->remote || (!route->ivi_id && !route->layer_id)) {
+		weston_log("Transmitter: [transmitter-route] needs output-name "
+			   "and ivi-id or layer-id.\n");
+		free(route->remote);
+		free(route);
+		return -1;
+	}
+
+	if (route->layer_id)
+		txr->route_layers = true;
+	wl_list_insert(txr->route_list.prev, &route->link);
+
+	return 0;
+}
+
+static void
+candidate_destroy(struct transmitter_candidate *cand)
+{
+	wl_list_remove(&cand->surface_destroy_listener.link);
+	wl_list_remove(&cand->link);
+	free(cand);
+}
+
+static void
+candidate_surface_destroyed(struct wl_listener *listener, void *data)
+{
+	struct transmitter_candidate *cand =
+		wl_container_of(listener, cand, surface_destroy_listener);
+
+	candidate_destroy(cand);
+}
+
+static void
+candidate_add(struct weston_transmitter_remote *remote,
+	      struct weston_surface *ws, const struct transmitter_route *route)
+{
+	struct transmitter_candidate *cand;
+
+	if (!ws)
+		return;
+
+	/* the first rule matching a surface wins */
+	wl_list_for_each(cand, &remote->candidate_list, link)
+		if (cand->surface == ws)
+			return;
+
+	cand = zalloc(sizeof *cand);
+	if (!cand)
+		return;
+
+	cand->surface = ws;
+	cand->route = route;
+	cand->surface_destroy_listener.notify = candidate_surface_destroyed;
+	wl_signal_add(&ws->destroy_signal, &cand->surface_destroy_listener);
+	wl_list_insert(remote->candidate_list.prev, &cand->link);
+}
+
+static void
+route_add_candidates(struct weston_transmitter *txr,
+		     struct weston_transmitter_remote *remote,
+		     const struct transmitter_route *route)
+{
+	const struct ivi_layout_interface *lyt = txr->lyt;
+	struct ivi_layout_surface **surfaces = NULL;
+	struct ivi_layout_surface *ivisurf;
+	struct ivi_layout_layer *ivilayer;
+	int32_t length = 0;
+	int32_t i;
+
+	if (route->ivi_id) {
+		ivisurf = lyt->get_surface_from_id(route->ivi_id);
+		if (ivisurf)
+			candidate_add(remote,
+				      lyt->surface_get_weston_surface(ivisurf),
+				      route);
+		return;
+	}
+
+	ivilayer = lyt->get_layer_from_id(route->layer_id);
+	if (!ivilayer)
+		return;
+
+	lyt->get_surfaces_on_layer(ivilayer, &length, &surfaces);
+	for (i = 0; i < length; i++)
+		candidate_add(remote, lyt->surface_get_weston_surface(surfaces[i]),
+			      route);
+	free(surfaces);
+}
+
+void
+transmitter_remote_clear_routes(struct weston_transmitter_remote *remote)
+{
+	struct transmitter_candidate *cand, *tmp;
+
+	wl_list_for_each_safe(cand, tmp, &remote->candidate_list, link)
+		candidate_destroy(cand);
+}
+
+/** Rebuild the candidate surfaces of every remote from the rules. */
+void
+transmitter_routes_update(struct weston_transmitter *txr)
+{
+	struct weston_transmitter_remote *remote;
+	struct transmitter_route *route;
+	struct ivi_layout_surface **surfaces = NULL;
+	int32_t length = 0;
+	int32_t i;
+
+	wl_list_for_each(remote, &txr->remote_list, link)
+		transmitter_remote_clear_routes(remote);
+
+	if (!txr->lyt)
+		return;
+
+	if (wl_list_empty(&txr->route_list)) {
+		txr->lyt->get_surfaces(&length, &surfaces);
+		wl_list_for_each(remote, &txr->remote_list, link)
+			for (i = 0; i < length; i++)
+				candidate_add(remote,
+					      txr->lyt->surface_get_weston_surface(surfaces[i]),
+					      NULL);
+		free(surfaces);
+		return;
+	}
+
+	wl_list_for_each(route, &txr->route_list, link)
+		wl_list_for_each(remote, &txr->remote_list, link)
+			if (strcmp(remote->model, route->remote) == 0)
+				route_add_candidates(txr, remote, route);
+}
+
+void
+transmitter_routes_destroy(struct weston_transmitter *txr)
+{
+	struct weston_transmitter_remote *remote;
+	struct transmitter_route *route, *rtmp;
+
+	wl_list_for_each(remote, &txr->remote_list, link)
+		transmitter_remote_clear_routes(remote);
+
+	wl_list_for_each_safe(route, rtmp, &txr->route_list, link) {
+		wl_list_remove(&route->link);
+		free(route->remote);
+		free(route);
+	}
+}
+
+/** The view of a candidate shown on a remote output, if any. */
+struct weston_view *
+transmitter_candidate_view(struct transmitter_candidate *cand,
+			   struct weston_transmitter_output *output)
+{
+	struct weston_surface *ws = cand->surface;
+	struct weston_view *view;
+
+	if (!cand->route && (ws->width < DEFAULT_ROUTE_MIN_SIZE ||
+			     ws->height < DEFAULT_ROUTE_MIN_SIZE))
+		return NULL;
+
+	wl_list_for_each(view, &ws->views, surface_link)
+		if (view->output == &output->base)
+			return view;
+
+	return NULL;
+}
+
+int32_t
+transmitter_candidate_priority(const struct transmitter_candidate *cand)
+{
+	return cand->route ? cand->route->priority : 0;
+}
@@ -65,6 +65,32 @@ enum weston_transmitter_stream_status {
 	WESTON_TRANSMITTER_STREAM_FAILED,
 };
 
+/** See weston_transmitter_api::remote_get_input_latency */
+enum weston_transmitter_input_kind {
+	/** Touch down events */
+	WESTON_TRANSMITTER_INPUT_TOUCH,
+
+	/** Pointer motion events */
+	WESTON_TRANSMITTER_INPUT_POINTER,
+
+	WESTON_TRANSMITTER_INPUT_KINDS,
+};
+
+#define WESTON_TRANSMITTER_LATENCY_BUCKETS 10
+
+/** Input latency histogram
+ *
+ * Time from an input event on the receiver's compositor to its delivery
+ * to the client, in ms. Bucket i counts the latencies below 2^i ms, the
+ * last bucket all the longer ones.
+ */
+struct weston_transmitter_latency {
+	uint32_t bucket[WESTON_TRANSMITTER_LATENCY_BUCKETS];
+	uint32_t count;
+	uint32_t max;
+	uint64_t sum;
+};
+
 /** The Transmitter Base API
  *
  * Transmitter is a Weston plugin that provides remoting of weston_surfaces
@@ -206,6 +232,19 @@ struct weston_transmitter_api {
 	 */
 	struct weston_surface *
 	(*get_weston_surface)(struct weston_transmitter_surface *txs);
+
+	/** Input latency of a remote since it was created
+	 *
+	 * \param remote The remote connection.
+	 * \param kind The input events to get the latency of.
+	 * \return The histogram, owned by the remote.
+	 *
+	 * Latencies are only measured once the clock of the receiver is
+	 * known from the heartbeat, with an error of half the round trip.
+	 */
+	const struct weston_transmitter_latency *
+	(*remote_get_input_latency)(struct weston_transmitter_remote *remote,
+				    enum weston_transmitter_input_kind kind);
 };
 
 static inline const struct weston_transmitter_api *
@@ -268,12 +307,22 @@ weston_get_transmitter_ivi_api(struct weston_compositor *compositor)
 
 struct renderer {
 	void (*repaint_output)(struct weston_output *base);
+	/* request an IDR/key frame on the next encoded buffer */
+	void (*force_keyframe)(struct weston_output *base);
+	/* encoder target in bit/s, applied to running and future pipelines */
+	void (*set_bitrate)(struct weston_output *base, uint32_t bitrate);
+	/* divide the encoded size, 1 for full size */
+	void (*set_scale)(struct weston_output *base, int divisor);
+	/* release the encoder session and the renderer */
+	void (*destroy)(struct weston_output *base);
 	struct GstAppContext *ctx;
 	int32_t dmafd;    /* dmafd received from compositor-drm */
 	int buf_stride;
 	int surface_width;
 	int surface_height;
 	bool recorder_enabled;
+	uint32_t bitrate; /* bit/s, 0 keeps the bitrate of the pipeline file */
+	int scale; /* divisor of the encoded size, 0 or 1 for full size */
 };
 
 #endif /* WESTON_TRANSMITTER_API_H */
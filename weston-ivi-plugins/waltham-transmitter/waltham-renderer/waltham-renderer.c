@@ -25,9 +25,11 @@
 
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 
 #include <gst/gst.h>
+#include <gst/video/video.h>
 #include <gst/video/gstvideometa.h>
 #include <gst/allocators/gstdmabuf.h>
 #include <gst/app/gstappsrc.h>
@@ -40,6 +42,12 @@
 
 struct waltham_renderer {
 	struct renderer base;
+	bool waiting; /* no encoder yet, logged once */
+	/* the pipeline of this codec cannot be built, not retried */
+	bool failed;
+	char failed_codec[16];
+	gint64 retry_time; /* g_get_monotonic_time() of the next try */
+	gint64 retry_delay; /* us */
 };
 
 struct GstAppContext
@@ -49,8 +57,40 @@ struct GstAppContext
 	GstElement *pipeline;
 	GstElement *appsrc;
 	GstBuffer *gstbuffer;
+	char codec[16]; /* remote codec the pipeline was built for */
+	GstElement *encoder; /* element with a "bitrate" property, or NULL */
+	bool encoder_kbps; /* its bitrate is in kbit/s */
+	bool software; /* built from a transmitter_pipeline_sw.cfg */
+	int32_t width, height; /* of the surface the caps were set for */
+	bool scale_logged; /* the pipeline has no scale element */
+	struct weston_transmitter_output *output;
+	struct wl_list slot_link; /* hw_sessions, empty for software */
+	gint64 slot_time; /* g_get_monotonic_time() it was taken at */
 };
 
+enum encoder_kind {
+	ENCODER_NONE = -1,
+	ENCODER_HARDWARE,
+	ENCODER_SOFTWARE,
+};
+
+/*
+ * Hardware encoder sessions of all the remote outputs. The SoC encoders
+ * take a fixed number of concurrent sessions, set by max-hw-encoder-sessions
+ * in weston.ini or learned when the hardware refuses one more.
+ */
+static int hw_max; /* 0 for no limit */
+static struct wl_list hw_sessions = { &hw_sessions, &hw_sessions };
+
+/* A session is held at least this long before it can be taken over, so
+ * that streams of alternating priorities do not rebuild their pipelines
+ * on every frame, us */
+#define ENCODER_SLOT_HOLD (2 * G_USEC_PER_SEC)
+
+/* Backoff of the retries while no hardware session is left, us */
+#define ENCODER_RETRY_MIN (G_USEC_PER_SEC / 10)
+#define ENCODER_RETRY_MAX (2 * G_USEC_PER_SEC)
+
 gboolean bus_message(GstBus *bus, GstMessage *message, gpointer p)
 {
 	struct GstAppContext *gstctx = p;
@@ -87,8 +127,133 @@ gboolean bus_message(GstBus *bus, GstMessage *message, gpointer p)
 	}
 }
 
+/* Find the encoder of the pipeline, for the bitrate set at runtime.
+ *
+ * Encoders disagree on the unit of their "bitrate" property: a value below
+ * 100000 is taken as kbit/s (x264enc, vaapi, mfx), bit/s otherwise (omx).
+ */
+static void
+gst_pipe_find_encoder(struct GstAppContext *gstctx)
+{
+	GstIterator *it;
+	GValue item = { 0 };
+	GstElement *element;
+	GParamSpec *pspec;
+	guint bitrate = 0;
+
+	it = gst_bin_iterate_recurse(GST_BIN(gstctx->pipeline));
+	while (!gstctx->encoder &&
+	       gst_iterator_next(it, &item) == GST_ITERATOR_OK) {
+		element = g_value_get_object(&item);
+		pspec = g_object_class_find_property(G_OBJECT_GET_CLASS(element),
+						     "bitrate");
+		if (pspec && G_PARAM_SPEC_VALUE_TYPE(pspec) == G_TYPE_UINT) {
+			gstctx->encoder = gst_object_ref(element);
+			g_object_get(G_OBJECT(element), "bitrate", &bitrate, NULL);
+			gstctx->encoder_kbps = bitrate < 100000;
+		}
+		g_value_unset(&item);
+	}
+	gst_iterator_free(it);
+
+	if (!gstctx->encoder)
+		weston_log("No encoder with a bitrate, bandwidth is not enforced\n");
+}
+
+static void
+gst_pipe_apply_bitrate(struct GstAppContext *gstctx, uint32_t bitrate)
+{
+	if (!gstctx->encoder || bitrate == 0)
+		return;
+
+	g_object_set(G_OBJECT(gstctx->encoder), "bitrate",
+		     gstctx->encoder_kbps ? MAX(bitrate / 1000, 1) : bitrate,
+		     NULL);
+}
+
+/* Scale the encoded picture down, through the capsfilter named "scale"
+ * which pipelines supporting it put after a videoscale element. At full
+ * size the capsfilter lets any size through.
+ */
+static void
+gst_pipe_apply_scale(struct weston_transmitter_output *output)
+{
+	struct GstAppContext *gstctx = output->renderer->ctx;
+	int divisor = output->renderer->scale > 1 ? output->renderer->scale : 1;
+	GstElement *scale;
+	GstCaps *caps;
+
+	scale = gst_bin_get_by_name(GST_BIN(gstctx->pipeline), "scale");
+	if (!scale) {
+		if (divisor > 1 && !gstctx->scale_logged)
+			weston_log("No scale element, %s keeps its size\n",
+				   output->base.name);
+		gstctx->scale_logged = divisor > 1;
+		return;
+	}
+
+	if (divisor == 1)
+		caps = gst_caps_new_any();
+	else
+		caps = gst_caps_new_simple("video/x-raw",
+					   "width", G_TYPE_INT,
+					   gstctx->width / divisor,
+					   "height", G_TYPE_INT,
+					   gstctx->height / divisor,
+					   NULL);
+	g_object_set(G_OBJECT(scale), "caps", caps, NULL);
+	gst_caps_unref(caps);
+	gst_object_unref(scale);
+}
+
+/* The pipeline file of the negotiated codec if any, the _sw variant for
+ * a software encoder.
+ */
+static FILE *
+gst_pipe_open_file(struct weston_transmitter_output *output, bool software)
+{
+	const char *suffix = software ? "_sw" : "";
+	char path[64];
+	FILE *file = NULL;
+
+	if (output->remote->codec[0]) {
+		snprintf(path, sizeof path, TRANSMITTER_PIPELINE_DIR
+			 "/transmitter_pipeline_%s%s.cfg",
+			 output->remote->codec, suffix);
+		file = fopen(path, "rb");
+	}
+	if (!file) {
+		snprintf(path, sizeof path, TRANSMITTER_PIPELINE_DIR
+			 "/transmitter_pipeline%s.cfg", suffix);
+		file = fopen(path, "rb");
+	}
+
+	return file;
+}
+
+static bool
+gst_pipe_has_software(struct weston_transmitter_output *output)
+{
+	FILE *file = gst_pipe_open_file(output, true);
+
+	if (!file)
+		return false;
+
+	fclose(file);
+	return true;
+}
+
+/** Build and start the pipeline of output.
+ *
+ * The context is set on output first, so that gst_pipe_release() frees
+ * whatever was built when this fails.
+ *
+ * \return 0 on success, -EBUSY when the hardware refused to start the
+ * pipeline, -1 when the pipeline cannot be built at all.
+ */
 static int
-gst_pipe_init(struct weston_transmitter_output *output, struct gst_settings *settings)
+gst_pipe_init(struct weston_transmitter_output *output,
+	      struct gst_settings *settings, bool software)
 {
 	struct GstAppContext *gstctx;
 	gstctx=zalloc(sizeof (*gstctx));
@@ -97,61 +262,79 @@ gst_pipe_init(struct weston_transmitter_output *output, struct gst_settings *set
 		return -1;
 	}
 	GstCaps *caps;
-	int ret = 0;
 	GError *gerror = NULL;
 	FILE * pFile;
 	long lSize;
 	char * pipe = NULL;
 	size_t res;
 
+	gstctx->output = output;
+	gstctx->software = software;
+	gstctx->width = settings->width;
+	gstctx->height = settings->height;
+	wl_list_init(&gstctx->slot_link);
+	output->renderer->ctx = gstctx;
+
 	/* create gstreamer pipeline */
 	gst_init(NULL, NULL);
 	gstctx->loop = g_main_loop_new(NULL, FALSE);
 
 	/* read pipeline from file */
-	pFile = fopen ( "/etc/xdg/weston/transmitter_pipeline.cfg" , "rb" );
+	pFile = gst_pipe_open_file(output, software);
 	if (pFile==NULL)
 	{
 		weston_log("File open error\n");
 		return -1;
 	}
+	snprintf(gstctx->codec, sizeof gstctx->codec, "%s",
+		 output->remote->codec);
 
 	/* obtain file size */
-	fseek (pFile , 0 , SEEK_END);
-	lSize = ftell (pFile);
+	if (fseek(pFile, 0, SEEK_END) < 0 || (lSize = ftell(pFile)) <= 0) {
+		weston_log("File read error\n");
+		fclose(pFile);
+		return -1;
+	}
 	rewind (pFile);
 
-	/* allocate memory to contain the whole file: */
-	pipe = (char*) zalloc (sizeof(char)*lSize);
+	/* allocate memory to contain the whole file, and its NUL */
+	pipe = (char*) zalloc (sizeof(char)*(lSize + 1));
 	if (pipe == NULL)
 	{
 		weston_log("Cannot allocate memory\n");
+		fclose(pFile);
 		return -1;
 	}
 
 	/* copy the file into the buffer: */
 	res = fread (pipe,1,lSize,pFile);
+	fclose (pFile);
 	if (res != lSize)
 	{
 		weston_log("File read error\n");
+		free(pipe);
 		return -1;
 	}
 
-	/* close file */
-	fclose (pFile);
 	weston_log("Parsing GST pipeline:%s",pipe);
 	gstctx->pipeline = gst_parse_launch(pipe, &gerror);
 	free(pipe);
-	if(!gstctx->pipeline)
-		weston_log("Could not create gstreamer pipeline.\n");
+	if (!gstctx->pipeline || gerror) {
+		weston_log("Could not create gstreamer pipeline: %s\n",
+			   gerror ? gerror->message : "unknown error");
+		g_clear_error(&gerror);
+		return -1;
+	}
 
 	gstctx->bus = gst_pipeline_get_bus((GstPipeline*)((void*)gstctx->pipeline));
-	gst_bus_add_watch(gstctx->bus, bus_message, &gstctx);
+	gst_bus_add_watch(gstctx->bus, bus_message, gstctx);
 
 	gstctx->appsrc = (GstAppSrc*)
 		gst_bin_get_by_name(GST_BIN(gstctx->pipeline), "src");
-	if (!gstctx->appsrc)
+	if (!gstctx->appsrc) {
+		weston_log("No appsrc named src in the pipeline\n");
 		return -1;
+	}
 
 	caps = gst_caps_new_simple("video/x-raw",
 				   "format", G_TYPE_STRING, "BGRx",
@@ -169,12 +352,135 @@ gst_pipe_init(struct weston_transmitter_output *output, struct gst_settings *set
 		     NULL);
 	gst_caps_unref(caps);
 
-	gst_element_set_state((GstElement*)((void*)gstctx->pipeline), GST_STATE_PLAYING);
-	output->renderer->ctx = gstctx;
+	gst_pipe_find_encoder(gstctx);
+	gst_pipe_apply_bitrate(gstctx, output->renderer->bitrate);
+	gst_pipe_apply_scale(output);
+
+	if (gst_element_set_state((GstElement*)((void*)gstctx->pipeline),
+				  GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+		weston_log("Could not start the %s encoder of %s\n",
+			   software ? "software" : "hardware", output->base.name);
+		return software ? -1 : -EBUSY;
+	}
+
+	if (!software) {
+		wl_list_insert(&hw_sessions, &gstctx->slot_link);
+		gstctx->slot_time = g_get_monotonic_time();
+	}
 
 	return 0;
 }
 
+/* Drop the pipeline, recorder_enable() builds a new one */
+static void
+gst_pipe_release(struct weston_transmitter_output *output)
+{
+	struct GstAppContext *gstctx = output->renderer->ctx;
+
+	output->renderer->recorder_enabled = 0;
+	output->renderer->ctx = NULL;
+	if (!gstctx)
+		return;
+
+	wl_list_remove(&gstctx->slot_link);
+
+	if (gstctx->pipeline) {
+		gst_element_set_state(gstctx->pipeline, GST_STATE_NULL);
+		gst_object_unref(gstctx->pipeline);
+	}
+	if (gstctx->appsrc)
+		gst_object_unref(gstctx->appsrc);
+	if (gstctx->encoder)
+		gst_object_unref(gstctx->encoder);
+	if (gstctx->bus) {
+		gst_bus_remove_watch(gstctx->bus);
+		gst_object_unref(gstctx->bus);
+	}
+	g_main_loop_unref(gstctx->loop);
+	free(gstctx);
+}
+
+static bool
+encoder_slot_free(void)
+{
+	return hw_max <= 0 || wl_list_length(&hw_sessions) < hw_max;
+}
+
+/* The lowest priority hardware stream below the priority of output, among
+ * those that held their session for ENCODER_SLOT_HOLD */
+static struct GstAppContext *
+encoder_slot_victim(struct weston_transmitter_output *output)
+{
+	struct GstAppContext *gstctx, *victim = NULL;
+	gint64 held = g_get_monotonic_time() - ENCODER_SLOT_HOLD;
+
+	wl_list_for_each(gstctx, &hw_sessions, slot_link)
+		if (gstctx->output->priority < output->priority &&
+		    gstctx->slot_time <= held &&
+		    (!victim ||
+		     gstctx->output->priority < victim->output->priority))
+			victim = gstctx;
+
+	return victim;
+}
+
+/** Pick the encoder of a new pipeline.
+ *
+ * A free hardware session is taken first. When they are all in use, a
+ * lower priority stream that held its session for ENCODER_SLOT_HOLD gives
+ * it up and moves to software on its next frame. Otherwise the stream is
+ * encoded in software, or waits for a session when there is no software
+ * pipeline.
+ */
+static enum encoder_kind
+encoder_slot_acquire(struct weston_transmitter_output *output)
+{
+	struct waltham_renderer *wth_renderer =
+		wl_container_of(output->renderer, wth_renderer, base);
+	struct GstAppContext *victim;
+
+	if (encoder_slot_free())
+		goto hardware;
+
+	victim = encoder_slot_victim(output);
+	if (victim) {
+		weston_log("%s takes the hardware encoder of %s\n",
+			   output->base.name, victim->output->base.name);
+		gst_pipe_release(victim->output);
+		goto hardware;
+	}
+
+	if (gst_pipe_has_software(output)) {
+		wth_renderer->waiting = false;
+		return ENCODER_SOFTWARE;
+	}
+
+	if (!wth_renderer->waiting)
+		weston_log("No hardware encoder left for %s, waiting\n",
+			   output->base.name);
+	wth_renderer->waiting = true;
+	return ENCODER_NONE;
+
+hardware:
+	wth_renderer->waiting = false;
+	return ENCODER_HARDWARE;
+}
+
+/* A software stream moves to hardware as soon as it can */
+static bool
+encoder_slot_upgrade(struct weston_transmitter_output *output)
+{
+	struct GstAppContext *gstctx = output->renderer->ctx;
+
+	return gstctx->software &&
+	       (encoder_slot_free() || encoder_slot_victim(output));
+}
+
+/** Build the pipeline of output on a free encoder.
+ *
+ * \return 0 on success, -EAGAIN while no hardware session is left, -1
+ * when the pipeline cannot be built.
+ */
 static int
 recorder_enable(struct weston_transmitter_output *output)
 {
@@ -183,6 +489,13 @@ recorder_enable(struct weston_transmitter_output *output)
 	struct weston_output* base = &output->base;
 	struct weston_compositor *compositor = base->compositor;
 	struct weston_transmitter_remote* remote = output->remote;
+	enum encoder_kind kind;
+	bool busy;
+	int ret;
+
+	kind = encoder_slot_acquire(output);
+	if (kind == ENCODER_NONE)
+		return -EAGAIN;
 
 	/*
 	 * Limitation:
@@ -207,9 +520,31 @@ recorder_enable(struct weston_transmitter_output *output)
 	weston_log("width = %d \n",settings->width);
 	weston_log("height = %d \n",settings->height);
 
-	gst_pipe_init(output, settings);
+	ret = gst_pipe_init(output, settings, kind == ENCODER_SOFTWARE);
+	if (ret < 0)
+		gst_pipe_release(output);
+
+	/* A valid hardware pipeline that does not start while others run:
+	 * the hardware ran out of sessions below the configured limit. */
+	if (ret == -EBUSY) {
+		busy = !wl_list_empty(&hw_sessions);
+		if (busy) {
+			hw_max = wl_list_length(&hw_sessions);
+			weston_log("Hardware encoder sessions limited to %d\n",
+				   hw_max);
+		}
 
-	return 0;
+		if (gst_pipe_has_software(output)) {
+			ret = gst_pipe_init(output, settings, true);
+			if (ret < 0)
+				gst_pipe_release(output);
+		} else {
+			ret = busy ? -EAGAIN : -1;
+		}
+	}
+
+	free(settings);
+	return ret;
 err:
 	weston_log("[gst recorder] %s:"
 		" invalid settings\n",
@@ -218,6 +553,56 @@ err:
 	return -1;
 }
 
+/** Start the encoder of output if it has none, and tell if it has one.
+ *
+ * While no hardware session is left the tries back off. A pipeline that
+ * cannot be built is not tried again until the receiver offers another
+ * codec.
+ */
+static bool
+waltham_renderer_ensure_recorder(struct weston_transmitter_output *output)
+{
+	struct waltham_renderer *wth_renderer =
+		wl_container_of(output->renderer, wth_renderer, base);
+	gint64 now;
+	int ret;
+
+	if (output->renderer->recorder_enabled)
+		return true;
+
+	if (wth_renderer->failed &&
+	    strcmp(wth_renderer->failed_codec, output->remote->codec) == 0)
+		return false;
+	wth_renderer->failed = false;
+
+	now = g_get_monotonic_time();
+	if (now < wth_renderer->retry_time)
+		return false;
+
+	ret = recorder_enable(output);
+	if (ret == -EAGAIN) {
+		wth_renderer->retry_delay =
+			MIN(MAX(wth_renderer->retry_delay * 2,
+				ENCODER_RETRY_MIN), ENCODER_RETRY_MAX);
+		wth_renderer->retry_time = now + wth_renderer->retry_delay;
+		return false;
+	}
+	if (ret < 0) {
+		weston_log("No pipeline for %s, its frames are dropped\n",
+			   output->base.name);
+		wth_renderer->failed = true;
+		snprintf(wth_renderer->failed_codec,
+			 sizeof wth_renderer->failed_codec, "%s",
+			 output->remote->codec);
+		return false;
+	}
+
+	wth_renderer->retry_delay = 0;
+	wth_renderer->retry_time = 0;
+	output->renderer->recorder_enabled = 1;
+	return true;
+}
+
 static void waltham_renderer_repaint_output(struct weston_transmitter_output *output)
 {
 	GstBuffer *gstbuffer;
@@ -226,11 +611,24 @@ static void waltham_renderer_repaint_output(struct weston_transmitter_output *ou
 	int stride = output->renderer->buf_stride;
 	gsize offset = 0;
 
-	if(!output->renderer->recorder_enabled)
-	{
-		recorder_enable(&output->base);
-		output->renderer->recorder_enabled = 1;
-	}
+	/* The receiver may offer another codec after a reconnection */
+	if (output->renderer->recorder_enabled && output->renderer->ctx &&
+	    strcmp(output->renderer->ctx->codec, output->remote->codec) != 0)
+		gst_pipe_release(output);
+
+	if (output->renderer->recorder_enabled && output->renderer->ctx &&
+	    encoder_slot_upgrade(output))
+		gst_pipe_release(output);
+
+	/* The caps of appsrc and of the scale step follow the surface size */
+	if (output->renderer->recorder_enabled && output->renderer->ctx &&
+	    (output->renderer->ctx->width != output->renderer->surface_width ||
+	     output->renderer->ctx->height != output->renderer->surface_height))
+		gst_pipe_release(output);
+
+	/* Without an encoder the frame is dropped */
+	if (!waltham_renderer_ensure_recorder(output))
+		return;
 
 	gstbuffer = gst_buffer_new();
 	allocator = gst_dmabuf_allocator_new();
@@ -250,6 +648,64 @@ static void waltham_renderer_repaint_output(struct weston_transmitter_output *ou
 	gst_object_unref(allocator);
 }
 
+static void waltham_renderer_force_keyframe(struct weston_output *base)
+{
+	struct weston_transmitter_output *output =
+		wl_container_of(base, output, base);
+	struct GstAppContext *gstctx = output->renderer->ctx;
+
+	/* Nothing encoded yet, the first frame is a key frame anyway */
+	if (!output->renderer->recorder_enabled || !gstctx || !gstctx->pipeline)
+		return;
+
+	/* Sent to the pipeline, the event travels upstream from the sink
+	 * and is honoured by the encoder on the next buffer.
+	 */
+	gst_element_send_event(gstctx->pipeline,
+			       gst_video_event_new_upstream_force_key_unit(
+					GST_CLOCK_TIME_NONE, TRUE, 0));
+}
+
+static void waltham_renderer_set_bitrate(struct weston_output *base,
+					 uint32_t bitrate)
+{
+	struct weston_transmitter_output *output =
+		wl_container_of(base, output, base);
+
+	/* kept for the pipeline built on the first frame */
+	output->renderer->bitrate = bitrate;
+	if (output->renderer->recorder_enabled && output->renderer->ctx)
+		gst_pipe_apply_bitrate(output->renderer->ctx, bitrate);
+}
+
+static void waltham_renderer_set_scale(struct weston_output *base, int divisor)
+{
+	struct weston_transmitter_output *output =
+		wl_container_of(base, output, base);
+
+	output->renderer->scale = divisor;
+	if (output->renderer->recorder_enabled && output->renderer->ctx)
+		gst_pipe_apply_scale(output);
+}
+
+static void waltham_renderer_destroy(struct weston_output *base)
+{
+	struct weston_transmitter_output *output =
+		wl_container_of(base, output, base);
+	struct waltham_renderer *wth_renderer =
+		wl_container_of(output->renderer, wth_renderer, base);
+
+	gst_pipe_release(output);
+	output->renderer = NULL;
+	free(wth_renderer);
+}
+
+static void
+waltham_renderer_set_hw_sessions(int max)
+{
+	hw_max = max;
+}
+
 static int
 waltham_renderer_display_create(struct weston_transmitter_output *output)
 {
@@ -259,6 +715,10 @@ waltham_renderer_display_create(struct weston_transmitter_output *output)
 	if (wth_renderer == NULL)
 		return -1;
 	wth_renderer->base.repaint_output = waltham_renderer_repaint_output;
+	wth_renderer->base.force_keyframe = waltham_renderer_force_keyframe;
+	wth_renderer->base.set_bitrate = waltham_renderer_set_bitrate;
+	wth_renderer->base.set_scale = waltham_renderer_set_scale;
+	wth_renderer->base.destroy = waltham_renderer_destroy;
 
 	output->renderer = &wth_renderer->base;
 
@@ -266,5 +726,6 @@ waltham_renderer_display_create(struct weston_transmitter_output *output)
 }
 
 WL_EXPORT struct waltham_renderer_interface waltham_renderer_interface = {
-		.display_create = waltham_renderer_display_create
+		.display_create = waltham_renderer_display_create,
+		.set_hw_sessions = waltham_renderer_set_hw_sessions
 };
@@ -26,8 +26,15 @@
 #ifndef TRANSMITTER_WALTHAM_RENDERER_H_
 #define TRANSMITTER_WALTHAM_RENDERER_H_
 
+/* location of transmitter_pipeline.cfg and transmitter_pipeline_<codec>.cfg,
+ * and of their _sw variants for software encoding
+ */
+#define TRANSMITTER_PIPELINE_DIR "/etc/xdg/weston"
+
 struct waltham_renderer_interface {
 	int (*display_create)(struct weston_transmitter_output *output);
+	/* hardware encoder sessions shared by all outputs, 0 for no limit */
+	void (*set_hw_sessions)(int max);
 };
 
 struct gst_settings {